@@ -0,0 +1,136 @@
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+
+#include "../source/mini_cnn.h"
+
+using namespace std;
+using namespace mini_cnn;
+
+/*
+	closed loop load generator for inference_session
+
+	every client thread sends one request, waits for its answer and sends the
+	next one, so the offered load grows with the client count. for each
+	batching setting and client count it reports throughput, p50 / p99
+	latency and the mean batch size actually formed.
+*/
+
+std::mt19937_64 global_setting::m_rand_generator = std::mt19937_64(1);
+
+network create_cnn()
+{
+	network nn;
+	nn.add_layer(new input_layer(28, 28, 1));
+	nn.add_layer(new convolutional_layer(3, 3, 1, 32, 1, 1, padding_type::eValid, activation_type::eRelu));
+	nn.add_layer(new max_pooling_layer(2, 2, 2, 2));
+	nn.add_layer(new convolutional_layer(3, 3, 32, 64, 1, 1, padding_type::eValid, activation_type::eRelu));
+	nn.add_layer(new max_pooling_layer(2, 2, 2, 2));
+	nn.add_layer(new fully_connected_layer(1024, activation_type::eRelu));
+	nn.add_layer(new output_layer(10, lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax));
+	return nn;
+}
+
+struct load_result
+{
+	double m_throughput;  // requests per second
+	double m_p50_us;
+	double m_p99_us;
+	double m_mean_batch;
+};
+
+load_result run_load(inference_session &session, const varray_vec &inputs, nn_int clients, nn_int requests_per_client)
+{
+	typedef std::chrono::steady_clock clock_type;
+	std::vector<std::vector<double>> latencies(clients);
+	session.reset_histograms();
+
+	auto t0 = clock_type::now();
+	std::vector<std::thread> threads;
+	for (nn_int c = 0; c < clients; ++c)
+	{
+		threads.push_back(std::thread([&, c]() {
+			latencies[c].reserve(requests_per_client);
+			for (nn_int i = 0; i < requests_per_client; ++i)
+			{
+				const varray &input = *inputs[(c * requests_per_client + i) % inputs.size()];
+				auto start = clock_type::now();
+				varray output = session.predict(input).get();
+				auto end = clock_type::now();
+				latencies[c].push_back(std::chrono::duration<double, std::micro>(end - start).count());
+			}
+		}));
+	}
+	for (auto &t : threads)
+	{
+		t.join();
+	}
+	double elapsed = std::chrono::duration<double>(clock_type::now() - t0).count();
+
+	std::vector<double> all;
+	for (auto &v : latencies)
+	{
+		all.insert(all.end(), v.begin(), v.end());
+	}
+	std::sort(all.begin(), all.end());
+
+	std::vector<long long> hist = session.batch_size_histogram();
+	long long batches = 0;
+	long long samples = 0;
+	for (size_t k = 0; k < hist.size(); ++k)
+	{
+		batches += hist[k];
+		samples += hist[k] * k;
+	}
+
+	load_result r;
+	r.m_throughput = all.size() / elapsed;
+	r.m_p50_us = all[all.size() / 2];
+	r.m_p99_us = all[std::min(all.size() - 1, all.size() * 99 / 100)];
+	r.m_mean_batch = batches > 0 ? 1.0 * samples / batches : 0;
+	return r;
+}
+
+int main()
+{
+	network nn = create_cnn();
+	he_normal_initializer initializer;
+	nn.init_all_weight(initializer);
+	inference_plan plan = nn.compile_for_inference();
+
+	uniform_random rand(0, 1);
+	varray_vec inputs;
+	for (nn_int i = 0; i < 256; ++i)
+	{
+		varray *img = new varray(28, 28, 1);
+		for (nn_int j = 0; j < img->size(); ++j)
+		{
+			(*img)[j] = rand.get_random();
+		}
+		inputs.push_back(img);
+	}
+
+	const nn_int requests_per_client = 400;
+	const nn_int max_batches[] = { 1, 8, 32 };
+	const nn_int client_counts[] = { 1, 4, 16, 64 };
+	const nn_int max_delay_us = 2000;
+
+	cout << setw(10) << "max_batch" << setw(10) << "clients" << setw(14) << "req/s"
+		<< setw(12) << "p50(us)" << setw(12) << "p99(us)" << setw(12) << "mean_batch" << endl;
+	for (nn_int max_batch : max_batches)
+	{
+		inference_session session(plan, max_batch, max_delay_us, 1);
+		for (nn_int clients : client_counts)
+		{
+			load_result r = run_load(session, inputs, clients, requests_per_client);
+			cout << setw(10) << max_batch << setw(10) << clients << setw(14) << fixed << setprecision(0) << r.m_throughput
+				<< setw(12) << r.m_p50_us << setw(12) << r.m_p99_us << setw(12) << setprecision(2) << r.m_mean_batch << endl;
+		}
+	}
+
+	for (auto img : inputs)
+	{
+		delete img;
+	}
+	return 0;
+}
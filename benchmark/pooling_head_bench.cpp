@@ -0,0 +1,84 @@
+#include <iostream>
+#include <iomanip>
+
+#include "../source/mini_cnn.h"
+
+using namespace std;
+using namespace mini_cnn;
+
+/*
+	flatten + fully connected head against an all convolutional head on mnist
+
+	both nets share the conv / pool body. the fc head flattens the 5x5x64
+	maps into a 1024 unit layer, the gap head uses a 1x1 convolution to 128
+	channels and global_avg_pooling_layer. for each head it reports the
+	parameter count, the mean time of one minibatch step and the test
+	accuracy after every epoch.
+*/
+
+std::mt19937_64 global_setting::m_rand_generator = std::mt19937_64(1);
+
+void add_body(network &nn, const dataset_source &data_set)
+{
+	nn.add_layer(new input_layer(data_set.width(), data_set.height(), data_set.depth()));
+	nn.add_layer(new convolutional_layer(3, 3, data_set.depth(), 32, 1, 1, padding_type::eValid, activation_type::eRelu));
+	nn.add_layer(new max_pooling_layer(2, 2, 2, 2));
+	nn.add_layer(new convolutional_layer(3, 3, 32, 64, 1, 1, padding_type::eValid, activation_type::eRelu));
+	nn.add_layer(new max_pooling_layer(2, 2, 2, 2));
+}
+
+network create_fc_head(const dataset_source &data_set)
+{
+	network nn;
+	add_body(nn, data_set);
+	nn.add_layer(new fully_connected_layer(1024, activation_type::eRelu));
+	nn.add_layer(new output_layer(data_set.class_count(), lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax));
+	return nn;
+}
+
+network create_gap_head(const dataset_source &data_set)
+{
+	network nn;
+	add_body(nn, data_set);
+	nn.add_layer(new convolutional_layer(1, 1, 64, 128, 1, 1, padding_type::eValid, activation_type::eRelu));
+	nn.add_layer(new global_avg_pooling_layer());
+	nn.add_layer(new output_layer(data_set.class_count(), lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax));
+	return nn;
+}
+
+int main(int argc, char **argv)
+{
+	std::string data_path = argc > 1 ? argv[1] : "../../dataset/mnist/";
+	idx_dataset train_set;
+	idx_dataset test_set;
+	if (!train_set.open(data_path + "train-images.idx3-ubyte", data_path + "train-labels.idx1-ubyte")
+		|| !test_set.open(data_path + "t10k-images.idx3-ubyte", data_path + "t10k-labels.idx1-ubyte"))
+	{
+		return -1;
+	}
+
+	const nn_int epoch = 3;
+	const nn_int batch_size = 32;
+	const nn_float learning_rate = 0.05f;
+	const nn_int nthreads = 4;
+	nn_int steps = train_set.count() / batch_size;
+
+	const char *names[] = { "fc", "gap" };
+	for (nn_int head = 0; head < 2; ++head)
+	{
+		global_setting::m_rand_generator.seed(1);
+		network nn = head == 0 ? create_fc_head(train_set) : create_gap_head(train_set);
+		he_normal_initializer initializer;
+		nn.init_all_weight(initializer);
+		cout << names[head] << " head, paramters: " << nn.paramters_count() << endl;
+
+		nn.SGD(train_set, test_set, epoch, batch_size, learning_rate, nthreads
+			, [](nn_int, nn_int) {}
+			, [&](nn_int c, nn_int, nn_float accuracy, nn_float cost, nn_float train_elapse, nn_float)
+		{
+			cout << "  epoch " << c << setw(12) << fixed << setprecision(3) << train_elapse * 1000 / steps << " ms/step"
+				<< setw(10) << setprecision(2) << accuracy * 100 << "% accuracy" << setw(10) << setprecision(4) << cost << " cost" << endl;
+		});
+	}
+	return 0;
+}
@@ -1,7 +1,6 @@
 #include <iostream>
 
 #include "source/mini_cnn.h"
-#include "source/mnist_dataset_parser.h"
 
 using namespace std;
 using namespace mini_cnn;
@@ -53,39 +52,39 @@ public:
 
 };
 
-network create_fnn()
+network create_fnn(const dataset_source &data_set)
 {
 	network nn;
-	nn.add_layer(new input_layer(N_inputCount));
+	nn.add_layer(new input_layer(data_set.sample_size()));
 	nn.add_layer(new fully_connected_layer(100, activation_type::eRelu));
 	nn.add_layer(new fully_connected_layer(30, activation_type::eRelu));
-	nn.add_layer(new output_layer(C_classCount, lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax));
+	nn.add_layer(new output_layer(data_set.class_count(), lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax));
 	return nn;
 }
 
-network create_cnn_small()
+network create_cnn_small(const dataset_source &data_set)
 {
 	network nn;
-	nn.add_layer(new input_layer(W_input, H_input, D_input));
-	nn.add_layer(new convolutional_layer(3, 3, 1, 4, 1, 1, padding_type::eValid, activation_type::eRelu));
+	nn.add_layer(new input_layer(data_set.width(), data_set.height(), data_set.depth()));
+	nn.add_layer(new convolutional_layer(3, 3, data_set.depth(), 4, 1, 1, padding_type::eValid, activation_type::eRelu));
 	nn.add_layer(new max_pooling_layer(2, 2, 2, 2));
 	nn.add_layer(new convolutional_layer(3, 3, 4, 8, 1, 1, padding_type::eValid, activation_type::eRelu));
 	nn.add_layer(new max_pooling_layer(2, 2, 2, 2));
 	nn.add_layer(new fully_connected_layer(32, activation_type::eRelu));
-	nn.add_layer(new output_layer(C_classCount, lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax));
+	nn.add_layer(new output_layer(data_set.class_count(), lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax));
 	return nn;
 }
 
-network create_cnn()
+network create_cnn(const dataset_source &data_set)
 {
 	network nn;
-	nn.add_layer(new input_layer(W_input, H_input, D_input));
-	nn.add_layer(new convolutional_layer(3, 3, 1, 32, 1, 1, padding_type::eValid, activation_type::eRelu));
+	nn.add_layer(new input_layer(data_set.width(), data_set.height(), data_set.depth()));
+	nn.add_layer(new convolutional_layer(3, 3, data_set.depth(), 32, 1, 1, padding_type::eValid, activation_type::eRelu));
 	nn.add_layer(new max_pooling_layer(2, 2, 2, 2));
 	nn.add_layer(new convolutional_layer(3, 3, 32, 64, 1, 1, padding_type::eValid, activation_type::eRelu));
 	nn.add_layer(new max_pooling_layer(2, 2, 2, 2));
 	nn.add_layer(new fully_connected_layer(1024, activation_type::eRelu));
-	nn.add_layer(new output_layer(C_classCount, lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax));
+	nn.add_layer(new output_layer(data_set.class_count(), lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax));
 	return nn;
 }
 
@@ -95,18 +94,18 @@ std::mt19937_64 global_setting::m_rand_generator = std::mt19937_64(get_now_ms())
 
 int main()
 {
-	varray_vec img_vec;
-	varray_vec lab_vec;
-	varray_vec test_img_vec;
-	index_vec test_lab_vec;
-
+	// same format for "../../dataset/fashion/", see cifar10_dataset / record_dataset for other sets
 	std::string relate_data_path = "../../dataset/mnist/";
-	mnist_dataset_parser mnist(relate_data_path, "train-images.idx3-ubyte", "train-labels.idx1-ubyte"
-		, "t10k-images.idx3-ubyte", "t10k-labels.idx1-ubyte");
-	mnist.read_dataset(img_vec, lab_vec, test_img_vec, test_lab_vec);
+	idx_dataset train_set;
+	idx_dataset test_set;
+	if (!train_set.open(relate_data_path + "train-images.idx3-ubyte", relate_data_path + "train-labels.idx1-ubyte")
+		|| !test_set.open(relate_data_path + "t10k-images.idx3-ubyte", relate_data_path + "t10k-labels.idx1-ubyte"))
+	{
+		return -1;
+	}
 
 	// define neural network
-	network nn = create_cnn();
+	network nn = create_cnn(train_set);
 
 	cout << "total paramters count:" << nn.paramters_count() << endl;
 
@@ -141,7 +140,7 @@ int main()
 
 	auto t0 = get_now_ms();
 
-	nn_float max_accuracy = nn.SGD(img_vec, lab_vec, test_img_vec, test_lab_vec, epoch, batch_size, learning_rate, nthreads, minibatch_callback, epoch_callback);
+	nn_float max_accuracy = nn.SGD(train_set, test_set, epoch, batch_size, learning_rate, nthreads, minibatch_callback, epoch_callback);
 
 	cout << "max_accuracy: " << max_accuracy << endl;
 
@@ -23,6 +23,15 @@ public:
 		nn_assert(stride_h > 0 && stride_h <= pool_h);
 	}
 
+	virtual void describe(layer_desc &desc) const
+	{
+		desc.m_type = layer_type::eAvgPoolingLayer;
+		desc.m_args[0] = m_pool_w;
+		desc.m_args[1] = m_pool_h;
+		desc.m_args[2] = m_stride_w;
+		desc.m_args[3] = m_stride_h;
+	}
+
 	virtual void connect(layer_base *next)
 	{
 		layer_base::connect(next);
@@ -37,7 +46,7 @@ public:
 		m_out_shape.set(out_w, out_h, in_d);
 	}
 
-	virtual void set_task_count(nn_int task_count)
+	virtual void alloc_task_storage(memory_arena &arena, nn_int task_idx)
 	{
 		nn_int in_w = m_prev->m_out_shape.m_w;
 		nn_int in_h = m_prev->m_out_shape.m_h;
@@ -47,19 +56,16 @@ public:
 		nn_int out_h = m_out_shape.m_h;
 		nn_int out_d = m_out_shape.m_d;
 
-		m_task_storage.resize(task_count);
-		for (auto& ts : m_task_storage)
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		if (!m_out_shape.is_img())
 		{
-			if (!m_out_shape.is_img())
-			{
-				ts.m_x.resize(out_w * out_h * out_d);
-			}
-			else
-			{
-				ts.m_x.resize(out_w, out_h, out_d);
-			}
-			ts.m_wd.resize(in_w, in_h, in_d);
+			arena.alloc(ts.m_x, storage_type::eOutput, out_w * out_h * out_d);
 		}
+		else
+		{
+			arena.alloc(ts.m_x, storage_type::eOutput, out_w, out_h, out_d);
+		}
+		alloc_wd(arena, task_idx, in_w, in_h, in_d);
 	}
 
 	virtual void forw_prop(const varray &input, nn_int task_idx)
@@ -67,11 +73,6 @@ public:
 		varray &out_x = m_task_storage[task_idx].m_x;
 
 		down_sample(input, out_x, m_pool_w, m_pool_h, m_stride_w, m_stride_h);
-
-		if (m_next != nullptr)
-		{
-			m_next->forw_prop(out_x, task_idx);
-		}
 	}
 
 	virtual void back_prop(const varray &next_wd, nn_int task_idx)
@@ -83,9 +84,6 @@ public:
 		nn_int in_sz = input.size();
 
 		up_sample(next_wd, ts.m_wd, m_pool_w, m_pool_h, m_stride_w, m_stride_h);
-
-		m_prev->back_prop(ts.m_wd, task_idx);
-
 	}
 
 private:
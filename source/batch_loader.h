@@ -0,0 +1,326 @@
+#ifndef __BATCH_LOADER_H__
+#define __BATCH_LOADER_H__
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <algorithm>
+
+namespace mini_cnn
+{
+
+/*
+	one assembled minibatch, images in one contiguous buffer (sample after sample)
+	with per-sample views for train_one_batch, labels as class indices
+*/
+class data_batch
+{
+public:
+	varray m_images;
+	varray_vec m_img_vec;
+	index_vec m_label_idx;
+
+	void create(nn_int batch_size, nn_int sample_size)
+	{
+		m_images.resize(sample_size, batch_size);
+		m_img_views.resize(batch_size);
+		for (nn_int k = 0; k < batch_size; ++k)
+		{
+			m_img_views[k].attach(&m_images[k * sample_size], sample_size, 1, 1, 1);
+		}
+		set_size(batch_size);
+	}
+
+	// the last batch of a pass may be short
+	void set_size(nn_int size)
+	{
+		nn_assert(size <= (nn_int)m_img_views.size());
+		m_img_vec.resize(size);
+		m_label_idx.resize(size);
+		for (nn_int k = 0; k < size; ++k)
+		{
+			m_img_vec[k] = &m_img_views[k];
+		}
+	}
+
+	nn_int batch_size() const
+	{
+		return (nn_int)m_img_vec.size();
+	}
+
+	varray& image(nn_int k)
+	{
+		return m_img_views[k];
+	}
+
+private:
+	std::vector<varray> m_img_views;
+};
+
+/*
+	prepares the next minibatches on dedicated threads while the current one trains
+
+	there are prefetch_count + 1 batch buffers used as a ring, batch i is always
+	assembled in slot i % slot_count. a loader thread takes the next batch index
+	and waits until its slot was released by the consumer (backpressure), so at
+	most prefetch_count batches are ready ahead of training. batches come out of
+	next() in order, the result does not depend on the number of loader threads.
+
+	random access sources are gathered in a (shuffled) index order by all loader
+	threads at once, sequential sources are read in batch order, one batch at a
+	time, while conversion and augmentation still overlap.
+
+	an optional augment_pipeline runs on the loader threads right after a
+	sample is written into the batch buffer, each thread has its own context.
+
+	usage per epoch:
+		nn_int batch_count = loader.start_epoch(sample_count, shuffle, seed);
+		for (i = 0; i < batch_count; ++i)
+		{
+			data_batch &b = loader.next();
+			train_one_batch(b.m_img_vec, b.m_label_idx, ...);
+			loader.release();
+		}
+*/
+class batch_loader
+{
+private:
+	enum slot_state
+	{
+		eFree,
+		eFilling,
+		eReady,
+	};
+
+	struct slot
+	{
+		data_batch m_batch;
+		slot_state m_state;
+		nn_int m_batch_idx;
+	};
+
+	dataset_source &m_data_set;
+	const augment_pipeline *m_augment;
+	nn_int m_batch_size;
+	std::vector<augment_context> m_contexts;
+	std::vector<slot> m_slots;
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_produce_cv;
+	std::condition_variable m_consume_cv;
+	std::mutex m_read_mutex;
+	std::condition_variable m_read_cv;
+
+	std::vector<nn_int> m_order;
+	nn_int m_sample_count;
+	nn_int m_batch_count;
+	nn_int m_next_produce;
+	nn_int m_next_consume;
+	nn_int m_next_read;
+	nn_int m_epoch;
+	bool m_stop;
+
+public:
+	batch_loader(dataset_source &data_set, nn_int batch_size, nn_int prefetch_count = 2, nn_int nthreads = 1
+		, const augment_pipeline *augment = nullptr)
+		: m_data_set(data_set), m_augment(augment), m_batch_size(batch_size), m_sample_count(0), m_batch_count(0)
+		, m_next_produce(0), m_next_consume(0), m_next_read(0), m_epoch(-1), m_stop(false)
+	{
+		nn_assert(batch_size > 0 && prefetch_count > 0 && nthreads > 0);
+		m_slots.resize(prefetch_count + 1);
+		for (auto &s : m_slots)
+		{
+			s.m_batch.create(batch_size, data_set.sample_size());
+			s.m_state = eFree;
+			s.m_batch_idx = -1;
+		}
+		m_contexts.resize(nthreads);
+		for (nn_int k = 0; k < nthreads; ++k)
+		{
+			m_contexts[k].create(data_set.width(), data_set.height(), data_set.depth());
+			m_threads.push_back(std::thread([this, k]() { load_loop(m_contexts[k]); }));
+		}
+	}
+
+	~batch_loader()
+	{
+		stop();
+	}
+
+	batch_loader(const batch_loader&) = delete;
+	batch_loader& operator=(const batch_loader&) = delete;
+
+	// the next start_epoch is epoch number epoch (augmentation positions depend on it)
+	void set_epoch(nn_int epoch)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_epoch = epoch - 1;
+	}
+
+	/*
+		starts a pass over the first sample_count samples of the (shuffled) order,
+		returns the number of batches, the last one holds the remainder.
+		first_batch resumes an interrupted pass, next() starts with that batch,
+		a sequential source has to read through the skipped records.
+	*/
+	nn_int start_epoch(nn_int sample_count, bool shuffle, unsigned long long seed, nn_int first_batch = 0)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		nn_assert(m_next_consume == m_batch_count);
+		nn_assert(sample_count <= m_data_set.count());
+		if (m_data_set.is_random_access())
+		{
+			nn_int count = m_data_set.count();
+			m_order.resize(count);
+			for (nn_int k = 0; k < count; ++k)
+			{
+				m_order[k] = k;
+			}
+			if (shuffle)
+			{
+				std::mt19937_64 rng(seed);
+				std::shuffle(m_order.begin(), m_order.end(), rng);
+			}
+			m_data_set.advise_order(shuffle);
+		}
+		else
+		{
+			m_data_set.begin_pass(seed, shuffle);
+		}
+		m_sample_count = sample_count;
+		m_batch_count = (sample_count + m_batch_size - 1) / m_batch_size;
+		nn_assert(first_batch >= 0 && first_batch <= m_batch_count);
+		if (!m_data_set.is_random_access())
+		{
+			nn_int skip = std::min(sample_count, first_batch * m_batch_size);
+			nn_int lab = 0;
+			for (nn_int k = 0; k < skip; ++k)
+			{
+				m_data_set.read_next(lab);
+			}
+		}
+		m_next_produce = first_batch;
+		m_next_consume = first_batch;
+		m_next_read = first_batch;
+		++m_epoch;
+		lock.unlock();
+		m_produce_cv.notify_all();
+		return m_batch_count;
+	}
+
+	// blocks until the next batch in order is assembled
+	data_batch& next()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		nn_assert(m_next_consume < m_batch_count);
+		slot &s = m_slots[m_next_consume % m_slots.size()];
+		m_consume_cv.wait(lock, [&]() { return s.m_state == eReady && s.m_batch_idx == m_next_consume; });
+		return s.m_batch;
+	}
+
+	// hands the batch returned by next() back to the loader threads
+	void release()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		slot &s = m_slots[m_next_consume % m_slots.size()];
+		s.m_state = eFree;
+		++m_next_consume;
+		lock.unlock();
+		m_produce_cv.notify_all();
+	}
+
+	void stop()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_stop = true;
+		lock.unlock();
+		m_produce_cv.notify_all();
+		for (auto &t : m_threads)
+		{
+			if (t.joinable())
+			{
+				t.join();
+			}
+		}
+		m_threads.clear();
+	}
+
+private:
+	void load_loop(augment_context &ctx)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true)
+		{
+			m_produce_cv.wait(lock, [&]() {
+				return m_stop || (m_next_produce < m_batch_count
+					&& m_slots[m_next_produce % m_slots.size()].m_state == eFree);
+			});
+			if (m_stop)
+			{
+				return;
+			}
+
+			nn_int batch_idx = m_next_produce++;
+			slot &s = m_slots[batch_idx % m_slots.size()];
+			s.m_state = eFilling;
+			s.m_batch_idx = batch_idx;
+
+			lock.unlock();
+			fill(s.m_batch, batch_idx, ctx);
+			lock.lock();
+
+			s.m_state = eReady;
+			m_consume_cv.notify_all();
+		}
+	}
+
+	// gather, convert to nn_float, normalize and augment straight into the batch buffers
+	void fill(data_batch &batch, nn_int batch_idx, augment_context &ctx)
+	{
+		nn_int begin = batch_idx * m_batch_size;
+		nn_int size = std::min(m_batch_size, m_sample_count - begin);
+		batch.set_size(size);
+
+		if (m_data_set.is_random_access())
+		{
+			for (nn_int k = 0; k < size; ++k)
+			{
+				nn_int j = m_order[begin + k];
+				m_data_set.get_image(j, batch.image(k));
+				batch.m_label_idx[k] = m_data_set.label(j);
+			}
+		}
+		else
+		{
+			// wait for the turn of this batch, the source can only be read in order
+			std::unique_lock<std::mutex> lock(m_read_mutex);
+			m_read_cv.wait(lock, [&]() { return m_next_read == batch_idx; });
+			for (nn_int k = 0; k < size; ++k)
+			{
+				nn_int lab = 0;
+				const unsigned char *pixels = m_data_set.read_next(lab);
+				nn_assert(pixels != nullptr);
+				dataset_source::decode_image(pixels, batch.image(k));
+				batch.m_label_idx[k] = lab;
+			}
+			++m_next_read;
+			lock.unlock();
+			m_read_cv.notify_all();
+		}
+
+		if (m_augment != nullptr && !m_augment->empty())
+		{
+			for (nn_int k = 0; k < size; ++k)
+			{
+				unsigned long long sample_pos = (unsigned long long)m_epoch * m_data_set.count() + begin + k;
+				m_augment->run(batch.image(k), sample_pos, ctx);
+			}
+		}
+	}
+};
+
+}
+
+#endif //__BATCH_LOADER_H__
@@ -0,0 +1,416 @@
+#ifndef __BATCH_NORM_LAYER_H__
+#define __BATCH_NORM_LAYER_H__
+
+#include <cmath>
+#include <vector>
+#include <cstring>
+
+namespace mini_cnn
+{
+
+/*
+	batch normalization per channel (depth of an image, every value of a vector)
+
+	z = gamma * (x - mean) / sqrt(var + epsilon) + beta
+	x = f(z)
+
+	gamma is m_w (starts at 1), beta is m_b. in training mean / var are the
+	statistics of the whole minibatch and the gradient flows through them, the
+	network runs the samples in stages with a barrier at every batch norm layer
+	(see network::train_stages):
+		collect_input, reduce_input        inputs of all samples, batch mean / var
+		forward_sample                     normalize one kept input
+		collect_delta, reduce_delta        deltas of all samples and their batch sums
+		backward_sample                    input gradient of one sample
+	the inputs and deltas of the minibatch are kept, batch size X input size each.
+
+	the running mean / var in m_stats (mean in row 0, var in row 1) follow the
+	batch statistics, stats = momentum * stats + (1 - momentum) * batch stats,
+	starting at mean 0, var 1. forw_prop normalizes with them, at inference the
+	layer is one scale and shift per channel, the inference plan folds it into a
+	preceding conv / fc layer with eIdentity activation.
+*/
+class batch_norm_layer : public layer_base
+{
+protected:
+	activation_type m_activation_type;
+	active_func m_f;
+	active_func m_df;
+	nn_float m_momentum;
+	nn_float m_epsilon;
+	nn_int m_channels;
+	nn_int m_spatial;  // values per channel
+
+	varray m_batch_x;      // input size X batch size, the inputs of the minibatch
+	varray m_batch_delta;  // input size X batch size, the deltas of the minibatch
+	varray m_batch_stats;  // channels X 4: mean, var, mean of delta, mean of delta * x_hat
+	nn_int m_batch_count;  // values per channel in the minibatch, 0 once the running statistics took it
+
+	struct norm_task_storage
+	{
+		_varray<double> m_sums;  // channels X 2, sums of the task's samples
+		nn_int m_count;          // values summed per channel
+
+		norm_task_storage() : m_count(0)
+		{
+		}
+	};
+	std::vector<norm_task_storage> m_norm_task_storage;
+
+public:
+	batch_norm_layer(activation_type ac_type = activation_type::eIdentity, nn_float momentum = 0.99f, nn_float epsilon = 1e-5f)
+		: layer_base()
+		, m_activation_type(ac_type)
+		, m_momentum(momentum)
+		, m_epsilon(epsilon)
+		, m_channels(0)
+		, m_spatial(0)
+		, m_batch_count(0)
+	{
+		nn_assert(momentum >= 0 && momentum < 1 && epsilon > 0);
+		switch (ac_type)
+		{
+		case activation_type::eSigmod:
+			m_f = sigmoid;
+			m_df = deriv_sigmoid;
+			break;
+		case activation_type::eRelu:
+			m_f = relu;
+			m_df = deriv_relu;
+			break;
+		case activation_type::eIdentity:
+			m_f = identity;
+			m_df = deriv_identity;
+			break;
+		default:
+			nn_assert(false);
+			break;
+		}
+	}
+
+	// args[1]: momentum in millionths
+	virtual void describe(layer_desc &desc) const
+	{
+		desc.m_type = layer_type::eBatchNormLayer;
+		desc.m_args[0] = m_activation_type;
+		desc.m_args[1] = (nn_int)std::lround(m_momentum * 1e6);
+		desc.m_prob = m_epsilon;
+	}
+
+	activation_type get_activation_type() const
+	{
+		return m_activation_type;
+	}
+
+	nn_int channels() const
+	{
+		return m_channels;
+	}
+
+	// gamma scales the normalized input, decaying it towards 0 would undo the normalization
+	virtual bool decays_weight() const
+	{
+		return false;
+	}
+
+	virtual void connect(layer_base *next)
+	{
+		layer_base::connect(next);
+		m_out_shape = m_prev->m_out_shape;
+		m_channels = m_out_shape.is_img() ? m_out_shape.m_d : m_out_shape.size();
+		m_spatial = m_out_shape.size() / m_channels;
+		m_w.resize(m_channels);
+		m_b.resize(m_channels);
+		m_stats.resize(m_channels, 2);
+		m_batch_stats.resize(m_channels, 4);
+		init_fixed_weight();
+		for (nn_int k = 0; k < m_channels; ++k)
+		{
+			m_stats(k, 0) = 0;
+			m_stats(k, 1) = cOne;
+		}
+	}
+
+	virtual void init_fixed_weight()
+	{
+		for (nn_int k = 0; k < m_channels; ++k)
+		{
+			m_w[k] = cOne;
+			m_b[k] = 0;
+		}
+	}
+
+	virtual void set_task_count(nn_int task_count)
+	{
+		m_task_storage.resize(task_count);
+		m_norm_task_storage.resize(task_count);
+	}
+
+	virtual void alloc_task_storage(memory_arena &arena, nn_int task_idx)
+	{
+		nn_int w = m_out_shape.m_w;
+		nn_int h = m_out_shape.m_h;
+		nn_int d = m_out_shape.m_d;
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		arena.alloc(ts.m_dw, storage_type::eBackward, m_channels);
+		arena.alloc(ts.m_db, storage_type::eBackward, m_channels);
+		if (!m_out_shape.is_img())
+		{
+			alloc_z(arena, task_idx, m_activation_type, m_out_shape.size());
+			arena.alloc(ts.m_x, storage_type::eOutput, m_out_shape.size());
+		}
+		else
+		{
+			alloc_z(arena, task_idx, m_activation_type, w, h, d);
+			arena.alloc(ts.m_x, storage_type::eOutput, w, h, d);
+		}
+		arena.alloc(ts.m_delta, storage_type::eBackward, w, h, d);
+		alloc_wd(arena, task_idx, w, h, d);
+
+		norm_task_storage &ns = m_norm_task_storage[task_idx];
+		arena.alloc(ns.m_sums, storage_type::eBackward, m_channels, 2);
+		ns.m_count = 0;
+	}
+
+	/*
+		scale and shift of channel k at inference:
+		z = scale[k] * x + shift[k]
+	*/
+	void inference_affine(varray &scale, varray &shift) const
+	{
+		scale.resize(m_channels);
+		shift.resize(m_channels);
+		for (nn_int k = 0; k < m_channels; ++k)
+		{
+			scale[k] = m_w[k] / std::sqrt(m_stats(k, 1) + m_epsilon);
+			shift[k] = m_b[k] - scale[k] * m_stats(k, 0);
+		}
+	}
+
+	// normalizes with the running statistics, training goes through the batch calls below
+	virtual void forw_prop(const varray &input, nn_int task_idx)
+	{
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		nn_assert(input.size() == m_channels * m_spatial);
+
+		const nn_float *nn_restrict src = &input[0];
+		nn_float *nn_restrict z = &z_buffer(ts, m_activation_type)[0];
+		for (nn_int k = 0; k < m_channels; ++k)
+		{
+			nn_float mean = m_stats(k, 0);
+			nn_float scale = m_w[k] / std::sqrt(m_stats(k, 1) + m_epsilon);
+			nn_float shift = m_b[k];
+			nn_int base = k * m_spatial;
+			for (nn_int i = 0; i < m_spatial; ++i)
+			{
+				z[base + i] = (src[base + i] - mean) * scale + shift;
+			}
+		}
+		activate(ts, m_activation_type, m_f);
+	}
+
+	// the gradient depends on the whole minibatch, see collect_delta / backward_sample
+	virtual void back_prop(const varray &next_wd, nn_int task_idx)
+	{
+		nn_assert(false);
+	}
+
+	// before the first stage of a minibatch
+	void begin_batch(nn_int batch_size)
+	{
+		nn_int in_sz = m_channels * m_spatial;
+		if (m_batch_x.width() != in_sz || m_batch_x.height() != batch_size)
+		{
+			m_batch_x.resize(in_sz, batch_size);
+		}
+		nn_int delta_count = m_need_input_gradient ? batch_size : 0;
+		if (m_batch_delta.width() != in_sz || m_batch_delta.height() != delta_count)
+		{
+			m_batch_delta.resize(in_sz, delta_count);
+		}
+	}
+
+	// keeps the input of sample and adds it to the task's sums
+	void collect_input(const varray &input, nn_int sample, nn_int task_idx)
+	{
+		nn_assert(input.size() == m_channels * m_spatial);
+		norm_task_storage &ns = m_norm_task_storage[task_idx];
+		const nn_float *nn_restrict src = &input[0];
+		nn_float *nn_restrict dst = &m_batch_x(0, sample);
+		for (nn_int k = 0; k < m_channels; ++k)
+		{
+			double sum = 0;
+			double sq_sum = 0;
+			nn_int base = k * m_spatial;
+			for (nn_int i = base; i < base + m_spatial; ++i)
+			{
+				double v = src[i];
+				dst[i] = src[i];
+				sum += v;
+				sq_sum += v * v;
+			}
+			ns.m_sums(k, 0) += sum;
+			ns.m_sums(k, 1) += sq_sum;
+		}
+		ns.m_count += m_spatial;
+	}
+
+	// after every sample was collected: mean and (biased) var of the minibatch
+	void reduce_input()
+	{
+		std::vector<double> sums;
+		m_batch_count = take_sums(sums);
+		nn_assert(m_batch_count > 0);
+		for (nn_int k = 0; k < m_channels; ++k)
+		{
+			double mean = sums[k] / m_batch_count;
+			double var = std::max(sums[m_channels + k] / m_batch_count - mean * mean, 0.0);
+			m_batch_stats(k, 0) = (nn_float)mean;
+			m_batch_stats(k, 1) = (nn_float)var;
+		}
+	}
+
+	// output of sample from its kept input and the batch statistics
+	void forward_sample(nn_int sample, nn_int task_idx)
+	{
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		const nn_float *nn_restrict src = &m_batch_x(0, sample);
+		nn_float *nn_restrict z = &z_buffer(ts, m_activation_type)[0];
+		for (nn_int k = 0; k < m_channels; ++k)
+		{
+			nn_float mean = m_batch_stats(k, 0);
+			nn_float scale = m_w[k] / std::sqrt(m_batch_stats(k, 1) + m_epsilon);
+			nn_float shift = m_b[k];
+			nn_int base = k * m_spatial;
+			for (nn_int i = base; i < base + m_spatial; ++i)
+			{
+				z[i] = (src[i] - mean) * scale + shift;
+			}
+		}
+		activate(ts, m_activation_type, m_f);
+	}
+
+	/*
+		next_wd: of the layer above, right after forward_sample of the same sample
+		delta := next_wd * df(z), gamma / beta gradients, keeps delta for backward_sample
+	*/
+	void collect_delta(const varray &next_wd, nn_int sample, nn_int task_idx)
+	{
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		norm_task_storage &ns = m_norm_task_storage[task_idx];
+		nn_assert(next_wd.size() == ts.m_x.size());
+
+		activation_delta(ts, m_activation_type, m_df, next_wd);
+
+		const nn_float *nn_restrict src = &m_batch_x(0, sample);
+		const nn_float *nn_restrict vec_delta = &ts.m_delta[0];
+		for (nn_int k = 0; k < m_channels; ++k)
+		{
+			nn_float mean = m_batch_stats(k, 0);
+			nn_float inv_std = cOne / std::sqrt(m_batch_stats(k, 1) + m_epsilon);
+			double dw = 0;
+			double db = 0;
+			nn_int base = k * m_spatial;
+			for (nn_int i = base; i < base + m_spatial; ++i)
+			{
+				nn_float delta = vec_delta[i];
+				db += delta;
+				dw += delta * (src[i] - mean) * inv_std;
+			}
+			ts.m_dw[k] += (nn_float)dw;
+			ts.m_db[k] += (nn_float)db;
+			if (m_need_input_gradient)
+			{
+				ns.m_sums(k, 0) += db;
+				ns.m_sums(k, 1) += dw;
+			}
+		}
+
+		// nothing below learns, no input gradient and no reduce_delta
+		if (m_need_input_gradient)
+		{
+			ns.m_count += m_spatial;
+			::memcpy(&m_batch_delta(0, sample), vec_delta, m_channels * m_spatial * sizeof(nn_float));
+		}
+	}
+
+	// after every sample was collected: means of delta and of delta * x_hat
+	void reduce_delta()
+	{
+		std::vector<double> sums;
+		nn_int count = take_sums(sums);
+		nn_assert(count == m_batch_count);
+		for (nn_int k = 0; k < m_channels; ++k)
+		{
+			m_batch_stats(k, 2) = (nn_float)(sums[k] / count);
+			m_batch_stats(k, 3) = (nn_float)(sums[m_channels + k] / count);
+		}
+	}
+
+	/*
+		input gradient of sample, the mean and var of the minibatch depend on every input:
+		wd = gamma / std * (delta - mean(delta) - x_hat * mean(delta * x_hat))
+	*/
+	void backward_sample(nn_int sample, nn_int task_idx)
+	{
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		const nn_float *nn_restrict src = &m_batch_x(0, sample);
+		const nn_float *nn_restrict vec_delta = &m_batch_delta(0, sample);
+		nn_float *nn_restrict vec_wd = &ts.m_wd[0];
+		for (nn_int k = 0; k < m_channels; ++k)
+		{
+			nn_float mean = m_batch_stats(k, 0);
+			nn_float inv_std = cOne / std::sqrt(m_batch_stats(k, 1) + m_epsilon);
+			nn_float scale = m_w[k] * inv_std;
+			nn_float mean_delta = m_batch_stats(k, 2);
+			nn_float mean_delta_x = m_batch_stats(k, 3);
+			nn_int base = k * m_spatial;
+			for (nn_int i = base; i < base + m_spatial; ++i)
+			{
+				nn_float x_hat = (src[i] - mean) * inv_std;
+				vec_wd[i] = scale * (vec_delta[i] - mean_delta - x_hat * mean_delta_x);
+			}
+		}
+	}
+
+	// the running statistics take the last minibatch's, var unbiased
+	virtual void reduce_statistics()
+	{
+		if (m_batch_count == 0)
+		{
+			return;
+		}
+		double correction = m_batch_count > 1 ? (double)m_batch_count / (m_batch_count - 1) : 1.0;
+		for (nn_int k = 0; k < m_channels; ++k)
+		{
+			m_stats(k, 0) = (nn_float)(m_momentum * m_stats(k, 0) + (1 - m_momentum) * m_batch_stats(k, 0));
+			m_stats(k, 1) = (nn_float)(m_momentum * m_stats(k, 1) + (1 - m_momentum) * m_batch_stats(k, 1) * correction);
+		}
+		m_batch_count = 0;
+	}
+
+private:
+	// sums of all tasks (channels X 2), cleared in the tasks, returns the count
+	nn_int take_sums(std::vector<double> &sums)
+	{
+		nn_int count = 0;
+		sums.assign(m_channels * 2, 0.0);
+		for (auto &ns : m_norm_task_storage)
+		{
+			if (ns.m_count == 0)
+			{
+				continue;
+			}
+			for (nn_int i = 0; i < m_channels * 2; ++i)
+			{
+				sums[i] += ns.m_sums[i];
+			}
+			count += ns.m_count;
+			ns.m_sums.make_zero();
+			ns.m_count = 0;
+		}
+		return count;
+	}
+};
+}
+#endif //__BATCH_NORM_LAYER_H__
@@ -0,0 +1,364 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace mini_cnn
+{
+
+/*
+	where a training run stands, enough to continue it exactly
+*/
+struct train_state
+{
+	nn_int m_epoch;                  // epoch to continue with
+	nn_int m_batch;                  // first batch of that epoch not trained yet
+	nn_int m_batch_size;
+	unsigned long long m_epoch_seed; // shuffle seed of m_epoch, valid when m_batch > 0
+	nn_float m_max_accuracy;
+	std::string m_rng_state;         // global_setting::m_rand_generator
+
+	train_state() : m_epoch(0), m_batch(0), m_batch_size(0), m_epoch_seed(0), m_max_accuracy(0)
+	{
+	}
+};
+
+/*
+	training checkpoints written from a background thread
+
+	write() only copies the parameters into a snapshot buffer, the file is written,
+	flushed to disk and renamed over the previous checkpoint by the writer thread,
+	so a crash at any point leaves either the old or the new checkpoint.
+
+	file layout (native byte order):
+		header, per layer weight, bias and statistics counts, rng state text,
+		all parameters (m_w, m_b, m_stats of every layer), optimizer state
+*/
+class checkpoint_writer
+{
+private:
+	struct file_header
+	{
+		char m_magic[8];
+		uint32_t m_version;
+		uint32_t m_float_size;
+		uint32_t m_layer_count;
+		uint32_t m_rng_state_size;
+		int64_t m_epoch;
+		int64_t m_batch;
+		int64_t m_batch_size;
+		uint64_t m_epoch_seed;
+		uint64_t m_param_count;
+		float m_max_accuracy;
+		uint32_t m_optimizer_step;
+		uint64_t m_optimizer_state_count;
+	};
+
+	static_assert(sizeof(file_header) == 80, "checkpoint header must be 80 bytes");
+
+	static const uint32_t cVersion = 3;
+
+	std::string m_path;
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	bool m_pending;   // a snapshot waits for the writer thread
+	bool m_stop;
+
+	train_state m_state;
+	std::vector<uint32_t> m_counts;
+	std::vector<nn_float> m_snapshot;  // parameters and statistics, then optimizer state
+	uint64_t m_optimizer_state_count;
+	uint32_t m_optimizer_step;
+
+public:
+	checkpoint_writer(const std::string &path) : m_path(path), m_pending(false), m_stop(false), m_optimizer_state_count(0), m_optimizer_step(0)
+	{
+		m_thread = std::thread([this]() { write_loop(); });
+	}
+
+	~checkpoint_writer()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cv.wait(lock, [&]() { return !m_pending; });
+		m_stop = true;
+		lock.unlock();
+		m_cv.notify_all();
+		m_thread.join();
+	}
+
+	checkpoint_writer(const checkpoint_writer&) = delete;
+	checkpoint_writer& operator=(const checkpoint_writer&) = delete;
+
+	const std::string& path() const
+	{
+		return m_path;
+	}
+
+	// snapshot the parameters of layers and opt, waits only if the previous checkpoint is still being written
+	void write(const std::vector<layer_base*> &layers, optimizer &opt, const train_state &state)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cv.wait(lock, [&]() { return !m_pending; });
+
+		m_state = state;
+		m_counts.clear();
+		size_t param_count = 0;
+		for (auto layer : layers)
+		{
+			m_counts.push_back(layer->m_w.size());
+			m_counts.push_back(layer->m_b.size());
+			m_counts.push_back(layer->m_stats.size());
+			param_count += layer->m_w.size() + layer->m_b.size() + layer->m_stats.size();
+		}
+		m_optimizer_state_count = opt.state().size();
+		m_optimizer_step = opt.step_count();
+		m_snapshot.resize(param_count + m_optimizer_state_count);
+		nn_float *dst = m_snapshot.data();
+		for (auto layer : layers)
+		{
+			dst = copy_out(layer->m_w, dst);
+			dst = copy_out(layer->m_b, dst);
+			dst = copy_out(layer->m_stats, dst);
+		}
+		copy_out(opt.state(), dst);
+
+		m_pending = true;
+		lock.unlock();
+		m_cv.notify_all();
+	}
+
+	// blocks until the last snapshot is on disk
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cv.wait(lock, [&]() { return !m_pending; });
+	}
+
+	/*
+		restores the parameters of layers (same architecture), the state of opt
+		(same optimizer, prepared for layers) and the training position
+	*/
+	static bool load(const std::string &path, const std::vector<layer_base*> &layers, optimizer &opt, train_state &state)
+	{
+		std::FILE *fp = std::fopen(path.c_str(), "rb");
+		if (fp == nullptr)
+		{
+			std::cerr << "Open failed!" << path << std::endl;
+			return false;
+		}
+
+		bool ok = false;
+		file_header header;
+		std::vector<uint32_t> counts;
+		if (std::fread(&header, sizeof(header), 1, fp) != 1 || ::memcmp(header.m_magic, "MCNNCKPT", 8) != 0
+			|| header.m_version != cVersion || header.m_float_size != sizeof(nn_float))
+		{
+			std::cerr << "Not a checkpoint file!" << path << std::endl;
+		}
+		else if (header.m_layer_count != layers.size() || !read_counts(fp, header.m_layer_count, counts)
+			|| !match_counts(layers, counts))
+		{
+			std::cerr << "Checkpoint does not match the network!" << path << std::endl;
+		}
+		else if (header.m_optimizer_state_count != (uint64_t)opt.state().size())
+		{
+			std::cerr << "Checkpoint does not match the optimizer!" << path << std::endl;
+		}
+		else
+		{
+			std::string rng_state(header.m_rng_state_size, '\0');
+			ok = (header.m_rng_state_size == 0 || std::fread(&rng_state[0], header.m_rng_state_size, 1, fp) == 1);
+			for (auto layer : layers)
+			{
+				ok = ok && copy_in(fp, layer->m_w) && copy_in(fp, layer->m_b) && copy_in(fp, layer->m_stats);
+			}
+			ok = ok && copy_in(fp, opt.state());
+			opt.set_step_count((nn_int)header.m_optimizer_step);
+			if (!ok)
+			{
+				std::cerr << "Truncated checkpoint file!" << path << std::endl;
+			}
+			state.m_epoch = (nn_int)header.m_epoch;
+			state.m_batch = (nn_int)header.m_batch;
+			state.m_batch_size = (nn_int)header.m_batch_size;
+			state.m_epoch_seed = header.m_epoch_seed;
+			state.m_max_accuracy = header.m_max_accuracy;
+			state.m_rng_state = rng_state;
+		}
+		std::fclose(fp);
+		return ok;
+	}
+
+	static std::string save_rng(const std::mt19937_64 &rng)
+	{
+		std::ostringstream os;
+		os << rng;
+		return os.str();
+	}
+
+	static void restore_rng(std::mt19937_64 &rng, const std::string &text)
+	{
+		std::istringstream is(text);
+		is >> rng;
+	}
+
+	/*
+		SIGTERM only raises a flag, network::SGD polls it after every minibatch,
+		writes a final checkpoint and returns
+	*/
+	static void install_stop_handler()
+	{
+		stop_flag() = 0;
+		std::signal(SIGTERM, on_stop_signal);
+	}
+
+	static bool stop_requested()
+	{
+		return stop_flag() != 0;
+	}
+
+private:
+	static volatile std::sig_atomic_t& stop_flag()
+	{
+		static volatile std::sig_atomic_t flag = 0;
+		return flag;
+	}
+
+	static void on_stop_signal(int)
+	{
+		stop_flag() = 1;
+	}
+
+	static nn_float* copy_out(const varray &arr, nn_float *dst)
+	{
+		if (arr.size() > 0)
+		{
+			::memcpy(dst, &arr[0], arr.size() * sizeof(nn_float));
+		}
+		return dst + arr.size();
+	}
+
+	static bool copy_in(std::FILE *fp, varray &arr)
+	{
+		return arr.size() == 0 || std::fread(&arr[0], sizeof(nn_float), arr.size(), fp) == (size_t)arr.size();
+	}
+
+	// counts: weight, bias and statistics count of every layer
+	static bool read_counts(std::FILE *fp, uint32_t layer_count, std::vector<uint32_t> &counts)
+	{
+		counts.resize(layer_count * 3);
+		return counts.empty() || std::fread(counts.data(), sizeof(uint32_t), counts.size(), fp) == counts.size();
+	}
+
+	static bool match_counts(const std::vector<layer_base*> &layers, const std::vector<uint32_t> &counts)
+	{
+		for (size_t i = 0; i < layers.size(); ++i)
+		{
+			if (counts[i * 3] != (uint32_t)layers[i]->m_w.size() || counts[i * 3 + 1] != (uint32_t)layers[i]->m_b.size()
+				|| counts[i * 3 + 2] != (uint32_t)layers[i]->m_stats.size())
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void write_loop()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true)
+		{
+			m_cv.wait(lock, [&]() { return m_stop || m_pending; });
+			if (m_stop)
+			{
+				return;
+			}
+			// the trainer does not touch the snapshot while m_pending is set
+			lock.unlock();
+			write_file();
+			lock.lock();
+			m_pending = false;
+			m_cv.notify_all();
+		}
+	}
+
+	void write_file()
+	{
+		std::string tmp_path = m_path + ".tmp";
+		std::FILE *fp = std::fopen(tmp_path.c_str(), "wb");
+		if (fp == nullptr)
+		{
+			std::cerr << "Open failed!" << tmp_path << std::endl;
+			return;
+		}
+
+		file_header header;
+		::memset(&header, 0, sizeof(header));
+		::memcpy(header.m_magic, "MCNNCKPT", 8);
+		header.m_version = cVersion;
+		header.m_float_size = sizeof(nn_float);
+		header.m_layer_count = (uint32_t)(m_counts.size() / 3);
+		header.m_rng_state_size = (uint32_t)m_state.m_rng_state.size();
+		header.m_epoch = m_state.m_epoch;
+		header.m_batch = m_state.m_batch;
+		header.m_batch_size = m_state.m_batch_size;
+		header.m_epoch_seed = m_state.m_epoch_seed;
+		header.m_param_count = m_snapshot.size() - m_optimizer_state_count;
+		header.m_max_accuracy = m_state.m_max_accuracy;
+		header.m_optimizer_step = m_optimizer_step;
+		header.m_optimizer_state_count = m_optimizer_state_count;
+
+		bool ok = std::fwrite(&header, sizeof(header), 1, fp) == 1;
+		ok = ok && (m_counts.empty() || std::fwrite(m_counts.data(), sizeof(uint32_t), m_counts.size(), fp) == m_counts.size());
+		ok = ok && (m_state.m_rng_state.empty() || std::fwrite(m_state.m_rng_state.data(), m_state.m_rng_state.size(), 1, fp) == 1);
+		ok = ok && (m_snapshot.empty() || std::fwrite(m_snapshot.data(), sizeof(nn_float), m_snapshot.size(), fp) == m_snapshot.size());
+		// the data must be on disk before the rename makes it the checkpoint
+		ok = ok && std::fflush(fp) == 0;
+#if defined(_WIN32)
+		ok = ok && ::_commit(::_fileno(fp)) == 0;
+#else
+		ok = ok && ::fsync(::fileno(fp)) == 0;
+#endif
+		ok = (std::fclose(fp) == 0) && ok;
+		if (!ok)
+		{
+			std::cerr << "Write failed!" << tmp_path << std::endl;
+			std::remove(tmp_path.c_str());
+			return;
+		}
+
+#if defined(_WIN32)
+		ok = ::MoveFileExA(tmp_path.c_str(), m_path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+		ok = std::rename(tmp_path.c_str(), m_path.c_str()) == 0;
+#endif
+		if (!ok)
+		{
+			std::cerr << "Rename failed!" << m_path << std::endl;
+		}
+	}
+};
+
+}
+
+#endif //__CHECKPOINT_H__
@@ -0,0 +1,102 @@
+#ifndef __CIFAR10_DATASET_H__
+#define __CIFAR10_DATASET_H__
+
+#include <string>
+#include <vector>
+#include <fstream>
+
+namespace mini_cnn
+{
+
+/*
+	CIFAR-10 binary batches (data_batch_1.bin ... data_batch_5.bin, test_batch.bin)
+
+	every record is 1 label byte followed by 32 * 32 * 3 pixel bytes, red plane,
+	green plane, blue plane, each row major, which is already the varray layout.
+	the records are loaded into memory with labels split off, 50000 training
+	images take 150MB. for sets that do not fit use record_dataset.
+*/
+class cifar10_dataset : public compact_dataset
+{
+public:
+	static const nn_int cWidth = 32;
+	static const nn_int cHeight = 32;
+	static const nn_int cDepth = 3;
+	static const nn_int cClassCount = 10;
+
+	bool open(const std::vector<std::string> &files)
+	{
+		const size_t sample_size = cWidth * cHeight * cDepth;
+		const size_t record_size = sample_size + 1;
+
+		std::vector<size_t> file_sizes;
+		size_t total = 0;
+		for (auto &file_path : files)
+		{
+			std::ifstream fs(file_path, std::ios::in | std::ios::binary | std::ios::ate);
+			if (!fs)
+			{
+				std::cerr << "Open failed!" << file_path << std::endl;
+				return false;
+			}
+			size_t size = (size_t)fs.tellg();
+			if (size % record_size != 0)
+			{
+				std::cerr << "Invalid cifar-10 batch!" << file_path << std::endl;
+				return false;
+			}
+			file_sizes.push_back(size);
+			total += size / record_size;
+		}
+
+		create((nn_int)total, cWidth, cHeight, cDepth, cClassCount);
+
+		std::vector<char> chunk;
+		nn_int idx = 0;
+		for (size_t f = 0; f < files.size(); ++f)
+		{
+			std::ifstream fs(files[f], std::ios::in | std::ios::binary);
+			chunk.resize(file_sizes[f]);
+			if (!chunk.empty() && !fs.read(&chunk[0], chunk.size()))
+			{
+				std::cerr << "Read failed!" << files[f] << std::endl;
+				return false;
+			}
+			size_t records = file_sizes[f] / record_size;
+			for (size_t r = 0; r < records; ++r, ++idx)
+			{
+				const unsigned char *rec = (const unsigned char*)&chunk[r * record_size];
+				if (rec[0] >= cClassCount)
+				{
+					std::cerr << "Invalid cifar-10 label!" << files[f] << std::endl;
+					return false;
+				}
+				m_labels[idx] = rec[0];
+				::memcpy(pixels(idx), rec + 1, sample_size);
+			}
+		}
+		return true;
+	}
+
+	// the five training batches or the test batch found in dir
+	bool open_dir(const std::string &dir, bool train)
+	{
+		std::vector<std::string> files;
+		if (train)
+		{
+			for (nn_int i = 1; i <= 5; ++i)
+			{
+				files.push_back(dir + "data_batch_" + std::to_string(i) + ".bin");
+			}
+		}
+		else
+		{
+			files.push_back(dir + "test_batch.bin");
+		}
+		return open(files);
+	}
+};
+
+}
+
+#endif //__CIFAR10_DATASET_H__
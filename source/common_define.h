@@ -56,6 +56,9 @@ namespace mini_cnn
 
 #define nn_align_size 32
 
+// cache line size, alignment of every memory_arena block
+#define nn_cache_line_size 64
+
 #define nn_restrict __restrict
 
 }
@@ -0,0 +1,145 @@
+#ifndef __COMPACT_DATASET_H__
+#define __COMPACT_DATASET_H__
+
+#include <vector>
+
+namespace mini_cnn
+{
+
+/*
+	images stored as they come from the file:
+	one contiguous block of uint8 pixels (w * h * d per sample, sample after sample)
+	and one uint8 class index per sample.
+
+	conversion to nn_float (pixel / 255) and the one-hot label are produced
+	only when a sample is copied into a batch.
+
+	a random access dataset_source, it either owns its bytes (create) or views
+	external read only memory such as a mapped idx file (attach), the memory
+	must outlive the set.
+*/
+class compact_dataset : public dataset_source
+{
+protected:
+	nn_int m_count;
+	nn_int m_width;
+	nn_int m_height;
+	nn_int m_depth;
+	nn_int m_class_count;
+	std::vector<unsigned char> m_pixels;
+	std::vector<unsigned char> m_labels;
+	const unsigned char *m_pixel_data;
+	const unsigned char *m_label_data;
+
+public:
+	compact_dataset() : m_count(0), m_width(0), m_height(0), m_depth(0), m_class_count(0)
+		, m_pixel_data(nullptr), m_label_data(nullptr)
+	{
+	}
+
+	compact_dataset(const compact_dataset&) = delete;
+	compact_dataset& operator=(const compact_dataset&) = delete;
+
+	void create(nn_int count, nn_int width, nn_int height, nn_int depth, nn_int class_count)
+	{
+		m_count = count;
+		m_width = width;
+		m_height = height;
+		m_depth = depth;
+		m_class_count = class_count;
+		m_pixels.resize((size_t)count * width * height * depth);
+		m_labels.resize(count);
+		m_pixel_data = m_pixels.empty() ? nullptr : &m_pixels[0];
+		m_label_data = m_labels.empty() ? nullptr : &m_labels[0];
+	}
+
+	// zero copy view, pixels are count samples of w * h * d bytes, labels count bytes
+	void attach(const unsigned char *pixels, const unsigned char *labels
+		, nn_int count, nn_int width, nn_int height, nn_int depth, nn_int class_count)
+	{
+		m_pixels.clear();
+		m_pixels.shrink_to_fit();
+		m_labels.clear();
+		m_labels.shrink_to_fit();
+		m_count = count;
+		m_width = width;
+		m_height = height;
+		m_depth = depth;
+		m_class_count = class_count;
+		m_pixel_data = pixels;
+		m_label_data = labels;
+	}
+
+	bool is_attached() const
+	{
+		return m_pixel_data != nullptr && m_pixels.empty();
+	}
+
+	virtual nn_int count() const
+	{
+		return m_count;
+	}
+
+	virtual nn_int width() const
+	{
+		return m_width;
+	}
+
+	virtual nn_int height() const
+	{
+		return m_height;
+	}
+
+	virtual nn_int depth() const
+	{
+		return m_depth;
+	}
+
+	virtual nn_int class_count() const
+	{
+		return m_class_count;
+	}
+
+	// writable access, only for sets that own their bytes
+	unsigned char* pixels(nn_int idx)
+	{
+		nn_assert(idx >= 0 && idx < m_count && !is_attached());
+		return &m_pixels[(size_t)idx * m_width * m_height * m_depth];
+	}
+
+	virtual const unsigned char* pixels(nn_int idx) const
+	{
+		nn_assert(idx >= 0 && idx < m_count);
+		return m_pixel_data + (size_t)idx * m_width * m_height * m_depth;
+	}
+
+	unsigned char* labels()
+	{
+		nn_assert(!is_attached());
+		return m_labels.empty() ? nullptr : &m_labels[0];
+	}
+
+	virtual nn_int label(nn_int idx) const
+	{
+		nn_assert(idx >= 0 && idx < m_count);
+		return m_label_data[idx];
+	}
+
+	// every label a valid class index, an out of range one would index past the output
+	bool check_labels() const
+	{
+		for (nn_int i = 0; i < m_count; ++i)
+		{
+			if (m_label_data[i] >= m_class_count)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+};
+
+}
+
+#endif //__COMPACT_DATASET_H__
@@ -4,62 +4,35 @@
 namespace mini_cnn 
 {
 
-class mem_block
-{
-public:
-	nn_int w;
-	nn_int h;
-	nn_float *data;
-	nn_int data_len;
-	mem_block() : data(nullptr), data_len(0), w(0), h(0)
-	{
-	}
-	void resize(nn_int len)
-	{
-		create(len);
-	}
-	~mem_block()
-	{
-		release();
-	}
-private:
-	void create(nn_int len)
-	{
-		data = (nn_float*)align_malloc(len * sizeof(nn_float), nn_align_size);
-		memset(data, 0, len * sizeof(nn_float));
-		data_len = len;
-		w = 0;
-		h = 0;
-	}
-	void release()
-	{
-		if (data != nullptr)
-		{
-			align_free(data);
-		}
-		data = nullptr;
-		data_len = 0;
-		w = 0;
-		h = 0;
-	}
-};
-
 /*
 for the l-th Conv layer:
 	(l)     (l-1)      (l)    (l)
    Z	=  X       *  W    + B
     (l)      (l)
    X    = f(Z   )
+
+a 1x1 stride 1 filter bank is one gemm on the channel-major layout,
+forward, weight gradient and input gradient skip the conv_2d lowering:
+	Z[K X H*W] = W[K X C] * X[C X H*W]
+
+with sparse backward (set_sparse_backward) a sparse enough delta of a
+larger filter is scattered value by value instead, see sparse_backward.
+a first layer behind an input with a sparse output (input_layer::
+set_sparse_output) does the same with the nonzero input pixels for Z and
+dW, see for_each_tap.
 */
 class convolutional_layer : public layer_base
 {
 
 protected:
+	typedef Map<Matrix<nn_float, Dynamic, Dynamic, RowMajor>, AlignmentType::Unaligned> row_mat;
+
 	shape3d m_filter_shape;
 	nn_int m_filter_count;
 	nn_int m_stride_w;
 	nn_int m_stride_h;
 	padding_type m_padding;
+	activation_type m_activation_type;
 	active_func m_f;
 	active_func m_df;
 
@@ -74,7 +47,7 @@ public:
 	convolutional_layer(nn_int filter_w, nn_int filter_h, nn_int filter_c, nn_int filter_n, nn_int stride_w, nn_int stride_h, padding_type padding, activation_type ac_type)
 		: layer_base()
 		, m_filter_shape(filter_w, filter_h, filter_c)
-		, m_filter_count(filter_n), m_stride_w(stride_w), m_stride_h(stride_h), m_padding(padding)
+		, m_filter_count(filter_n), m_stride_w(stride_w), m_stride_h(stride_h), m_padding(padding), m_activation_type(ac_type)
 	{
 		switch (ac_type)
 		{
@@ -90,11 +63,28 @@ public:
 			m_f = softmax;
 			m_df = nullptr;
 			break;
+		case activation_type::eIdentity:
+			m_f = identity;
+			m_df = deriv_identity;
+			break;
 		default:
 			break;
 		}
 	}
 
+	virtual void describe(layer_desc &desc) const
+	{
+		desc.m_type = layer_type::eConvolutionalLayer;
+		desc.m_args[0] = m_filter_shape.m_w;
+		desc.m_args[1] = m_filter_shape.m_h;
+		desc.m_args[2] = m_filter_shape.m_d;
+		desc.m_args[3] = m_filter_count;
+		desc.m_args[4] = m_stride_w;
+		desc.m_args[5] = m_stride_h;
+		desc.m_args[6] = m_padding;
+		desc.m_args[7] = m_activation_type;
+	}
+
 	virtual void connect(layer_base *next)
 	{
 		layer_base::connect(next);
@@ -135,6 +125,12 @@ public:
 	}
 
 	virtual void set_task_count(nn_int task_count)
+	{
+		m_task_storage.resize(task_count);
+		m_conv_task_storage.resize(task_count);
+	}
+
+	virtual void alloc_task_storage(memory_arena &arena, nn_int task_idx)
 	{
 		nn_int in_w = m_prev->m_out_shape.m_w;
 		nn_int in_h = m_prev->m_out_shape.m_h;
@@ -144,54 +140,78 @@ public:
 		nn_int out_h = m_out_shape.m_h;
 		nn_int out_d = m_out_shape.m_d;
 
-		m_task_storage.resize(task_count);
-		for (auto& ts : m_task_storage)
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		arena.alloc(ts.m_dw, storage_type::eBackward, m_w.width(), m_w.height(), m_w.depth(), m_w.count());
+		arena.alloc(ts.m_db, storage_type::eBackward, m_filter_count);
+		alloc_z(arena, task_idx, m_activation_type, out_w, out_h, out_d);
+		if (!m_out_shape.is_img())
 		{
-			ts.m_dw.resize(m_w.width(), m_w.height(), m_w.depth(), m_w.count());
-			ts.m_db.resize(m_filter_count);
-			ts.m_z.resize(out_w, out_h, out_d);
-			if (!m_out_shape.is_img())
-			{
-				ts.m_x.resize(out_w * out_h * out_d);
-			}
-			else
-			{
-				ts.m_x.resize(out_w, out_h, out_d);
-			}
-			ts.m_delta.resize(out_w, out_h, out_d);
-			ts.m_wd.resize(in_w, in_h, in_d);
+			arena.alloc(ts.m_x, storage_type::eOutput, out_w * out_h * out_d);
+		}
+		else
+		{
+			arena.alloc(ts.m_x, storage_type::eOutput, out_w, out_h, out_d);
 		}
+		arena.alloc(ts.m_delta, storage_type::eBackward, out_w, out_h, out_d);
+		alloc_wd(arena, task_idx, in_w, in_h, in_d);
+		alloc_nz(arena, task_idx);
 
 #ifdef nnGEMM
 		nn_int temp_w = in_w + in_w - out_w;
 		nn_int temp_h = in_h + in_h - out_h;
 		nn_int img2row_size = temp_w * temp_h * m_filter_shape.m_w * m_filter_shape.m_h * m_filter_shape.m_d;
-		m_conv_task_storage.resize(task_count);
-		for (auto &cts : m_conv_task_storage)
-		{
-			cts.m_img_block.resize(img2row_size);
-		}
+		arena.alloc(m_conv_task_storage[task_idx].m_img_block, storage_type::eTemporary, img2row_size);
 #else
-		m_conv_task_storage.resize(task_count);
-		for (auto &cts : m_conv_task_storage)
-		{
-			cts.m_img_block.resize(in_w * in_h);
-		}
+		arena.alloc(m_conv_task_storage[task_idx].m_img_block, storage_type::eTemporary, in_w * in_h);
 #endif
 	}
 
 	virtual void forw_prop(const varray &input, nn_int task_idx)
 	{
-		varray &out_z = m_task_storage[task_idx].m_z;
-		varray &out_x = m_task_storage[task_idx].m_x;
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		varray &out_z = z_buffer(ts, m_activation_type);
 
 		mem_block &block = m_conv_task_storage[task_idx].m_img_block;
+		const nn_int *in_index;
+		const nn_float *in_value;
+		nn_int in_nnz = pointwise() ? -1 : m_prev->get_sparse_output(task_idx, in_index, in_value);
 
+		if (pointwise())
+		{
+			nn_int out_n = m_out_shape.m_w * m_out_shape.m_h;
+			row_mat w(&m_w[0], m_filter_count, m_filter_shape.m_d);
+			row_mat x((nn_float*)&input[0], m_filter_shape.m_d, out_n);
+			row_mat z(&out_z[0], m_filter_count, out_n);
+			z.noalias() = w * x;
+		}
+		else if (in_nnz >= 0)
+		{
+			// z(j, i, k) += x * w(u, v, c, k) for every output a nonzero x is under
+			nn_int out_n = m_out_shape.m_w * m_out_shape.m_h;
+			nn_int filter_n = m_filter_shape.size();
+			out_z.make_zero();
+			for (nn_int t = 0; t < in_nnz; ++t)
+			{
+				nn_float x = in_value[t];
+				for_each_tap(input, in_index[t], [&](nn_int u, nn_int v, nn_int c, nn_int out_idx)
+				{
+					const nn_float *nn_restrict w = &m_w(u, v, c, 0);
+					nn_float *nn_restrict z = &out_z[out_idx];
+					for (nn_int k = 0; k < m_filter_count; ++k)
+					{
+						z[k * out_n] += x * w[k * filter_n];
+					}
+				});
+			}
+		}
+		else
+		{
 #ifdef nnGEMM		
-		conv_input_w(input, block, m_w, m_stride_w, m_stride_h, out_z);
+			conv_input_w(input, block, m_w, m_stride_w, m_stride_h, out_z);
 #else
-		conv_input_w(input, block, m_w, m_stride_w, m_stride_h, out_z);
+			conv_input_w(input, block, m_w, m_stride_w, m_stride_h, out_z);
 #endif
+		}
 
 		for (nn_int k = 0; k < m_out_shape.m_d; ++k)
 		{
@@ -206,12 +226,7 @@ public:
 			}
 		}
 
-		m_f(out_z, out_x);
-
-		if (m_next != nullptr)
-		{
-			m_next->forw_prop(out_x, task_idx);
-		}
+		activate(ts, m_activation_type, m_f);
 	}
 
 	virtual void back_prop(const varray &next_wd, nn_int task_idx)
@@ -219,29 +234,61 @@ public:
 		layer_base::task_storage &ts = m_task_storage[task_idx];
 		const varray &input = m_prev->get_output(task_idx);
 
-		nn_int out_sz = next_wd.size();
-
 		/*
 			delta := next_wd  df(z)
 		*/
-		m_df(ts.m_z, ts.m_delta);
+		activation_delta(ts, m_activation_type, m_df, next_wd);
 
-		nn_float *nn_restrict vec_delta = &ts.m_delta[0];
-		const nn_float *nn_restrict vec_next_wd = &next_wd[0];
-		for (nn_int i = 0; i < out_sz; ++i)
+		// the 1x1 gemm stays dense, it is faster than a scatter at any useful density
+		nn_int nnz = pointwise() ? -1 : compact_delta(ts);
+		if (nnz >= 0)
 		{
-			vec_delta[i] *= vec_next_wd[i];
+			sparse_backward(input, nnz, task_idx);
+			return;
 		}
 
 		/*
 			dw_k := conv2d(input_d, delta_k)
 		*/
 		mem_block &block = m_conv_task_storage[task_idx].m_img_block;
+		const nn_int *in_index;
+		const nn_float *in_value;
+		nn_int in_nnz = pointwise() ? -1 : m_prev->get_sparse_output(task_idx, in_index, in_value);
+		if (pointwise())
+		{
+			nn_int out_n = m_out_shape.m_w * m_out_shape.m_h;
+			row_mat dw(&ts.m_dw[0], m_filter_count, m_filter_shape.m_d);
+			row_mat delta(&ts.m_delta[0], m_filter_count, out_n);
+			row_mat x((nn_float*)&input[0], m_filter_shape.m_d, out_n);
+			dw.noalias() += delta * x.transpose();
+		}
+		else if (in_nnz >= 0)
+		{
+			// dw(u, v, c, k) += x * delta(j, i, k) for every output a nonzero x is under
+			nn_int out_n = m_out_shape.m_w * m_out_shape.m_h;
+			nn_int filter_n = m_filter_shape.size();
+			for (nn_int t = 0; t < in_nnz; ++t)
+			{
+				nn_float x = in_value[t];
+				for_each_tap(input, in_index[t], [&](nn_int u, nn_int v, nn_int c, nn_int out_idx)
+				{
+					const nn_float *nn_restrict delta = &ts.m_delta[out_idx];
+					nn_float *nn_restrict dw = &ts.m_dw(u, v, c, 0);
+					for (nn_int k = 0; k < m_filter_count; ++k)
+					{
+						dw[k * filter_n] += x * delta[k * out_n];
+					}
+				});
+			}
+		}
+		else
+		{
 #ifdef nnGEMM
-		conv_input_delta(input, block, ts.m_delta, m_stride_w, m_stride_h, ts.m_dw);
+			conv_input_delta(input, block, ts.m_delta, m_stride_w, m_stride_h, ts.m_dw);
 #else
-		conv_input_delta(input, block, ts.m_delta, m_stride_w, m_stride_h, ts.m_dw);
+			conv_input_delta(input, block, ts.m_delta, m_stride_w, m_stride_h, ts.m_dw);
 #endif
+		}
 
 		/*
 			db_k := sum(delta_k)
@@ -261,23 +308,132 @@ public:
 		}
 
 		/*
-			wd := conv(delta, w)
+			wd := conv(delta, w), the first layer has no use for it
 		*/
+		if (!m_need_input_gradient)
+		{
+			return;
+		}
 		nn_int out_w = m_out_shape.m_w;
 		nn_int out_h = m_out_shape.m_h;
 		nn_int offset_w = input.width() - out_w;
 		nn_int offset_h = input.height() - out_h;
 
+		if (pointwise())
+		{
+			nn_int out_n = out_w * out_h;
+			row_mat w(&m_w[0], m_filter_count, m_filter_shape.m_d);
+			row_mat delta(&ts.m_delta[0], m_filter_count, out_n);
+			row_mat wd(&ts.m_wd[0], m_filter_shape.m_d, out_n);
+			wd.noalias() = w.transpose() * delta;
+			return;
+		}
+
 #ifdef nnGEMM
 		conv_delta_w(ts.m_delta, block, m_w, m_stride_w, m_stride_h, ts.m_wd);
 #else
 		conv_delta_w(ts.m_delta, block, m_index_map, m_w, m_stride_w, m_stride_h, ts.m_wd);
 #endif
-		m_prev->back_prop(ts.m_wd, task_idx);
-
 	}
 
 private:
+	bool pointwise() const
+	{
+		return m_filter_shape.m_w == 1 && m_filter_shape.m_h == 1 && m_stride_w == 1 && m_stride_h == 1;
+	}
+
+	/*
+		calls f(u, v, c, j + i * out_w) for every output (j, i) whose window
+		holds input value idx under filter tap (u, v) of channel c
+	*/
+	template<class F>
+	void for_each_tap(const varray &input, nn_int idx, F f) const
+	{
+		nn_int in_w = input.width();
+		nn_int in_n = in_w * input.height();
+		nn_int c = idx / in_n;
+		nn_int y = (idx % in_n) / in_w;
+		nn_int x = idx % in_w;
+		nn_int out_w = m_out_shape.m_w;
+		nn_int out_h = m_out_shape.m_h;
+		for (nn_int v = 0; v < m_filter_shape.m_h && v <= y; ++v)
+		{
+			nn_int i = (y - v) / m_stride_h;
+			if ((y - v) % m_stride_h != 0 || i >= out_h)
+			{
+				continue;
+			}
+			for (nn_int u = 0; u < m_filter_shape.m_w && u <= x; ++u)
+			{
+				nn_int j = (x - u) / m_stride_w;
+				if ((x - u) % m_stride_w != 0 || j >= out_w)
+				{
+					continue;
+				}
+				f(u, v, c, j + i * out_w);
+			}
+		}
+	}
+
+	/*
+		back_prop for a delta with nnz nonzero values listed in m_nz. each
+		delta(j, i, k) = d only meets the input window under output (j, i):
+			db(k) += d
+			dw(u, v, c, k) += d * x(j * stride_w + u, i * stride_h + v, c)
+			wd(j * stride_w + u, i * stride_h + v, c) += d * w(u, v, c, k)
+	*/
+	void sparse_backward(const varray &input, nn_int nnz, nn_int task_idx)
+	{
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		nn_int in_w = input.width();
+		nn_int out_w = m_out_shape.m_w;
+		nn_int out_n = out_w * m_out_shape.m_h;
+		nn_int fw = m_filter_shape.m_w;
+		nn_int fh = m_filter_shape.m_h;
+		nn_int fd = m_filter_shape.m_d;
+		const nn_int *nz = &ts.m_nz[0];
+		bool need_wd = m_need_input_gradient;
+
+		if (need_wd)
+		{
+			ts.m_wd.make_zero();
+		}
+		for (nn_int t = 0; t < nnz; ++t)
+		{
+			nn_int idx = nz[t];
+			nn_int k = idx / out_n;
+			nn_int i = (idx % out_n) / out_w;
+			nn_int j = idx % out_w;
+			nn_float d = ts.m_delta[idx];
+			ts.m_db[k] += d;
+			for (nn_int c = 0; c < fd; ++c)
+			{
+				const nn_float *img = &input(j * m_stride_w, i * m_stride_h, c);
+				nn_float *dw = &ts.m_dw(0, 0, c, k);
+				for (nn_int v = 0; v < fh; ++v)
+				{
+					for (nn_int u = 0; u < fw; ++u)
+					{
+						dw[u + v * fw] += d * img[u + v * in_w];
+					}
+				}
+				if (!need_wd)
+				{
+					continue;
+				}
+				nn_float *wd = &ts.m_wd(j * m_stride_w, i * m_stride_h, c);
+				const nn_float *w = &m_w(0, 0, c, k);
+				for (nn_int v = 0; v < fh; ++v)
+				{
+					for (nn_int u = 0; u < fw; ++u)
+					{
+						wd[u + v * in_w] += d * w[u + v * fw];
+					}
+				}
+			}
+		}
+	}
+
 
 #ifdef nnGEMM
 	static inline void img2row(const nn_float *img, nn_int iw, nn_int ih, nn_int channels
@@ -371,8 +527,6 @@ private:
 		nn_assert(in_d == d);
 		nn_assert(n == delta_d);
 
-		dw.make_zero();
-
 		for (nn_int k = 0; k < n; ++k)
 		{
 			for (nn_int c = 0; c < d; ++c)
@@ -528,8 +682,6 @@ static void conv_input_delta(const varray &in_img, mem_block &block, const varra
 	nn_assert(in_d == d);
 	nn_assert(n == delta_d);
 
-	dw.make_zero();
-
 	for (nn_int k = 0; k < n; ++k)
 	{
 		for (nn_int c = 0; c < d; ++c)
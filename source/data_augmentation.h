@@ -0,0 +1,440 @@
+#ifndef __DATA_AUGMENTATION_H__
+#define __DATA_AUGMENTATION_H__
+
+#include <vector>
+#include <random>
+#include <cmath>
+
+namespace mini_cnn
+{
+
+/*
+	per loader thread scratch, nothing here is shared between threads
+*/
+struct augment_context
+{
+	std::mt19937_64 m_rng;
+	nn_int m_w;
+	nn_int m_h;
+	nn_int m_d;
+	varray m_src;      // copy of the sample before resampling
+	varray m_map_x;    // source coordinate of every output pixel
+	varray m_map_y;
+	varray m_field_x;  // elastic displacement fields
+	varray m_field_y;
+	varray m_blur;
+	_varray<nn_int> m_tap;  // w * h X 4, source index of the 4 bilinear taps
+	varray m_tap_w;         // w * h X 10, tap weights and 6 rows of scratch
+
+	void create(nn_int w, nn_int h, nn_int d)
+	{
+		m_w = w;
+		m_h = h;
+		m_d = d;
+		m_src.resize(w, h, d);
+		m_map_x.resize(w, h);
+		m_map_y.resize(w, h);
+		m_field_x.resize(w, h);
+		m_field_y.resize(w, h);
+		m_blur.resize(w, h);
+		m_tap.resize(w * h, 4);
+		m_tap_w.resize(w * h, 10);
+	}
+
+	nn_float uniform(nn_float lo, nn_float hi)
+	{
+		return std::uniform_real_distribution<nn_float>(lo, hi)(m_rng);
+	}
+};
+
+/*
+	one augmentation step
+
+	geometric steps only move the sampling map (where each output pixel reads
+	from), all of them together cost one bilinear resample of the image.
+	pixel steps work on the resampled image afterwards.
+*/
+class augmenter
+{
+public:
+	virtual ~augmenter()
+	{
+	}
+
+	virtual bool is_geometric() const
+	{
+		return false;
+	}
+
+	// map_x/map_y hold source coordinates of each output pixel
+	virtual void warp(augment_context &ctx)
+	{
+	}
+
+	virtual void apply(varray &img, augment_context &ctx)
+	{
+	}
+};
+
+// random translation, up to max_shift pixels in x and y
+class shift_augmenter : public augmenter
+{
+protected:
+	nn_float m_max_shift;
+
+public:
+	shift_augmenter(nn_float max_shift) : m_max_shift(max_shift)
+	{
+	}
+
+	virtual bool is_geometric() const
+	{
+		return true;
+	}
+
+	virtual void warp(augment_context &ctx)
+	{
+		nn_float sx = ctx.uniform(-m_max_shift, m_max_shift);
+		nn_float sy = ctx.uniform(-m_max_shift, m_max_shift);
+		nn_int sz = ctx.m_w * ctx.m_h;
+		nn_float *nn_restrict mx = &ctx.m_map_x[0];
+		nn_float *nn_restrict my = &ctx.m_map_y[0];
+		for (nn_int i = 0; i < sz; ++i)
+		{
+			mx[i] -= sx;
+			my[i] -= sy;
+		}
+	}
+};
+
+// random rotation around the image center, up to max_degrees either way
+class rotate_augmenter : public augmenter
+{
+protected:
+	nn_float m_max_degrees;
+
+public:
+	rotate_augmenter(nn_float max_degrees) : m_max_degrees(max_degrees)
+	{
+	}
+
+	virtual bool is_geometric() const
+	{
+		return true;
+	}
+
+	virtual void warp(augment_context &ctx)
+	{
+		nn_float angle = ctx.uniform(-m_max_degrees, m_max_degrees) * (nn_float)(3.14159265358979 / 180.0);
+		nn_float c = std::cos(angle);
+		nn_float s = std::sin(angle);
+		nn_float cx = (ctx.m_w - 1) * (nn_float)0.5;
+		nn_float cy = (ctx.m_h - 1) * (nn_float)0.5;
+		nn_int sz = ctx.m_w * ctx.m_h;
+		nn_float *nn_restrict mx = &ctx.m_map_x[0];
+		nn_float *nn_restrict my = &ctx.m_map_y[0];
+		for (nn_int i = 0; i < sz; ++i)
+		{
+			nn_float x = mx[i] - cx;
+			nn_float y = my[i] - cy;
+			mx[i] = c * x - s * y + cx;
+			my[i] = s * x + c * y + cy;
+		}
+	}
+};
+
+/*
+	elastic distortion (Simard et al. 2003): a uniform random displacement
+	field smoothed by a gaussian of sigma and scaled by alpha
+*/
+class elastic_augmenter : public augmenter
+{
+protected:
+	nn_float m_alpha;
+	nn_float m_sigma;
+	varray m_kernel;
+
+public:
+	elastic_augmenter(nn_float alpha, nn_float sigma) : m_alpha(alpha), m_sigma(sigma)
+	{
+		nn_int radius = std::max(1, (nn_int)std::ceil(3 * sigma));
+		m_kernel.resize(2 * radius + 1);
+		nn_float sum = 0;
+		for (nn_int i = -radius; i <= radius; ++i)
+		{
+			nn_float v = std::exp(-(nn_float)(i * i) / (2 * sigma * sigma));
+			m_kernel[i + radius] = v;
+			sum += v;
+		}
+		for (nn_int i = 0; i < m_kernel.size(); ++i)
+		{
+			m_kernel[i] /= sum;
+		}
+	}
+
+	virtual bool is_geometric() const
+	{
+		return true;
+	}
+
+	virtual void warp(augment_context &ctx)
+	{
+		nn_int sz = ctx.m_w * ctx.m_h;
+		for (nn_int i = 0; i < sz; ++i)
+		{
+			ctx.m_field_x[i] = ctx.uniform(-cOne, cOne);
+			ctx.m_field_y[i] = ctx.uniform(-cOne, cOne);
+		}
+		smooth(ctx.m_field_x, ctx);
+		smooth(ctx.m_field_y, ctx);
+
+		const nn_float *nn_restrict fx = &ctx.m_field_x[0];
+		const nn_float *nn_restrict fy = &ctx.m_field_y[0];
+		nn_float *nn_restrict mx = &ctx.m_map_x[0];
+		nn_float *nn_restrict my = &ctx.m_map_y[0];
+		for (nn_int i = 0; i < sz; ++i)
+		{
+			mx[i] += m_alpha * fx[i];
+			my[i] += m_alpha * fy[i];
+		}
+	}
+
+private:
+	// separable gaussian, borders clamped
+	void smooth(varray &field, augment_context &ctx)
+	{
+		nn_int w = ctx.m_w;
+		nn_int h = ctx.m_h;
+		nn_int radius = m_kernel.size() / 2;
+		varray &tmp = ctx.m_blur;
+		for (nn_int y = 0; y < h; ++y)
+		{
+			for (nn_int x = 0; x < w; ++x)
+			{
+				nn_float v = 0;
+				for (nn_int k = -radius; k <= radius; ++k)
+				{
+					nn_int xx = std::min(w - 1, std::max(0, x + k));
+					v += m_kernel[k + radius] * field[y * w + xx];
+				}
+				tmp[y * w + x] = v;
+			}
+		}
+		for (nn_int y = 0; y < h; ++y)
+		{
+			for (nn_int x = 0; x < w; ++x)
+			{
+				nn_float v = 0;
+				for (nn_int k = -radius; k <= radius; ++k)
+				{
+					nn_int yy = std::min(h - 1, std::max(0, y + k));
+					v += m_kernel[k + radius] * tmp[yy * w + x];
+				}
+				field[y * w + x] = v;
+			}
+		}
+	}
+};
+
+// zero a random square of size x size pixels (all channels) with probability prob
+class cutout_augmenter : public augmenter
+{
+protected:
+	nn_int m_size;
+	nn_float m_prob;
+
+public:
+	cutout_augmenter(nn_int size, nn_float prob = 1) : m_size(size), m_prob(prob)
+	{
+	}
+
+	virtual void apply(varray &img, augment_context &ctx)
+	{
+		if (ctx.uniform(0, cOne) >= m_prob)
+		{
+			return;
+		}
+		// the center may lie anywhere, the square is clipped at the borders
+		nn_int cx = std::uniform_int_distribution<nn_int>(0, ctx.m_w - 1)(ctx.m_rng);
+		nn_int cy = std::uniform_int_distribution<nn_int>(0, ctx.m_h - 1)(ctx.m_rng);
+		nn_int x0 = std::max(0, cx - m_size / 2);
+		nn_int y0 = std::max(0, cy - m_size / 2);
+		nn_int x1 = std::min(ctx.m_w, cx - m_size / 2 + m_size);
+		nn_int y1 = std::min(ctx.m_h, cy - m_size / 2 + m_size);
+		for (nn_int c = 0; c < ctx.m_d; ++c)
+		{
+			for (nn_int y = y0; y < y1; ++y)
+			{
+				nn_float *row = &img[(c * ctx.m_h + y) * ctx.m_w];
+				for (nn_int x = x0; x < x1; ++x)
+				{
+					row[x] = 0;
+				}
+			}
+		}
+	}
+};
+
+/*
+	ordered list of augmenters, owns them
+
+	run() transforms one sample in place: the geometric steps are folded into
+	one sampling map and the image is bilinearly resampled once (pixels outside
+	the source read as 0), then the pixel steps run in order.
+	the random stream of a sample is seeded from (seed, sample position) so the
+	result does not depend on which loader thread prepared it.
+*/
+class augment_pipeline
+{
+protected:
+	std::vector<augmenter*> m_augmenters;
+	nn_int m_geometric_count;
+	unsigned long long m_seed;
+
+public:
+	augment_pipeline(unsigned long long seed = 0) : m_geometric_count(0), m_seed(seed)
+	{
+	}
+
+	~augment_pipeline()
+	{
+		for (auto aug : m_augmenters)
+		{
+			delete aug;
+		}
+	}
+
+	augment_pipeline(const augment_pipeline&) = delete;
+	augment_pipeline& operator=(const augment_pipeline&) = delete;
+
+	augment_pipeline& add(augmenter *aug)
+	{
+		m_augmenters.push_back(aug);
+		if (aug->is_geometric())
+		{
+			++m_geometric_count;
+		}
+		return *this;
+	}
+
+	bool empty() const
+	{
+		return m_augmenters.empty();
+	}
+
+	void run(varray &img, unsigned long long sample_pos, augment_context &ctx) const
+	{
+		nn_assert(img.size() == ctx.m_w * ctx.m_h * ctx.m_d);
+		ctx.m_rng.seed(m_seed * 0x9E3779B97F4A7C15ULL + sample_pos);
+
+		if (m_geometric_count > 0)
+		{
+			nn_int w = ctx.m_w;
+			nn_int h = ctx.m_h;
+			for (nn_int y = 0; y < h; ++y)
+			{
+				nn_float *nn_restrict mx = &ctx.m_map_x[y * w];
+				nn_float *nn_restrict my = &ctx.m_map_y[y * w];
+				for (nn_int x = 0; x < w; ++x)
+				{
+					mx[x] = (nn_float)x;
+					my[x] = (nn_float)y;
+				}
+			}
+			for (auto aug : m_augmenters)
+			{
+				if (aug->is_geometric())
+				{
+					aug->warp(ctx);
+				}
+			}
+			ctx.m_src.copy(img);
+			resample(ctx.m_src, img, ctx);
+		}
+
+		for (auto aug : m_augmenters)
+		{
+			if (!aug->is_geometric())
+			{
+				aug->apply(img, ctx);
+			}
+		}
+	}
+
+private:
+	/*
+		bilinear, pixels outside the source read as 0. the taps are computed
+		once for all channels as eigen array expressions, packet floor / min /
+		max / abs and no branches: a tap is clamped into the image and its
+		weight is multiplied by max(0, 1 - |clamped - unclamped|), 1 inside the
+		image and 0 outside. a channel then is 4 gathers and 4 multiply-adds
+		per pixel.
+	*/
+	static void resample(const varray &src, varray &dst, augment_context &ctx)
+	{
+		typedef Map<Array<nn_float, Dynamic, 1>, AlignmentType::Unaligned> float_arr;
+		typedef Map<Array<nn_int, Dynamic, 1>, AlignmentType::Unaligned> int_arr;
+
+		nn_int w = ctx.m_w;
+		nn_int h = ctx.m_h;
+		nn_int sz = w * h;
+		float_arr mx(&ctx.m_map_x[0], sz);
+		float_arr my(&ctx.m_map_y[0], sz);
+
+		// every operand is stored before it is used again, a nested floor or cast is evaluated per scalar
+		float_arr fx(&ctx.m_tap_w(0, 4), sz);
+		float_arr fy(&ctx.m_tap_w(0, 5), sz);
+		float_arr x0(&ctx.m_tap_w(0, 6), sz);
+		float_arr x1(&ctx.m_tap_w(0, 7), sz);
+		float_arr y0(&ctx.m_tap_w(0, 8), sz);
+		float_arr y1(&ctx.m_tap_w(0, 9), sz);
+		fx = mx.floor();
+		fy = my.floor();
+		x0 = fx.max(nn_float(0)).min(nn_float(w - 1));
+		x1 = (fx + cOne).max(nn_float(0)).min(nn_float(w - 1));
+		y0 = fy.max(nn_float(0)).min(nn_float(h - 1));
+		y1 = (fy + cOne).max(nn_float(0)).min(nn_float(h - 1));
+
+		// tap order 00, 01, 10, 11 (y, x)
+		int_arr(&ctx.m_tap(0, 0), sz) = (y0 * nn_float(w) + x0).cast<nn_int>();
+		int_arr(&ctx.m_tap(0, 1), sz) = (y0 * nn_float(w) + x1).cast<nn_int>();
+		int_arr(&ctx.m_tap(0, 2), sz) = (y1 * nn_float(w) + x0).cast<nn_int>();
+		int_arr(&ctx.m_tap(0, 3), sz) = (y1 * nn_float(w) + x1).cast<nn_int>();
+
+		float_arr w00(&ctx.m_tap_w(0, 0), sz);
+		float_arr w01(&ctx.m_tap_w(0, 1), sz);
+		float_arr w10(&ctx.m_tap_w(0, 2), sz);
+		float_arr w11(&ctx.m_tap_w(0, 3), sz);
+		w00 = (cOne - (mx - fx)) * (cOne - (x0 - fx).abs()).max(nn_float(0));
+		w01 = (mx - fx) * (cOne - (x1 - fx - cOne).abs()).max(nn_float(0));
+		// x0 / x1 are free now, they take the y weights
+		x0 = (cOne - (my - fy)) * (cOne - (y0 - fy).abs()).max(nn_float(0));
+		x1 = (my - fy) * (cOne - (y1 - fy - cOne).abs()).max(nn_float(0));
+		w10 = w00 * x1;
+		w11 = w01 * x1;
+		w00 *= x0;
+		w01 *= x0;
+
+		const nn_int *nn_restrict t00 = &ctx.m_tap(0, 0);
+		const nn_int *nn_restrict t01 = &ctx.m_tap(0, 1);
+		const nn_int *nn_restrict t10 = &ctx.m_tap(0, 2);
+		const nn_int *nn_restrict t11 = &ctx.m_tap(0, 3);
+		const nn_float *nn_restrict pw00 = &w00[0];
+		const nn_float *nn_restrict pw01 = &w01[0];
+		const nn_float *nn_restrict pw10 = &w10[0];
+		const nn_float *nn_restrict pw11 = &w11[0];
+		for (nn_int c = 0; c < ctx.m_d; ++c)
+		{
+			const nn_float *nn_restrict s = &src[c * sz];
+			nn_float *nn_restrict d = &dst[c * sz];
+			for (nn_int i = 0; i < sz; ++i)
+			{
+				d[i] = pw00[i] * s[t00[i]] + pw01[i] * s[t01[i]] + pw10[i] * s[t10[i]] + pw11[i] * s[t11[i]];
+			}
+		}
+	}
+};
+
+}
+
+#endif //__DATA_AUGMENTATION_H__
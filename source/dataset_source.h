@@ -0,0 +1,105 @@
+#ifndef __DATASET_SOURCE_H__
+#define __DATASET_SOURCE_H__
+
+namespace mini_cnn
+{
+
+/*
+	samples of w * h * d uint8 pixels (channel planes, row major) with one class index each
+
+	random access sources hand out any sample by index, network::SGD shuffles
+	the index order. sequential sources can only be read front to back, a pass
+	is started with begin_pass() and read with read_next(), shuffling is up to
+	the source (e.g. shard order plus a shuffle buffer).
+*/
+class dataset_source
+{
+public:
+	virtual ~dataset_source()
+	{
+	}
+
+	virtual nn_int count() const = 0;
+	virtual nn_int width() const = 0;
+	virtual nn_int height() const = 0;
+	virtual nn_int depth() const = 0;
+	virtual nn_int class_count() const = 0;
+
+	nn_int sample_size() const
+	{
+		return width() * height() * depth();
+	}
+
+	virtual bool is_random_access() const
+	{
+		return true;
+	}
+
+	// random access
+	virtual const unsigned char* pixels(nn_int idx) const
+	{
+		nn_assert(false);
+		return nullptr;
+	}
+
+	virtual nn_int label(nn_int idx) const
+	{
+		nn_assert(false);
+		return 0;
+	}
+
+	/*
+		random access: the next pass reads the samples shuffled or in index
+		order. a mapped source passes it on to the OS as a paging hint
+	*/
+	virtual void advise_order(bool shuffle) const
+	{
+	}
+
+	// sequential, shuffle is false for evaluation passes
+	virtual void begin_pass(unsigned long long seed, bool shuffle)
+	{
+	}
+
+	// the returned pixels stay valid until the next call, nullptr at the end of the pass
+	virtual const unsigned char* read_next(nn_int &label)
+	{
+		nn_assert(false);
+		return nullptr;
+	}
+
+	// img := pixels / 255
+	static void decode_image(const unsigned char *src, varray &img)
+	{
+		nn_int sz = img.size();
+		nn_float *nn_restrict dst = &img[0];
+		const nn_float scale = cOne / (nn_float)255;
+		for (nn_int i = 0; i < sz; ++i)
+		{
+			dst[i] = src[i] * scale;
+		}
+	}
+
+	// lab := one-hot of label
+	void decode_label(nn_int label, varray &lab) const
+	{
+		nn_assert(lab.size() == class_count() && label >= 0 && label < class_count());
+		lab.make_zero();
+		lab[label] = cOne;
+	}
+
+	void get_image(nn_int idx, varray &img) const
+	{
+		nn_assert(img.size() == sample_size());
+		decode_image(pixels(idx), img);
+	}
+
+	void get_label(nn_int idx, varray &lab) const
+	{
+		decode_label(label(idx), lab);
+	}
+};
+
+}
+
+#endif //__DATASET_SOURCE_H__
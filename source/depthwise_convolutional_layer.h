@@ -0,0 +1,248 @@
+#ifndef __DEPTHWISE_CONVOLUTIONAL_LAYER_H__
+#define __DEPTHWISE_CONVOLUTIONAL_LAYER_H__
+
+namespace mini_cnn
+{
+
+/*
+	depthwise convolution: one filter_w X filter_h filter per channel,
+	channel c of the output only sees channel c of the input
+
+	z(j, i, c) = sum_u_v( x(j * stride_w + u, i * stride_h + v, c) * w(u, v, c) ) + b(c)
+
+	no im2col, every filter tap is one pass over an output row, so the inner
+	loops run along the width and vectorize. followed by a 1x1 convolution it
+	makes a depthwise separable convolution.
+*/
+class depthwise_convolutional_layer : public layer_base
+{
+protected:
+	nn_int m_filter_w;
+	nn_int m_filter_h;
+	nn_int m_channels;
+	nn_int m_stride_w;
+	nn_int m_stride_h;
+	activation_type m_activation_type;
+	active_func m_f;
+	active_func m_df;
+
+public:
+	depthwise_convolutional_layer(nn_int filter_w, nn_int filter_h, nn_int channels, nn_int stride_w, nn_int stride_h, activation_type ac_type)
+		: layer_base()
+		, m_filter_w(filter_w), m_filter_h(filter_h), m_channels(channels)
+		, m_stride_w(stride_w), m_stride_h(stride_h), m_activation_type(ac_type)
+	{
+		nn_assert(stride_w > 0 && stride_h > 0);
+		switch (ac_type)
+		{
+		case activation_type::eSigmod:
+			m_f = sigmoid;
+			m_df = deriv_sigmoid;
+			break;
+		case activation_type::eRelu:
+			m_f = relu;
+			m_df = deriv_relu;
+			break;
+		case activation_type::eIdentity:
+			m_f = identity;
+			m_df = deriv_identity;
+			break;
+		default:
+			nn_assert(false);
+			break;
+		}
+	}
+
+	virtual void describe(layer_desc &desc) const
+	{
+		desc.m_type = layer_type::eDepthwiseConvLayer;
+		desc.m_args[0] = m_filter_w;
+		desc.m_args[1] = m_filter_h;
+		desc.m_args[2] = m_channels;
+		desc.m_args[3] = m_stride_w;
+		desc.m_args[4] = m_stride_h;
+		desc.m_args[5] = m_activation_type;
+	}
+
+	virtual void connect(layer_base *next)
+	{
+		layer_base::connect(next);
+
+		nn_assert(m_prev->m_out_shape.is_img());
+		nn_assert(m_prev->m_out_shape.m_d == m_channels);
+
+		nn_int in_w = m_prev->m_out_shape.m_w;
+		nn_int in_h = m_prev->m_out_shape.m_h;
+		nn_int out_w = (in_w - m_filter_w) / m_stride_w + 1;
+		nn_int out_h = (in_h - m_filter_h) / m_stride_h + 1;
+		m_out_shape.set(out_w, out_h, m_channels);
+
+		m_b.resize(m_channels);
+		m_w.resize(m_filter_w, m_filter_h, 1, m_channels);
+	}
+
+	virtual nn_int fan_in_size() const
+	{
+		return m_filter_w * m_filter_h;
+	}
+
+	virtual nn_int fan_out_size() const
+	{
+		return (m_filter_w / m_stride_w) * (m_filter_h / m_stride_h);
+	}
+
+	virtual void alloc_task_storage(memory_arena &arena, nn_int task_idx)
+	{
+		const shape3d &in = m_prev->m_out_shape;
+		const shape3d &out = m_out_shape;
+
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		arena.alloc(ts.m_dw, storage_type::eBackward, m_w.width(), m_w.height(), m_w.depth(), m_w.count());
+		arena.alloc(ts.m_db, storage_type::eBackward, m_channels);
+		alloc_z(arena, task_idx, m_activation_type, out.m_w, out.m_h, out.m_d);
+		arena.alloc(ts.m_x, storage_type::eOutput, out.m_w, out.m_h, out.m_d);
+		arena.alloc(ts.m_delta, storage_type::eBackward, out.m_w, out.m_h, out.m_d);
+		alloc_wd(arena, task_idx, in.m_w, in.m_h, in.m_d);
+	}
+
+	virtual void forw_prop(const varray &input, nn_int task_idx)
+	{
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		varray &out_z = z_buffer(ts, m_activation_type);
+		nn_int in_w = input.width();
+		nn_int in_h = input.height();
+		nn_int out_w = m_out_shape.m_w;
+		nn_int out_h = m_out_shape.m_h;
+		nn_assert(in_h >= (out_h - 1) * m_stride_h + m_filter_h);
+
+		for (nn_int c = 0; c < m_channels; ++c)
+		{
+			const nn_float *img = &input(0, 0, c);
+			const nn_float *filter = &m_w(0, 0, 0, c);
+			nn_float bc = m_b[c];
+			for (nn_int i = 0; i < out_h; ++i)
+			{
+				nn_float *nn_restrict z = &out_z(0, i, c);
+				for (nn_int j = 0; j < out_w; ++j)
+				{
+					z[j] = bc;
+				}
+				for (nn_int v = 0; v < m_filter_h; ++v)
+				{
+					const nn_float *row = img + (i * m_stride_h + v) * in_w;
+					for (nn_int u = 0; u < m_filter_w; ++u)
+					{
+						row_madd(z, row + u, m_stride_w, filter[u + v * m_filter_w], out_w);
+					}
+				}
+			}
+		}
+
+		activate(ts, m_activation_type, m_f);
+	}
+
+	virtual void back_prop(const varray &next_wd, nn_int task_idx)
+	{
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		const varray &input = m_prev->get_output(task_idx);
+		nn_int in_w = input.width();
+		nn_int out_w = m_out_shape.m_w;
+		nn_int out_h = m_out_shape.m_h;
+
+		// delta := next_wd * df(z)
+		activation_delta(ts, m_activation_type, m_df, next_wd);
+
+		bool need_wd = m_need_input_gradient;
+		if (need_wd)
+		{
+			ts.m_wd.make_zero();
+		}
+		for (nn_int c = 0; c < m_channels; ++c)
+		{
+			const nn_float *img = &input(0, 0, c);
+			const nn_float *filter = &m_w(0, 0, 0, c);
+			nn_float *dw = &ts.m_dw(0, 0, 0, c);
+			nn_float *wd = need_wd ? &ts.m_wd(0, 0, c) : nullptr;
+			nn_float db = 0;
+			for (nn_int i = 0; i < out_h; ++i)
+			{
+				const nn_float *delta = &ts.m_delta(0, i, c);
+				for (nn_int j = 0; j < out_w; ++j)
+				{
+					db += delta[j];
+				}
+				for (nn_int v = 0; v < m_filter_h; ++v)
+				{
+					nn_int offset = (i * m_stride_h + v) * in_w;
+					for (nn_int u = 0; u < m_filter_w; ++u)
+					{
+						// dw(u, v) += delta . x row,  wd row += w(u, v) * delta
+						dw[u + v * m_filter_w] += row_dot(delta, img + offset + u, m_stride_w, out_w);
+						if (need_wd)
+						{
+							row_scatter(wd + offset + u, m_stride_w, delta, filter[u + v * m_filter_w], out_w);
+						}
+					}
+				}
+			}
+			ts.m_db[c] += db;
+		}
+	}
+
+private:
+	// z[j] += a * x[j * stride]
+	static inline void row_madd(nn_float *nn_restrict z, const nn_float *nn_restrict x, nn_int stride, nn_float a, nn_int n)
+	{
+		if (stride == 1)
+		{
+			for (nn_int j = 0; j < n; ++j)
+			{
+				z[j] += a * x[j];
+			}
+		}
+		else
+		{
+			for (nn_int j = 0; j < n; ++j)
+			{
+				z[j] += a * x[j * stride];
+			}
+		}
+	}
+
+	// sum of d[j] * x[j * stride], a float reduction only vectorizes through eigen
+	static inline nn_float row_dot(const nn_float *nn_restrict d, const nn_float *nn_restrict x, nn_int stride, nn_int n)
+	{
+		typedef Map<const Matrix<nn_float, Dynamic, 1>, AlignmentType::Unaligned> const_vec;
+		if (stride == 1)
+		{
+			return const_vec(d, n).dot(const_vec(x, n));
+		}
+		nn_float s = 0;
+		for (nn_int j = 0; j < n; ++j)
+		{
+			s += d[j] * x[j * stride];
+		}
+		return s;
+	}
+
+	// y[j * stride] += a * d[j]
+	static inline void row_scatter(nn_float *nn_restrict y, nn_int stride, const nn_float *nn_restrict d, nn_float a, nn_int n)
+	{
+		if (stride == 1)
+		{
+			for (nn_int j = 0; j < n; ++j)
+			{
+				y[j] += a * d[j];
+			}
+		}
+		else
+		{
+			for (nn_int j = 0; j < n; ++j)
+			{
+				y[j * stride] += a * d[j];
+			}
+		}
+	}
+};
+}
+#endif //__DEPTHWISE_CONVOLUTIONAL_LAYER_H__
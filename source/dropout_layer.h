@@ -1,6 +1,8 @@
 #ifndef __DROPOUT_LAYER_H__
 #define __DROPOUT_LAYER_H__
 
+#include <cstring>
+
 namespace mini_cnn 
 {
 
@@ -13,10 +15,13 @@ protected:
 
 	struct dropout_task_storage
 	{
-		std::vector<nn_int> m_drop_mask;
+		_varray<nn_int> m_drop_mask;
 	};
 	std::vector<dropout_task_storage> m_dropout_task_storage;
 
+	// masks of the minibatch, input size X batch size, for segments forwarded twice (network::train_stages)
+	_varray<nn_int> m_batch_mask;
+
 public:
 	dropout_layer(nn_float drop_prob)
 		: layer_base()
@@ -25,6 +30,12 @@ public:
 	{
 	}
 
+	virtual void describe(layer_desc &desc) const
+	{
+		desc.m_type = layer_type::eDropoutLayer;
+		desc.m_prob = m_drop_prob;
+	}
+
 	virtual void connect(layer_base *next)
 	{
 		layer_base::connect(next);
@@ -37,38 +48,39 @@ public:
 	}
 
 	virtual void set_task_count(nn_int task_count)
+	{
+		m_task_storage.resize(task_count);
+		m_dropout_task_storage.resize(task_count);
+	}
+
+	virtual void alloc_task_storage(memory_arena &arena, nn_int task_idx)
 	{
 		nn_int in_w = m_prev->m_out_shape.m_w;
 		nn_int in_h = m_prev->m_out_shape.m_h;
 		nn_int in_d = m_prev->m_out_shape.m_d;
 		nn_int in_sz = m_prev->m_out_shape.size();
-		m_task_storage.resize(task_count);
-		for (auto& ts : m_task_storage)
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		if (!m_out_shape.is_img())
 		{
-			if (!m_out_shape.is_img())
-			{
-				ts.m_x.resize(in_sz);
-			}
-			else
-			{
-				ts.m_x.resize(in_w, in_h, in_d);
-			}
-			ts.m_wd.resize(in_w, in_h, in_d);
+			arena.alloc(ts.m_x, storage_type::eOutput, in_sz);
 		}
-
-		m_dropout_task_storage.resize(task_count);
-		for (auto& dts : m_dropout_task_storage)
+		else
 		{
-			dts.m_drop_mask.resize(in_sz);
+			arena.alloc(ts.m_x, storage_type::eOutput, in_w, in_h, in_d);
 		}
+		alloc_wd(arena, task_idx, in_w, in_h, in_d);
+
+		arena.alloc(m_dropout_task_storage[task_idx].m_drop_mask, storage_type::eBackward, in_sz);
 	}
 
 	virtual void forw_prop(const varray &input, nn_int task_idx)
 	{
-		std::vector<nn_int> &drop_mask = m_dropout_task_storage[task_idx].m_drop_mask;
+		_varray<nn_int> &drop_mask = m_dropout_task_storage[task_idx].m_drop_mask;
 		varray &out_x = m_task_storage[task_idx].m_x;
 		nn_int in_sz = input.size();
-		if (m_phase_type == phase_type::eTrain)
+		// a recomputed checkpoint segment must replay the mask of the first pass
+		bool replay = m_phase_type == phase_type::eGradientCheck || m_task_storage[task_idx].m_recompute;
+		if (m_phase_type == phase_type::eTrain && !replay)
 		{
 			for (nn_int i = 0; i < in_sz; ++i)
 			{
@@ -83,7 +95,7 @@ public:
 				}
 			}
 		}
-		else if (m_phase_type == phase_type::eGradientCheck)
+		else if (replay)
 		{
 			for (nn_int i = 0; i < in_sz; ++i)
 			{
@@ -97,30 +109,47 @@ public:
 				out_x[i] = input[i];
 			}
 		}
-
-		if (m_next != nullptr)
-		{
-			m_next->forw_prop(out_x, task_idx);
-		}
 	}
 
 	virtual void back_prop(const varray &next_wd, nn_int task_idx)
 	{
 		layer_base::task_storage &ts = m_task_storage[task_idx];
-		std::vector<nn_int> &drop_mask = m_dropout_task_storage[task_idx].m_drop_mask;
+		_varray<nn_int> &drop_mask = m_dropout_task_storage[task_idx].m_drop_mask;
 		nn_int in_sz = drop_mask.size();
 		for (nn_int i = 0; i < in_sz; ++i)
 		{
 			ts.m_wd[i] = drop_mask[i] * next_wd[i];
 		}
-		m_prev->back_prop(ts.m_wd, task_idx);
+	}
+
+	void begin_batch(nn_int batch_size)
+	{
+		nn_int in_sz = m_prev->m_out_shape.size();
+		if (m_batch_mask.width() != in_sz || m_batch_mask.height() != batch_size)
+		{
+			m_batch_mask.resize(in_sz, batch_size);
+		}
+	}
+
+	// after the first forward pass of sample
+	void keep_mask(nn_int sample, nn_int task_idx)
+	{
+		const _varray<nn_int> &drop_mask = m_dropout_task_storage[task_idx].m_drop_mask;
+		::memcpy(&m_batch_mask(0, sample), &drop_mask[0], drop_mask.size() * sizeof(nn_int));
+	}
+
+	// before a second forward pass of sample, which replays the mask
+	void restore_mask(nn_int sample, nn_int task_idx)
+	{
+		_varray<nn_int> &drop_mask = m_dropout_task_storage[task_idx].m_drop_mask;
+		::memcpy(&drop_mask[0], &m_batch_mask(0, sample), drop_mask.size() * sizeof(nn_int));
 	}
 
 	// for gradient check you should fixed the drop probability
 	virtual void set_fixed_prop(nn_int task_idx)
 	{
-		std::vector<nn_int> &drop_mask = m_dropout_task_storage[task_idx].m_drop_mask;
-		nn_int sz = (nn_int)drop_mask.size();
+		_varray<nn_int> &drop_mask = m_dropout_task_storage[task_idx].m_drop_mask;
+		nn_int sz = drop_mask.size();
 		for (nn_int i = 0; i < sz; ++i)
 		{
 			drop_mask[i] = drop() ? 1 : 0;
@@ -147,9 +147,9 @@ namespace mini_cnn
 	}
 #endif
 
-	// m := x * y
+	// m += x * y
 	// 
-	// get matrix by vector multiply vector
+	// accumulate matrix of vector multiply vector
 	// m: matrix with shape of h X w
 	// x, y: vector
 	static inline void fo_vv_m(nn_float *nn_restrict x, nn_int h, nn_float *nn_restrict y, nn_int w, nn_float *nn_restrict m)
@@ -160,7 +160,7 @@ namespace mini_cnn
 			nn_float xi = x[i];
 			for (nn_int j = 0; j < w; ++j)
 			{
-				vec_m[j] = xi * y[j];
+				vec_m[j] += xi * y[j];
 			}
 		}
 	}
@@ -1,20 +1,43 @@
 #ifndef __FULLY_CONNECTED_LAYER_H__
 #define __FULLY_CONNECTED_LAYER_H__
 
+#include <vector>
+#include <memory>
+#include <mutex>
+
 namespace mini_cnn
 {
 class fully_connected_layer : public layer_base
 {
 protected:
 	nn_int m_neural_count;
+	activation_type m_activation_type;
 	active_func m_f;
 	active_func m_df;
 
+	// sharded gradient accumulation, see set_gradient_shards
+	struct grad_stage
+	{
+		varray m_input;  // rank X in_sz, staged samples
+		varray m_delta;  // rank X out_sz
+		nn_int m_count;
+
+		grad_stage() : m_count(0)
+		{
+		}
+	};
+
+	nn_int m_shard_count;  // 0: every task has its own m_dw
+	nn_int m_rank;
+	std::unique_ptr<std::mutex[]> m_shard_locks;
+	std::vector<grad_stage> m_stages;  // per task
+
 public:
 	fully_connected_layer(nn_int neural_count, activation_type ac_type)
-		: layer_base()
+		: layer_base(), m_shard_count(0), m_rank(0)
 	{
 		m_neural_count = neural_count;
+		m_activation_type = ac_type;
 		switch (ac_type)
 		{
 		case activation_type::eSigmod:
@@ -29,6 +52,10 @@ public:
 			m_f = softmax;
 			m_df = nullptr;
 			break;
+		case activation_type::eIdentity:
+			m_f = identity;
+			m_df = deriv_identity;
+			break;
 		default:
 			break;
 		}
@@ -44,6 +71,13 @@ public:
 		return out_size();
 	}
 
+	virtual void describe(layer_desc &desc) const
+	{
+		desc.m_type = layer_type::eFullyConnectedLayer;
+		desc.m_args[0] = m_neural_count;
+		desc.m_args[1] = m_activation_type;
+	}
+
 	virtual void connect(layer_base *next)
 	{
 		layer_base::connect(next);
@@ -52,7 +86,39 @@ public:
 		m_w.resize(m_prev->out_size(), out_size());
 	}
 
+	/*
+		sharded gradient accumulation: instead of a full m_dw per task, all tasks add
+		into one weight gradient whose rows are split into shard_count shards with a
+		lock each. a task stages the inputs and deltas of rank samples and adds them
+		with one rank-k update per shard, every task starting at a different shard.
+		gradient memory is one m_dw plus rank * (in + out) values per task, the
+		summation order then depends on thread timing.
+		shard_count 0 goes back to per-task m_dw. takes effect on the next set_task_count.
+	*/
+	void set_gradient_shards(nn_int shard_count, nn_int rank = 16)
+	{
+		nn_assert(shard_count >= 0 && rank > 0);
+		m_shard_count = shard_count;
+		m_rank = rank;
+		m_shard_locks.reset(shard_count > 0 ? new std::mutex[shard_count] : nullptr);
+	}
+
 	virtual void set_task_count(nn_int task_count)
+	{
+		layer_base::set_task_count(task_count);
+		m_stages.resize(m_shard_count > 0 ? task_count : 0);
+	}
+
+	virtual void clear_grident()
+	{
+		layer_base::clear_grident();
+		for (auto &st : m_stages)
+		{
+			st.m_count = 0;
+		}
+	}
+
+	virtual void alloc_task_storage(memory_arena &arena, nn_int task_idx)
 	{
 		nn_int in_w = m_prev->m_out_shape.m_w;
 		nn_int in_h = m_prev->m_out_shape.m_h;
@@ -60,23 +126,37 @@ public:
 
 		nn_int in_sz = m_w.width();
 		nn_int out_sz = m_w.height(); 
-		m_task_storage.resize(task_count);
-		for (auto& ts : m_task_storage)
-		{
-			ts.m_dw.resize(in_sz, out_sz);
-			ts.m_db.resize(out_sz);
-			ts.m_z.resize(out_sz);
-			ts.m_x.resize(out_sz);
-			ts.m_delta.resize(out_sz);
-			if (m_prev->m_out_shape.is_img())
-			{
-				ts.m_wd.resize(in_w, in_h, in_d);
-			}
-			else
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		if (m_shard_count > 0)
+		{
+			if (task_idx == 0)
 			{
-				ts.m_wd.resize(in_sz);
+				arena.alloc(m_shared_dw, storage_type::eBackward, in_sz, out_sz);
 			}
+			grad_stage &st = m_stages[task_idx];
+			st.m_count = 0;
+			arena.alloc(st.m_input, storage_type::eBackward, in_sz, m_rank);
+			arena.alloc(st.m_delta, storage_type::eBackward, out_sz, m_rank);
+			ts.m_dw.resize(0);
 		}
+		else
+		{
+			arena.alloc(ts.m_dw, storage_type::eBackward, in_sz, out_sz);
+			m_shared_dw.resize(0);
+		}
+		arena.alloc(ts.m_db, storage_type::eBackward, out_sz);
+		alloc_z(arena, task_idx, m_activation_type, out_sz);
+		arena.alloc(ts.m_x, storage_type::eOutput, out_sz);
+		arena.alloc(ts.m_delta, storage_type::eBackward, out_sz);
+		if (m_prev->m_out_shape.is_img())
+		{
+			alloc_wd(arena, task_idx, in_w, in_h, in_d);
+		}
+		else
+		{
+			alloc_wd(arena, task_idx, in_sz);
+		}
+		alloc_nz(arena, task_idx);
 	}
 
 	virtual void forw_prop(const varray &input, nn_int task_idx)
@@ -87,21 +167,28 @@ public:
 		nn_assert(width == input.size());
 
 		layer_base::task_storage &ts = m_task_storage[task_idx];
+		varray &z = z_buffer(ts, m_activation_type);
 
-		nn_assert(ts.m_z.width() == height);
-
-		// z = w * input + b
-		fo_mvv_v(&m_w[0], width, height
-			, (nn_float*)&input[0]
-			, &m_b[0]
-			, &ts.m_z[0]);
+		nn_assert(z.width() == height);
 
-		m_f(ts.m_z, ts.m_x);
-
-		if (m_next != nullptr)
+		const nn_int *in_index;
+		const nn_float *in_value;
+		nn_int in_nnz = m_prev->get_sparse_output(task_idx, in_index, in_value);
+		// the gather beats the vectorized gemv below ~1/6 of the inputs (mnist has ~1/5)
+		if (in_nnz >= 0 && in_nnz * 6 <= width)
+		{
+			sparse_forward(in_index, in_value, in_nnz, z);
+		}
+		else
 		{
-			m_next->forw_prop(ts.m_x, task_idx);
+			// z = w * input + b
+			fo_mvv_v(&m_w[0], width, height
+				, (nn_float*)&input[0]
+				, &m_b[0]
+				, &z[0]);
 		}
+
+		activate(ts, m_activation_type, m_f);
 	}
 
 	virtual void back_prop(const varray &next_wd, nn_int task_idx)
@@ -109,7 +196,7 @@ public:
 		layer_base::task_storage &ts = m_task_storage[task_idx];
 
 		nn_assert(m_w.dim() == 2);
-		nn_assert(next_wd.size() == ts.m_z.size());
+		nn_assert(next_wd.size() == ts.m_x.size());
 
 		const varray &input = m_prev->get_output(task_idx);
 
@@ -122,28 +209,22 @@ public:
 		/*
 			prev delta := w * delta  df(z)
 		*/
-		m_df(ts.m_z, ts.m_delta);
-
-		const nn_float *nn_restrict vec_next_wd = &next_wd[0];
+		activation_delta(ts, m_activation_type, m_df, next_wd);
 		nn_float *nn_restrict vec_delta = &ts.m_delta[0];
-		for (nn_int i = 0; i < out_sz; ++i)
+
+		nn_int nnz = compact_delta(ts);
+		if (nnz >= 0)
 		{
-			vec_delta[i] *= vec_next_wd[i];
+			sparse_backward(input, nnz, task_idx);
+			return;
 		}
 
-		/*
-			dw := db * input
-		*/
-		nn_float *nn_restrict vec_db = &ts.m_db[0];
-		for (nn_int i = 0; i < out_sz; ++i)
+		accumulate_gradient(input, task_idx);
+		if (!m_need_input_gradient)
 		{
-			vec_db[i] = vec_delta[i];
+			return;
 		}
 
-		fo_vv_m(vec_delta, out_sz
-			, (nn_float*)&input[0], in_sz
-			, &ts.m_dw[0]);
-
 		/*
 			m_w : out_sz X in_sz
 			wd := w.transpose * delta
@@ -151,9 +232,189 @@ public:
 		fo_mtv_v(&m_w[0], in_sz, out_sz
 			, vec_delta
 			, &ts.m_wd[0]);
+	}
+
+	virtual void flush_gradient(nn_int task_idx)
+	{
+		if (m_shard_count == 0 || m_stages[task_idx].m_count == 0)
+		{
+			return;
+		}
+
+		typedef Map<Matrix<nn_float, Dynamic, Dynamic, RowMajor>, AlignmentType::Unaligned> row_mat;
+		grad_stage &st = m_stages[task_idx];
+		nn_int in_sz = m_w.width();
+		nn_int out_sz = m_w.height();
+		row_mat input(&st.m_input[0], st.m_count, in_sz);
+		row_mat delta(&st.m_delta[0], st.m_count, out_sz);
+		row_mat dw(&m_shared_dw[0], out_sz, in_sz);
+		for (nn_int j = 0; j < m_shard_count; ++j)
+		{
+			nn_int shard = (task_idx + j) % m_shard_count;
+			nn_int row_begin = out_sz * shard / m_shard_count;
+			nn_int rows = out_sz * (shard + 1) / m_shard_count - row_begin;
+			std::lock_guard<std::mutex> lock(m_shard_locks[shard]);
+			dw.middleRows(row_begin, rows).noalias() += delta.middleCols(row_begin, rows).transpose() * input;
+		}
+		st.m_count = 0;
+	}
+
+protected:
+	/*
+		back_prop for a delta with nnz nonzero values listed in m_nz, only
+		their rows of m_w / m_dw are touched:
+			db[i] += delta[i], dw row i += delta[i] * input, wd += delta[i] * w row i
+		sharded gradients stage the sample as usual
+	*/
+	void sparse_backward(const varray &input, nn_int nnz, nn_int task_idx)
+	{
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		nn_int in_sz = input.size();
+		const nn_int *nz = &ts.m_nz[0];
+		const nn_float *vec_delta = &ts.m_delta[0];
+		const nn_float *nn_restrict vec_input = &input[0];
+		bool sharded = m_shard_count > 0;
+		if (sharded)
+		{
+			accumulate_gradient(input, task_idx);
+		}
+		const nn_int *in_index;
+		const nn_float *in_value;
+		nn_int in_nnz = m_prev->get_sparse_output(task_idx, in_index, in_value);
+
+		if (m_need_input_gradient)
+		{
+			ts.m_wd.make_zero();
+		}
+		for (nn_int k = 0; k < nnz; ++k)
+		{
+			nn_int i = nz[k];
+			nn_float d = vec_delta[i];
+			const nn_float *nn_restrict w_row = &m_w(0, i);
+			if (!sharded)
+			{
+				ts.m_db[i] += d;
+				nn_float *nn_restrict dw_row = &ts.m_dw(0, i);
+				if (in_nnz >= 0)
+				{
+					scatter_row(dw_row, d, in_index, in_value, in_nnz);
+				}
+				else
+				{
+					for (nn_int j = 0; j < in_sz; ++j)
+					{
+						dw_row[j] += d * vec_input[j];
+					}
+				}
+			}
+			if (m_need_input_gradient)
+			{
+				nn_float *nn_restrict vec_wd = &ts.m_wd[0];
+				for (nn_int j = 0; j < in_sz; ++j)
+				{
+					vec_wd[j] += d * w_row[j];
+				}
+			}
+		}
+	}
+
+	/*
+		db += delta, dw += delta * input, gradients add up over the samples of a task.
+		sharded: the sample is staged and a full stage goes to the shared gradient
+	*/
+	void accumulate_gradient(const varray &input, nn_int task_idx)
+	{
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		nn_int in_sz = input.size();
+		nn_int out_sz = ts.m_delta.size();
+
+		nn_float *nn_restrict vec_db = &ts.m_db[0];
+		const nn_float *nn_restrict vec_delta = &ts.m_delta[0];
+		for (nn_int i = 0; i < out_sz; ++i)
+		{
+			vec_db[i] += vec_delta[i];
+		}
 
-		m_prev->back_prop(ts.m_wd, task_idx);
+		if (m_shard_count == 0)
+		{
+			const nn_int *in_index;
+			const nn_float *in_value;
+			nn_int in_nnz = m_prev->get_sparse_output(task_idx, in_index, in_value);
+			if (in_nnz >= 0)
+			{
+				for (nn_int i = 0; i < out_sz; ++i)
+				{
+					if (vec_delta[i] != 0)
+					{
+						scatter_row(&ts.m_dw(0, i), vec_delta[i], in_index, in_value, in_nnz);
+					}
+				}
+				return;
+			}
+			fo_vv_m((nn_float*)vec_delta, out_sz
+				, (nn_float*)&input[0], in_sz
+				, &ts.m_dw[0]);
+			return;
+		}
+
+		grad_stage &st = m_stages[task_idx];
+		::memcpy(&st.m_input(0, st.m_count), &input[0], in_sz * sizeof(nn_float));
+		::memcpy(&st.m_delta(0, st.m_count), vec_delta, out_sz * sizeof(nn_float));
+		if (++st.m_count == m_rank)
+		{
+			flush_gradient(task_idx);
+		}
+	}
+
+	/*
+		z[i] = b[i] + sum of w(index[k], i) * value[k], a gather over the nonzero
+		inputs. four rows share every (index, value) load and the four sums
+		are independent, a single running sum waits on the previous add
+	*/
+	void sparse_forward(const nn_int *nn_restrict index, const nn_float *nn_restrict value, nn_int nnz, varray &z) const
+	{
+		nn_int height = m_w.height();
+		nn_int i = 0;
+		for (; i + 4 <= height; i += 4)
+		{
+			const nn_float *nn_restrict w0 = &m_w(0, i);
+			const nn_float *nn_restrict w1 = &m_w(0, i + 1);
+			const nn_float *nn_restrict w2 = &m_w(0, i + 2);
+			const nn_float *nn_restrict w3 = &m_w(0, i + 3);
+			nn_float s0 = m_b[i], s1 = m_b[i + 1], s2 = m_b[i + 2], s3 = m_b[i + 3];
+			for (nn_int k = 0; k < nnz; ++k)
+			{
+				nn_int j = index[k];
+				nn_float v = value[k];
+				s0 += w0[j] * v;
+				s1 += w1[j] * v;
+				s2 += w2[j] * v;
+				s3 += w3[j] * v;
+			}
+			z[i] = s0;
+			z[i + 1] = s1;
+			z[i + 2] = s2;
+			z[i + 3] = s3;
+		}
+		for (; i < height; ++i)
+		{
+			const nn_float *nn_restrict w_row = &m_w(0, i);
+			nn_float s = m_b[i];
+			for (nn_int k = 0; k < nnz; ++k)
+			{
+				s += w_row[index[k]] * value[k];
+			}
+			z[i] = s;
+		}
+	}
 
+	// dw_row[index[k]] += d * value[k], the outer product row of a sparse input
+	static inline void scatter_row(nn_float *nn_restrict dw_row, nn_float d, const nn_int *nn_restrict index, const nn_float *nn_restrict value, nn_int nnz)
+	{
+		for (nn_int k = 0; k < nnz; ++k)
+		{
+			dw_row[index[k]] += d * value[k];
+		}
 	}
 
 };
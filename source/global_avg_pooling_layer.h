@@ -0,0 +1,81 @@
+#ifndef __GLOBAL_AVG_POOLING_LAYER_H__
+#define __GLOBAL_AVG_POOLING_LAYER_H__
+
+namespace mini_cnn
+{
+
+/*
+	mean of every channel of an image, the output is a vector of depth values
+
+	x(c) = sum_i_j( in(j, i, c) ) / (w * h)
+
+	replaces the flatten + fully connected head of a cnn: a 1x1 convolution
+	to the wanted channel count followed by this layer has no weights that
+	grow with the image size. backward spreads next_wd(c) / (w * h) over the
+	whole channel.
+*/
+class global_avg_pooling_layer : public layer_base
+{
+protected:
+	typedef Map<Matrix<nn_float, Dynamic, Dynamic, RowMajor>, AlignmentType::Unaligned> row_mat;
+	typedef Map<Matrix<nn_float, Dynamic, 1>, AlignmentType::Unaligned> col_vec;
+
+public:
+	global_avg_pooling_layer() : layer_base()
+	{
+	}
+
+	virtual void describe(layer_desc &desc) const
+	{
+		desc.m_type = layer_type::eGlobalAvgPoolingLayer;
+	}
+
+	virtual void connect(layer_base *next)
+	{
+		layer_base::connect(next);
+
+		nn_assert(m_prev->m_out_shape.is_img());
+
+		m_out_shape.set(m_prev->m_out_shape.m_d, 1, 1);
+	}
+
+	virtual void alloc_task_storage(memory_arena &arena, nn_int task_idx)
+	{
+		const shape3d &in = m_prev->m_out_shape;
+
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		arena.alloc(ts.m_x, storage_type::eOutput, in.m_d);
+		alloc_wd(arena, task_idx, in.m_w, in.m_h, in.m_d);
+	}
+
+	virtual void forw_prop(const varray &input, nn_int task_idx)
+	{
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		nn_int channels = input.depth();
+		nn_int n = input.width() * input.height();
+
+		row_mat x((nn_float*)&input[0], channels, n);
+		col_vec out(&ts.m_x[0], channels);
+		out.noalias() = x.rowwise().sum() * (cOne / n);
+	}
+
+	virtual void back_prop(const varray &next_wd, nn_int task_idx)
+	{
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		nn_int channels = ts.m_wd.depth();
+		nn_int n = ts.m_wd.width() * ts.m_wd.height();
+		nn_float inv_n = cOne / n;
+
+		for (nn_int c = 0; c < channels; ++c)
+		{
+			nn_float g = next_wd[c] * inv_n;
+			nn_float *nn_restrict wd = &ts.m_wd(0, 0, c);
+			for (nn_int i = 0; i < n; ++i)
+			{
+				wd[i] = g;
+			}
+		}
+	}
+};
+}
+#endif //__GLOBAL_AVG_POOLING_LAYER_H__
@@ -0,0 +1,306 @@
+#ifndef __GROUPED_CONVOLUTIONAL_LAYER_H__
+#define __GROUPED_CONVOLUTIONAL_LAYER_H__
+
+namespace mini_cnn
+{
+
+/*
+	grouped convolution: the input channels and the filters are split into
+	groups, filter k of group g only spans the in_channels / groups channels
+	of group g. groups = 1 is a dense convolution, filter_n = groups =
+	in_channels a depthwise one (depthwise_convolutional_layer is faster).
+
+	every group is one gemm on the channel-major layout:
+		z_g[filter_n / groups X out_w * out_h] = w_g * col_g
+	col_g is the im2col matrix of the group's channels. a 1x1 stride 1 filter
+	needs no im2col, the channels of the group already are col_g (pointwise
+	convolution).
+*/
+class grouped_convolutional_layer : public layer_base
+{
+protected:
+	typedef Map<Matrix<nn_float, Dynamic, Dynamic, RowMajor>, AlignmentType::Unaligned> row_mat;
+
+	nn_int m_filter_w;
+	nn_int m_filter_h;
+	nn_int m_in_channels;
+	nn_int m_filter_count;
+	nn_int m_groups;
+	nn_int m_stride_w;
+	nn_int m_stride_h;
+	activation_type m_activation_type;
+	active_func m_f;
+	active_func m_df;
+
+	struct grouped_task_storage
+	{
+		varray m_col;  // im2col matrix of one group, empty for pointwise
+	};
+	std::vector<grouped_task_storage> m_grouped_task_storage;
+
+public:
+	grouped_convolutional_layer(nn_int filter_w, nn_int filter_h, nn_int in_channels, nn_int filter_n, nn_int groups, nn_int stride_w, nn_int stride_h, activation_type ac_type)
+		: layer_base()
+		, m_filter_w(filter_w), m_filter_h(filter_h), m_in_channels(in_channels), m_filter_count(filter_n), m_groups(groups)
+		, m_stride_w(stride_w), m_stride_h(stride_h), m_activation_type(ac_type)
+	{
+		nn_assert(groups > 0 && in_channels % groups == 0 && filter_n % groups == 0);
+		nn_assert(stride_w > 0 && stride_h > 0);
+		switch (ac_type)
+		{
+		case activation_type::eSigmod:
+			m_f = sigmoid;
+			m_df = deriv_sigmoid;
+			break;
+		case activation_type::eRelu:
+			m_f = relu;
+			m_df = deriv_relu;
+			break;
+		case activation_type::eIdentity:
+			m_f = identity;
+			m_df = deriv_identity;
+			break;
+		default:
+			nn_assert(false);
+			break;
+		}
+	}
+
+	virtual void describe(layer_desc &desc) const
+	{
+		desc.m_type = layer_type::eGroupedConvLayer;
+		desc.m_args[0] = m_filter_w;
+		desc.m_args[1] = m_filter_h;
+		desc.m_args[2] = m_in_channels;
+		desc.m_args[3] = m_filter_count;
+		desc.m_args[4] = m_groups;
+		desc.m_args[5] = m_stride_w;
+		desc.m_args[6] = m_stride_h;
+		desc.m_args[7] = m_activation_type;
+	}
+
+	virtual void connect(layer_base *next)
+	{
+		layer_base::connect(next);
+
+		nn_assert(m_prev->m_out_shape.is_img());
+		nn_assert(m_prev->m_out_shape.m_d == m_in_channels);
+
+		nn_int in_w = m_prev->m_out_shape.m_w;
+		nn_int in_h = m_prev->m_out_shape.m_h;
+		nn_int out_w = (in_w - m_filter_w) / m_stride_w + 1;
+		nn_int out_h = (in_h - m_filter_h) / m_stride_h + 1;
+		m_out_shape.set(out_w, out_h, m_filter_count);
+
+		m_b.resize(m_filter_count);
+		m_w.resize(m_filter_w, m_filter_h, m_in_channels / m_groups, m_filter_count);
+	}
+
+	virtual nn_int fan_in_size() const
+	{
+		return m_filter_w * m_filter_h * (m_in_channels / m_groups);
+	}
+
+	virtual nn_int fan_out_size() const
+	{
+		return (m_filter_w / m_stride_w) * (m_filter_h / m_stride_h) * (m_filter_count / m_groups);
+	}
+
+	virtual void set_task_count(nn_int task_count)
+	{
+		m_task_storage.resize(task_count);
+		m_grouped_task_storage.resize(task_count);
+	}
+
+	virtual void alloc_task_storage(memory_arena &arena, nn_int task_idx)
+	{
+		const shape3d &in = m_prev->m_out_shape;
+		const shape3d &out = m_out_shape;
+
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		arena.alloc(ts.m_dw, storage_type::eBackward, m_w.width(), m_w.height(), m_w.depth(), m_w.count());
+		arena.alloc(ts.m_db, storage_type::eBackward, m_filter_count);
+		alloc_z(arena, task_idx, m_activation_type, out.m_w, out.m_h, out.m_d);
+		arena.alloc(ts.m_x, storage_type::eOutput, out.m_w, out.m_h, out.m_d);
+		arena.alloc(ts.m_delta, storage_type::eBackward, out.m_w, out.m_h, out.m_d);
+		alloc_wd(arena, task_idx, in.m_w, in.m_h, in.m_d);
+
+		varray &col = m_grouped_task_storage[task_idx].m_col;
+		if (pointwise())
+		{
+			col.resize(0);
+		}
+		else
+		{
+			// the backward pass reuses it for the gradient of col_g
+			arena.alloc(col, storage_type::eTemporary, out.m_w * out.m_h, col_rows());
+		}
+	}
+
+	virtual void forw_prop(const varray &input, nn_int task_idx)
+	{
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		varray &out_z = z_buffer(ts, m_activation_type);
+		nn_int out_n = m_out_shape.m_w * m_out_shape.m_h;
+		nn_int group_filters = m_filter_count / m_groups;
+		nn_int rows = col_rows();
+
+		for (nn_int g = 0; g < m_groups; ++g)
+		{
+			row_mat w(&m_w(0, 0, 0, g * group_filters), group_filters, rows);
+			row_mat z(&out_z(0, 0, g * group_filters), group_filters, out_n);
+			z.noalias() = w * group_input(input, g, task_idx);
+		}
+
+		for (nn_int k = 0; k < m_filter_count; ++k)
+		{
+			nn_float bk = m_b[k];
+			nn_float *nn_restrict vec_z = &out_z(0, 0, k);
+			for (nn_int i = 0; i < out_n; ++i)
+			{
+				vec_z[i] += bk;
+			}
+		}
+
+		activate(ts, m_activation_type, m_f);
+	}
+
+	virtual void back_prop(const varray &next_wd, nn_int task_idx)
+	{
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		const varray &input = m_prev->get_output(task_idx);
+		nn_int out_n = m_out_shape.m_w * m_out_shape.m_h;
+		nn_int group_filters = m_filter_count / m_groups;
+		nn_int group_channels = m_in_channels / m_groups;
+		nn_int rows = col_rows();
+
+		// delta := next_wd * df(z)
+		activation_delta(ts, m_activation_type, m_df, next_wd);
+
+		for (nn_int k = 0; k < m_filter_count; ++k)
+		{
+			const nn_float *nn_restrict delta_k = &ts.m_delta(0, 0, k);
+			nn_float s = 0;
+			for (nn_int i = 0; i < out_n; ++i)
+			{
+				s += delta_k[i];
+			}
+			ts.m_db[k] += s;
+		}
+
+		if (m_need_input_gradient)
+		{
+			ts.m_wd.make_zero();
+		}
+		for (nn_int g = 0; g < m_groups; ++g)
+		{
+			row_mat w(&m_w(0, 0, 0, g * group_filters), group_filters, rows);
+			row_mat dw(&ts.m_dw(0, 0, 0, g * group_filters), group_filters, rows);
+			row_mat delta(&ts.m_delta(0, 0, g * group_filters), group_filters, out_n);
+
+			// dw_g += delta_g * col_g', wd_g := w_g' * delta_g (through col2im) when a layer below learns
+			dw.noalias() += delta * group_input(input, g, task_idx).transpose();
+			if (!m_need_input_gradient)
+			{
+				continue;
+			}
+			if (pointwise())
+			{
+				row_mat wd(&ts.m_wd(0, 0, g * group_channels), rows, out_n);
+				wd.noalias() = w.transpose() * delta;
+			}
+			else
+			{
+				varray &col = m_grouped_task_storage[task_idx].m_col;
+				row_mat dcol(&col[0], rows, out_n);
+				dcol.noalias() = w.transpose() * delta;
+				col2im(col, g, ts.m_wd);
+			}
+		}
+	}
+
+protected:
+	bool pointwise() const
+	{
+		return m_filter_w == 1 && m_filter_h == 1 && m_stride_w == 1 && m_stride_h == 1;
+	}
+
+	nn_int col_rows() const
+	{
+		return m_filter_w * m_filter_h * (m_in_channels / m_groups);
+	}
+
+	// col_g, pointwise: the channels of group g in place
+	row_mat group_input(const varray &input, nn_int g, nn_int task_idx)
+	{
+		nn_int out_n = m_out_shape.m_w * m_out_shape.m_h;
+		nn_int group_channels = m_in_channels / m_groups;
+		if (pointwise())
+		{
+			return row_mat((nn_float*)&input(0, 0, g * group_channels), group_channels, out_n);
+		}
+		varray &col = m_grouped_task_storage[task_idx].m_col;
+		im2col(input, g, col);
+		return row_mat(&col[0], col_rows(), out_n);
+	}
+
+	// row (c * fh + v) * fw + u of col: input pixels under filter tap (u, v) of channel c of group g
+	void im2col(const varray &input, nn_int g, varray &col) const
+	{
+		nn_int in_w = input.width();
+		nn_int out_w = m_out_shape.m_w;
+		nn_int out_h = m_out_shape.m_h;
+		nn_int group_channels = m_in_channels / m_groups;
+		for (nn_int c = 0; c < group_channels; ++c)
+		{
+			const nn_float *img = &input(0, 0, g * group_channels + c);
+			for (nn_int v = 0; v < m_filter_h; ++v)
+			{
+				for (nn_int u = 0; u < m_filter_w; ++u)
+				{
+					nn_float *row = &col(0, (c * m_filter_h + v) * m_filter_w + u);
+					for (nn_int i = 0; i < out_h; ++i)
+					{
+						const nn_float *nn_restrict src = img + (i * m_stride_h + v) * in_w + u;
+						nn_float *nn_restrict dst = row + i * out_w;
+						for (nn_int j = 0; j < out_w; ++j)
+						{
+							dst[j] = src[j * m_stride_w];
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// adds every row of col back to the input pixels it was gathered from
+	void col2im(const varray &col, nn_int g, varray &wd) const
+	{
+		nn_int in_w = wd.width();
+		nn_int out_w = m_out_shape.m_w;
+		nn_int out_h = m_out_shape.m_h;
+		nn_int group_channels = m_in_channels / m_groups;
+		for (nn_int c = 0; c < group_channels; ++c)
+		{
+			nn_float *img = &wd(0, 0, g * group_channels + c);
+			for (nn_int v = 0; v < m_filter_h; ++v)
+			{
+				for (nn_int u = 0; u < m_filter_w; ++u)
+				{
+					const nn_float *row = &col(0, (c * m_filter_h + v) * m_filter_w + u);
+					for (nn_int i = 0; i < out_h; ++i)
+					{
+						nn_float *nn_restrict dst = img + (i * m_stride_h + v) * in_w + u;
+						const nn_float *nn_restrict src = row + i * out_w;
+						for (nn_int j = 0; j < out_w; ++j)
+						{
+							dst[j * m_stride_w] += src[j];
+						}
+					}
+				}
+			}
+		}
+	}
+};
+}
+#endif //__GROUPED_CONVOLUTIONAL_LAYER_H__
@@ -0,0 +1,115 @@
+#ifndef __IDX_DATASET_H__
+#define __IDX_DATASET_H__
+
+#include <string>
+#include <cstring>
+
+namespace mini_cnn
+{
+
+/*
+	images / labels IDX file pair (MNIST, Fashion-MNIST, ...), viewed through
+	the mapped files without copying
+
+	images: count * rows * cols, or count * rows * cols * depth
+	labels: count
+
+	with depth > 1 the channels are the fastest index (interleaved pixels),
+	such sets are copied once into channel planes instead of being viewed
+*/
+class idx_dataset : public compact_dataset
+{
+protected:
+	idx_file m_images;
+	idx_file m_labels;
+
+public:
+	bool open(const std::string &img_file, const std::string &label_file, nn_int class_count = 10)
+	{
+		if (!m_images.open(img_file) || !m_labels.open(label_file))
+		{
+			close();
+			return false;
+		}
+		if (m_images.dim_count() < 2 || m_labels.dim_count() != 1 || m_images.count() != m_labels.count())
+		{
+			std::cerr << "Images and labels do not match!" << img_file << std::endl;
+			close();
+			return false;
+		}
+
+		nn_int ndim = m_images.dim_count();
+		nn_int height = ndim >= 3 ? m_images.dim(1) : 1;
+		nn_int width = ndim >= 3 ? m_images.dim(2) : m_images.dim(1);
+		nn_int depth = m_images.sample_size() / (width * height);
+		nn_int count = m_images.count();
+		if (depth > 1)
+		{
+			load_planes(count, width, height, depth, class_count);
+		}
+		else
+		{
+			attach(count > 0 ? m_images.sample(0) : nullptr, count > 0 ? m_labels.sample(0) : nullptr
+				, count, width, height, depth, class_count);
+		}
+		if (!check_labels())
+		{
+			std::cerr << "Invalid label!" << label_file << std::endl;
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	// shuffled passes turn off read ahead, in order passes (evaluation) read ahead eagerly
+	virtual void advise_order(bool shuffle) const
+	{
+		if (shuffle)
+		{
+			m_images.advise_random();
+			m_labels.advise_random();
+		}
+		else
+		{
+			m_images.advise_sequential();
+			m_labels.advise_sequential();
+		}
+	}
+
+	void close()
+	{
+		attach(nullptr, nullptr, 0, 0, 0, 0, 0);
+		m_images.close();
+		m_labels.close();
+	}
+
+private:
+	// rows * cols * depth interleaved -> depth planes of rows * cols, the mapped files are closed
+	void load_planes(nn_int count, nn_int width, nn_int height, nn_int depth, nn_int class_count)
+	{
+		create(count, width, height, depth, class_count);
+		nn_int plane = width * height;
+		for (nn_int i = 0; i < count; ++i)
+		{
+			const unsigned char *src = m_images.sample(i);
+			unsigned char *dst = pixels(i);
+			for (nn_int p = 0; p < plane; ++p)
+			{
+				for (nn_int c = 0; c < depth; ++c)
+				{
+					dst[c * plane + p] = src[p * depth + c];
+				}
+			}
+		}
+		if (count > 0)
+		{
+			::memcpy(labels(), m_labels.sample(0), count);
+		}
+		m_images.close();
+		m_labels.close();
+	}
+};
+
+}
+
+#endif //__IDX_DATASET_H__
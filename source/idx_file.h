@@ -0,0 +1,165 @@
+#ifndef __IDX_FILE_H__
+#define __IDX_FILE_H__
+
+#include <string>
+#include <iostream>
+
+namespace mini_cnn
+{
+
+/*
+	read only memory mapping of an IDX file
+
+	layout (all integers big-endian):
+		0x00 0x00 <type> <ndim>
+		ndim * uint32 dimension sizes
+		data, row major, dims[0] is the sample count
+
+	only type 0x08 (unsigned byte) is accepted, any number of dimensions.
+	samples are returned as pointers into the mapping, nothing is copied,
+	pages are loaded by the OS on first touch.
+*/
+class idx_file
+{
+private:
+	mapped_file m_file;
+	index_vec m_dims;
+	const unsigned char *m_body;
+	size_t m_sample_size;
+
+public:
+	idx_file() : m_body(nullptr), m_sample_size(0)
+	{
+	}
+
+	idx_file(const idx_file&) = delete;
+	idx_file& operator=(const idx_file&) = delete;
+
+	bool open(const std::string &file_path)
+	{
+		close();
+		if (!m_file.open(file_path))
+		{
+			std::cerr << "Open failed!" << file_path << std::endl;
+			return false;
+		}
+		if (!parse_header())
+		{
+			std::cerr << "Invalid idx file!" << file_path << std::endl;
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void close()
+	{
+		m_file.close();
+		m_dims.clear();
+		m_body = nullptr;
+		m_sample_size = 0;
+	}
+
+	bool is_open() const
+	{
+		return m_file.is_open();
+	}
+
+	nn_int dim_count() const
+	{
+		return (nn_int)m_dims.size();
+	}
+
+	nn_int dim(nn_int i) const
+	{
+		nn_assert(i >= 0 && i < dim_count());
+		return m_dims[i];
+	}
+
+	nn_int count() const
+	{
+		return m_dims.empty() ? 0 : m_dims[0];
+	}
+
+	// bytes of one sample, product of dims[1..]
+	nn_int sample_size() const
+	{
+		return (nn_int)m_sample_size;
+	}
+
+	const unsigned char* sample(nn_int idx) const
+	{
+		nn_assert(idx >= 0 && idx < count());
+		return m_body + idx * m_sample_size;
+	}
+
+	/*
+		access pattern hints for sets larger than memory (idx_dataset::advise_order):
+		read ahead for passes in index order, none for shuffled ones
+	*/
+	void advise_sequential() const
+	{
+		m_file.advise_sequential();
+	}
+
+	void advise_random() const
+	{
+		m_file.advise_random();
+	}
+
+private:
+	static nn_int read_be32(const unsigned char *p)
+	{
+		return (nn_int)(((nn_uint)p[0] << 24) | ((nn_uint)p[1] << 16) | ((nn_uint)p[2] << 8) | (nn_uint)p[3]);
+	}
+
+	bool parse_header()
+	{
+		const unsigned char *data = m_file.data();
+		size_t size = m_file.size();
+		if (size < 4 || data[0] != 0 || data[1] != 0)
+		{
+			return false;
+		}
+		// 0x08: unsigned byte
+		if (data[2] != 0x08)
+		{
+			return false;
+		}
+		nn_int ndim = data[3];
+		size_t header_size = 4 + 4 * (size_t)ndim;
+		if (ndim < 1 || size < header_size)
+		{
+			return false;
+		}
+
+		m_dims.resize(ndim);
+		size_t total = 1;
+		for (nn_int i = 0; i < ndim; ++i)
+		{
+			m_dims[i] = read_be32(data + 4 + 4 * i);
+			// an empty set is fine, an empty sample is not
+			if (m_dims[i] < 0 || (i > 0 && m_dims[i] == 0))
+			{
+				return false;
+			}
+			total *= (size_t)m_dims[i];
+		}
+		if (size < header_size + total)
+		{
+			return false;
+		}
+
+		m_sample_size = 1;
+		for (nn_int i = 1; i < ndim; ++i)
+		{
+			m_sample_size *= (size_t)m_dims[i];
+		}
+		m_body = data + header_size;
+		return true;
+	}
+};
+
+}
+
+#endif //__IDX_FILE_H__
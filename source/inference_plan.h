@@ -0,0 +1,680 @@
+#ifndef __INFERENCE_PLAN_H__
+#define __INFERENCE_PLAN_H__
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+namespace mini_cnn
+{
+
+/*
+	buffers of one thread running an inference_plan: two ping-pong activation
+	buffers for up to max_batch samples and the im2col matrix of one sample,
+	all sized for the largest step at creation
+*/
+class inference_context
+{
+	friend class inference_plan;
+
+private:
+	varray m_act[2];
+	varray m_col;
+	nn_int m_max_batch;
+	const nn_float *m_output;
+
+public:
+	inference_context() : m_max_batch(0), m_output(nullptr)
+	{
+	}
+
+	nn_int max_batch() const
+	{
+		return m_max_batch;
+	}
+
+	// output of the last forward
+	const nn_float* output() const
+	{
+		return m_output;
+	}
+};
+
+/*
+	frozen inference engine, see network::compile_for_inference
+
+	the layers are flattened into a list of steps with resolved shapes:
+	convolution (im2col + one gemm per group, 1x1 without im2col), depthwise
+	convolution (row kernel), fully connected (gemv) each with bias and
+	activation fused into one pass over the result, max / avg pooling,
+	global avg pooling (one row mean per channel).
+	input and dropout layers produce no step. a batch norm layer right after
+	a conv / fc layer with eIdentity activation is folded into its weights
+	and bias, the step then takes the activation of the batch norm. any other
+	batch norm becomes a per channel scale and shift step. all weights are
+	copied into one aligned block at compile time, so a plan does not depend
+	on the network afterwards.
+
+	a plan is immutable, any number of threads may run it at once, each
+	with its own inference_context.
+*/
+class inference_plan
+{
+private:
+	enum step_type
+	{
+		eConvStep,
+		eDepthwiseConvStep,
+		eFullyConnectedStep,
+		eMaxPoolStep,
+		eAvgPoolStep,
+		eGlobalAvgPoolStep,
+		eScaleShiftStep,
+	};
+
+	enum act_type
+	{
+		eNoAct = -1,
+	};
+
+	struct step
+	{
+		step_type m_type;
+		nn_int m_activation;  // activation_type, eNoAct for pooling
+		shape3d m_in;
+		shape3d m_out;
+		nn_int m_kw;          // filter / pool window
+		nn_int m_kh;
+		nn_int m_sw;
+		nn_int m_sh;
+		nn_int m_groups;      // conv: input channels / filters split into groups
+		size_t m_w_offset;    // into m_params, scale of a scale-shift step
+		size_t m_b_offset;    // shift of a scale-shift step
+	};
+
+	typedef Map<Matrix<nn_float, Dynamic, Dynamic, RowMajor>, AlignmentType::Unaligned> plan_mat;
+	typedef Map<Matrix<nn_float, Dynamic, 1>, AlignmentType::Unaligned> plan_vec;
+	typedef Map<Matrix<nn_float, Dynamic, Dynamic, ColMajor>, AlignmentType::Unaligned> plan_cols;
+
+	std::vector<step> m_steps;
+	varray m_params;
+	shape3d m_in_shape;
+	nn_int m_out_size;
+	nn_int m_max_act_size;
+	nn_int m_max_col_size;
+
+public:
+	inference_plan() : m_out_size(0), m_max_act_size(0), m_max_col_size(0)
+	{
+	}
+
+	bool empty() const
+	{
+		return m_steps.empty();
+	}
+
+	nn_int input_size() const
+	{
+		return m_in_shape.m_w * m_in_shape.m_h * m_in_shape.m_d;
+	}
+
+	nn_int output_size() const
+	{
+		return m_out_size;
+	}
+
+	nn_int step_count() const
+	{
+		return (nn_int)m_steps.size();
+	}
+
+	// layers: input layer first, output layer last (network::layers)
+	void compile(const std::vector<layer_base*> &layers)
+	{
+		nn_assert(layers.size() >= 2);
+		m_steps.clear();
+		m_in_shape = layers[0]->m_out_shape;
+		m_max_act_size = 0;
+		m_max_col_size = 0;
+
+		std::vector<nn_float> params;  // every section starts at an aligned offset
+		shape3d in_shape = m_in_shape;
+		for (size_t i = 1; i < layers.size(); ++i)
+		{
+			const layer_base *layer = layers[i];
+			layer_desc desc;
+			layer->describe(desc);
+
+			step s;
+			s.m_activation = eNoAct;
+			s.m_in = in_shape;
+			s.m_out = layer->m_out_shape;
+			s.m_kw = s.m_kh = s.m_sw = s.m_sh = 1;
+			s.m_groups = 1;
+			s.m_w_offset = s.m_b_offset = 0;
+			switch (desc.m_type)
+			{
+			case layer_type::eConvolutionalLayer:
+				s.m_type = eConvStep;
+				s.m_kw = desc.m_args[0];
+				s.m_kh = desc.m_args[1];
+				s.m_sw = desc.m_args[4];
+				s.m_sh = desc.m_args[5];
+				s.m_activation = desc.m_args[7];
+				break;
+			case layer_type::eGroupedConvLayer:
+				s.m_type = eConvStep;
+				s.m_kw = desc.m_args[0];
+				s.m_kh = desc.m_args[1];
+				s.m_groups = desc.m_args[4];
+				s.m_sw = desc.m_args[5];
+				s.m_sh = desc.m_args[6];
+				s.m_activation = desc.m_args[7];
+				break;
+			case layer_type::eDepthwiseConvLayer:
+				s.m_type = eDepthwiseConvStep;
+				s.m_kw = desc.m_args[0];
+				s.m_kh = desc.m_args[1];
+				s.m_groups = desc.m_args[2];
+				s.m_sw = desc.m_args[3];
+				s.m_sh = desc.m_args[4];
+				s.m_activation = desc.m_args[5];
+				break;
+			case layer_type::eFullyConnectedLayer:
+			case layer_type::eOutputLayer:
+				s.m_type = eFullyConnectedStep;
+				s.m_activation = desc.m_args[1];
+				break;
+			case layer_type::eMaxPoolingLayer:
+			case layer_type::eAvgPoolingLayer:
+				s.m_type = desc.m_type == layer_type::eMaxPoolingLayer ? eMaxPoolStep : eAvgPoolStep;
+				s.m_kw = desc.m_args[0];
+				s.m_kh = desc.m_args[1];
+				s.m_sw = desc.m_args[2];
+				s.m_sh = desc.m_args[3];
+				break;
+			case layer_type::eGlobalAvgPoolingLayer:
+				s.m_type = eGlobalAvgPoolStep;
+				break;
+			case layer_type::eDropoutLayer:
+				// identity at inference
+				continue;
+			case layer_type::eBatchNormLayer:
+			{
+				varray scale, shift;
+				static_cast<const batch_norm_layer*>(layer)->inference_affine(scale, shift);
+				if (!m_steps.empty() && fold_affine(m_steps.back(), params, scale, shift))
+				{
+					m_steps.back().m_activation = desc.m_args[0];
+					continue;
+				}
+				s.m_type = eScaleShiftStep;
+				s.m_activation = desc.m_args[0];
+				s.m_w_offset = append_params(params, scale);
+				s.m_b_offset = append_params(params, shift);
+				break;
+			}
+			default:
+				nn_assert(false);
+				continue;
+			}
+			if (s.m_type == eConvStep && !pointwise(s))
+			{
+				m_max_col_size = std::max(m_max_col_size, s.m_kw * s.m_kh * s.m_in.m_d / s.m_groups * s.m_out.m_w * s.m_out.m_h);
+			}
+			if (s.m_type == eConvStep || s.m_type == eDepthwiseConvStep || s.m_type == eFullyConnectedStep)
+			{
+				s.m_w_offset = append_params(params, layer->m_w);
+				s.m_b_offset = append_params(params, layer->m_b);
+			}
+			m_max_act_size = std::max(m_max_act_size, s.m_out.size());
+			m_steps.push_back(s);
+			in_shape = s.m_out;
+		}
+		m_out_size = in_shape.size();
+
+		// the block is aligned, so every section starts at an aligned address
+		m_params.resize(std::max((nn_int)params.size(), 1));
+		m_params.make_zero();
+		if (!params.empty())
+		{
+			::memcpy(&m_params[0], params.data(), params.size() * sizeof(nn_float));
+		}
+	}
+
+	inference_context create_context(nn_int max_batch = 1) const
+	{
+		nn_assert(max_batch > 0);
+		inference_context ctx;
+		ctx.m_act[0].resize(std::max(m_max_act_size, 1) * max_batch);
+		ctx.m_act[1].resize(std::max(m_max_act_size, 1) * max_batch);
+		ctx.m_col.resize(std::max(m_max_col_size, 1));
+		ctx.m_max_batch = max_batch;
+		return ctx;
+	}
+
+	// input: input_size() values in varray layout, returns output_size() values owned by ctx
+	const nn_float* forward(const nn_float *input, inference_context &ctx) const
+	{
+		return forward_batch(input, 1, ctx);
+	}
+
+	/*
+		n samples stored one after another, returns n * output_size() values owned by ctx.
+		fully connected steps run as one gemm over the whole batch.
+	*/
+	const nn_float* forward_batch(const nn_float *input, nn_int n, inference_context &ctx) const
+	{
+		nn_assert(n > 0 && n <= ctx.m_max_batch);
+		const nn_float *in = input;
+		nn_int cur = 0;
+		for (auto &s : m_steps)
+		{
+			nn_float *out = &ctx.m_act[cur][0];
+			nn_int in_sz = s.m_in.size();
+			nn_int out_sz = s.m_out.size();
+			switch (s.m_type)
+			{
+			case eConvStep:
+				for (nn_int k = 0; k < n; ++k)
+				{
+					conv(s, in + k * in_sz, &ctx.m_col[0], out + k * out_sz);
+				}
+				break;
+			case eDepthwiseConvStep:
+				for (nn_int k = 0; k < n; ++k)
+				{
+					depthwise_conv(s, in + k * in_sz, out + k * out_sz);
+				}
+				break;
+			case eFullyConnectedStep:
+				fully_connected(s, in, n, out);
+				break;
+			case eMaxPoolStep:
+				for (nn_int k = 0; k < n; ++k)
+				{
+					max_pool(s, in + k * in_sz, out + k * out_sz);
+				}
+				break;
+			case eAvgPoolStep:
+				for (nn_int k = 0; k < n; ++k)
+				{
+					avg_pool(s, in + k * in_sz, out + k * out_sz);
+				}
+				break;
+			case eGlobalAvgPoolStep:
+				for (nn_int k = 0; k < n; ++k)
+				{
+					global_avg_pool(s, in + k * in_sz, out + k * out_sz);
+				}
+				break;
+			case eScaleShiftStep:
+				for (nn_int k = 0; k < n; ++k)
+				{
+					scale_shift(s, in + k * in_sz, out + k * out_sz);
+				}
+				break;
+			}
+			in = out;
+			cur ^= 1;
+		}
+		ctx.m_output = in;
+		return in;
+	}
+
+	const nn_float* forward(const varray &input, inference_context &ctx) const
+	{
+		nn_assert(input.size() == input_size());
+		return forward(&input[0], ctx);
+	}
+
+	// index of the largest output
+	nn_int predict(const varray &input, inference_context &ctx) const
+	{
+		const nn_float *out = forward(input, ctx);
+		return (nn_int)(std::max_element(out, out + m_out_size) - out);
+	}
+
+private:
+	static size_t align_floats(size_t n)
+	{
+		const size_t a = nn_align_size / sizeof(nn_float);
+		return (n + a - 1) / a * a;
+	}
+
+	static size_t append_params(std::vector<nn_float> &params, const varray &arr)
+	{
+		size_t offset = params.size();
+		if (arr.size() > 0)
+		{
+			params.insert(params.end(), &arr[0], &arr[0] + arr.size());
+		}
+		params.resize(align_floats(params.size()), 0);
+		return offset;
+	}
+
+	/*
+		z' = scale[k] * z + shift[k] for output channel k of a conv / fc step without
+		activation: row k of w and b[k] are scaled, shift[k] is added to b[k]
+	*/
+	static bool fold_affine(const step &s, std::vector<nn_float> &params, const varray &scale, const varray &shift)
+	{
+		bool conv = s.m_type == eConvStep || s.m_type == eDepthwiseConvStep;
+		if ((!conv && s.m_type != eFullyConnectedStep) || s.m_activation != activation_type::eIdentity)
+		{
+			return false;
+		}
+		nn_int rows = conv ? s.m_out.m_d : s.m_out.size();
+		nn_int cols = conv ? s.m_kw * s.m_kh * s.m_in.m_d / s.m_groups : s.m_in.size();
+		nn_assert(rows == scale.size());
+		for (nn_int k = 0; k < rows; ++k)
+		{
+			nn_float *w = &params[s.m_w_offset + k * cols];
+			for (nn_int j = 0; j < cols; ++j)
+			{
+				w[j] *= scale[k];
+			}
+			nn_float &b = params[s.m_b_offset + k];
+			b = b * scale[k] + shift[k];
+		}
+		return true;
+	}
+
+	// bias and activation over n values of z, in place
+	static void bias_activate(nn_float *nn_restrict z, nn_int n, nn_float b, nn_int activation)
+	{
+		switch (activation)
+		{
+		case activation_type::eRelu:
+			for (nn_int i = 0; i < n; ++i)
+			{
+				nn_float t = z[i] + b;
+				z[i] = t > 0 ? t : 0;
+			}
+			break;
+		case activation_type::eSigmod:
+			for (nn_int i = 0; i < n; ++i)
+			{
+				z[i] = cOne / (cOne + exp(-(z[i] + b)));
+			}
+			break;
+		default:
+			for (nn_int i = 0; i < n; ++i)
+			{
+				z[i] += b;
+			}
+			break;
+		}
+	}
+
+	static void softmax_inplace(nn_float *nn_restrict z, nn_int n)
+	{
+		nn_float maxv = *std::max_element(z, z + n);
+		nn_float s = 0;
+		for (nn_int i = 0; i < n; ++i)
+		{
+			z[i] = exp(z[i] - maxv);
+			s += z[i];
+		}
+		s = cOne / s;
+		for (nn_int i = 0; i < n; ++i)
+		{
+			z[i] *= s;
+		}
+	}
+
+	// 1x1 stride 1 filter, the input channels already are the im2col matrix
+	static bool pointwise(const step &s)
+	{
+		return s.m_kw == 1 && s.m_kh == 1 && s.m_sw == 1 && s.m_sh == 1;
+	}
+
+	/*
+		per group g of m_groups:
+		out_g[K/G x OH*OW] = w_g[K/G x C/G*FH*FW] * col_g[C/G*FH*FW x OH*OW]
+		the filters of m_w already are the rows of w
+	*/
+	void conv(const step &s, const nn_float *in, nn_float *col, nn_float *out) const
+	{
+		nn_int in_w = s.m_in.m_w;
+		nn_int in_h = s.m_in.m_h;
+		nn_int out_w = s.m_out.m_w;
+		nn_int out_h = s.m_out.m_h;
+		nn_int out_n = out_w * out_h;
+		nn_int filter_n = s.m_out.m_d;
+		nn_int group_channels = s.m_in.m_d / s.m_groups;
+		nn_int group_filters = filter_n / s.m_groups;
+		nn_int rows = s.m_kw * s.m_kh * group_channels;
+
+		for (nn_int g = 0; g < s.m_groups; ++g)
+		{
+			const nn_float *group_in = in + g * group_channels * in_w * in_h;
+			const nn_float *x_data = group_in;
+			if (!pointwise(s))
+			{
+				for (nn_int c = 0; c < group_channels; ++c)
+				{
+					const nn_float *img = group_in + c * in_w * in_h;
+					for (nn_int v = 0; v < s.m_kh; ++v)
+					{
+						for (nn_int u = 0; u < s.m_kw; ++u)
+						{
+							nn_float *nn_restrict row = col + ((c * s.m_kh + v) * s.m_kw + u) * out_n;
+							for (nn_int i = 0; i < out_h; ++i)
+							{
+								const nn_float *src = img + (i * s.m_sh + v) * in_w + u;
+								nn_float *dst = row + i * out_w;
+								if (s.m_sw == 1)
+								{
+									::memcpy(dst, src, out_w * sizeof(nn_float));
+								}
+								else
+								{
+									for (nn_int j = 0; j < out_w; ++j)
+									{
+										dst[j] = src[j * s.m_sw];
+									}
+								}
+							}
+						}
+					}
+				}
+				x_data = col;
+			}
+
+			plan_mat w((nn_float*)&m_params[s.m_w_offset + g * group_filters * rows], group_filters, rows);
+			plan_mat x((nn_float*)x_data, rows, out_n);
+			plan_mat z(out + g * group_filters * out_n, group_filters, out_n);
+			z.noalias() = w * x;
+		}
+
+		const nn_float *b = &m_params[s.m_b_offset];
+		for (nn_int k = 0; k < filter_n; ++k)
+		{
+			bias_activate(out + k * out_n, out_n, b[k], s.m_activation);
+		}
+		if (s.m_activation == activation_type::eSoftMax)
+		{
+			softmax_inplace(out, filter_n * out_n);
+		}
+	}
+
+	// one filter per channel, every filter tap is one pass over an output row
+	void depthwise_conv(const step &s, const nn_float *in, nn_float *out) const
+	{
+		nn_int in_w = s.m_in.m_w;
+		nn_int in_h = s.m_in.m_h;
+		nn_int out_w = s.m_out.m_w;
+		nn_int out_h = s.m_out.m_h;
+		nn_int channels = s.m_out.m_d;
+		const nn_float *w = &m_params[s.m_w_offset];
+		const nn_float *b = &m_params[s.m_b_offset];
+
+		for (nn_int c = 0; c < channels; ++c)
+		{
+			const nn_float *img = in + c * in_w * in_h;
+			const nn_float *filter = w + c * s.m_kw * s.m_kh;
+			for (nn_int i = 0; i < out_h; ++i)
+			{
+				nn_float *nn_restrict z = out + (c * out_h + i) * out_w;
+				for (nn_int j = 0; j < out_w; ++j)
+				{
+					z[j] = 0;
+				}
+				for (nn_int v = 0; v < s.m_kh; ++v)
+				{
+					const nn_float *row = img + (i * s.m_sh + v) * in_w;
+					for (nn_int u = 0; u < s.m_kw; ++u)
+					{
+						nn_float a = filter[u + v * s.m_kw];
+						const nn_float *nn_restrict x = row + u;
+						if (s.m_sw == 1)
+						{
+							for (nn_int j = 0; j < out_w; ++j)
+							{
+								z[j] += a * x[j];
+							}
+						}
+						else
+						{
+							for (nn_int j = 0; j < out_w; ++j)
+							{
+								z[j] += a * x[j * s.m_sw];
+							}
+						}
+					}
+				}
+			}
+			bias_activate(out + c * out_w * out_h, out_w * out_h, b[c], s.m_activation);
+		}
+		if (s.m_activation == activation_type::eSoftMax)
+		{
+			softmax_inplace(out, channels * out_w * out_h);
+		}
+	}
+
+	// z[out x n] = w[out x in] * x[in x n] + b, one sample per column
+	void fully_connected(const step &s, const nn_float *in, nn_int n, nn_float *out) const
+	{
+		nn_int in_sz = s.m_in.size();
+		nn_int out_sz = s.m_out.size();
+		plan_mat w((nn_float*)&m_params[s.m_w_offset], out_sz, in_sz);
+		plan_vec b((nn_float*)&m_params[s.m_b_offset], out_sz);
+		if (n == 1)
+		{
+			plan_vec x((nn_float*)in, in_sz);
+			plan_vec z(out, out_sz);
+			z.noalias() = w * x + b;
+		}
+		else
+		{
+			plan_cols x((nn_float*)in, in_sz, n);
+			plan_cols z(out, out_sz, n);
+			z.noalias() = w * x;
+			z.colwise() += b;
+		}
+		if (s.m_activation == activation_type::eSoftMax)
+		{
+			for (nn_int k = 0; k < n; ++k)
+			{
+				softmax_inplace(out + k * out_sz, out_sz);
+			}
+		}
+		else
+		{
+			bias_activate(out, out_sz * n, 0, s.m_activation);
+		}
+	}
+
+	// batch norm that could not be folded, channels as in batch_norm_layer
+	void scale_shift(const step &s, const nn_float *in, nn_float *out) const
+	{
+		nn_int channels = s.m_out.is_img() ? s.m_out.m_d : s.m_out.size();
+		nn_int n = s.m_out.size() / channels;
+		const nn_float *scale = &m_params[s.m_w_offset];
+		const nn_float *shift = &m_params[s.m_b_offset];
+		for (nn_int k = 0; k < channels; ++k)
+		{
+			const nn_float *nn_restrict src = in + k * n;
+			nn_float *nn_restrict dst = out + k * n;
+			for (nn_int i = 0; i < n; ++i)
+			{
+				dst[i] = src[i] * scale[k];
+			}
+			bias_activate(dst, n, shift[k], s.m_activation);
+		}
+	}
+
+	static void max_pool(const step &s, const nn_float *in, nn_float *out)
+	{
+		nn_int in_w = s.m_in.m_w;
+		nn_int in_h = s.m_in.m_h;
+		nn_int out_w = s.m_out.m_w;
+		nn_int out_h = s.m_out.m_h;
+		for (nn_int c = 0; c < s.m_out.m_d; ++c)
+		{
+			const nn_float *img = in + c * in_w * in_h;
+			nn_float *dst = out + c * out_w * out_h;
+			for (nn_int i = 0; i < out_h; ++i)
+			{
+				for (nn_int j = 0; j < out_w; ++j)
+				{
+					const nn_float *win = img + i * s.m_sh * in_w + j * s.m_sw;
+					nn_float maxv = cMinFloat;
+					for (nn_int v = 0; v < s.m_kh; ++v)
+					{
+						for (nn_int u = 0; u < s.m_kw; ++u)
+						{
+							maxv = std::max(maxv, win[v * in_w + u]);
+						}
+					}
+					dst[j + i * out_w] = maxv;
+				}
+			}
+		}
+	}
+
+	static void global_avg_pool(const step &s, const nn_float *in, nn_float *out)
+	{
+		nn_int n = s.m_in.m_w * s.m_in.m_h;
+		plan_mat x((nn_float*)in, s.m_in.m_d, n);
+		plan_vec z(out, s.m_in.m_d);
+		z.noalias() = x.rowwise().sum() * (cOne / n);
+	}
+
+	static void avg_pool(const step &s, const nn_float *in, nn_float *out)
+	{
+		nn_int in_w = s.m_in.m_w;
+		nn_int in_h = s.m_in.m_h;
+		nn_int out_w = s.m_out.m_w;
+		nn_int out_h = s.m_out.m_h;
+		nn_float inv_size = cOne / (s.m_kw * s.m_kh);
+		for (nn_int c = 0; c < s.m_out.m_d; ++c)
+		{
+			const nn_float *img = in + c * in_w * in_h;
+			nn_float *dst = out + c * out_w * out_h;
+			for (nn_int i = 0; i < out_h; ++i)
+			{
+				nn_int v_end = std::min(s.m_kh, in_h - i * s.m_sh);
+				for (nn_int j = 0; j < out_w; ++j)
+				{
+					nn_int u_end = std::min(s.m_kw, in_w - j * s.m_sw);
+					const nn_float *win = img + i * s.m_sh * in_w + j * s.m_sw;
+					nn_float sum = 0;
+					for (nn_int v = 0; v < v_end; ++v)
+					{
+						for (nn_int u = 0; u < u_end; ++u)
+						{
+							sum += win[v * in_w + u];
+						}
+					}
+					dst[j + i * out_w] = sum * inv_size;
+				}
+			}
+		}
+	}
+};
+
+}
+
+#endif //__INFERENCE_PLAN_H__
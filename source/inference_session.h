@@ -0,0 +1,229 @@
+#ifndef __INFERENCE_SESSION_H__
+#define __INFERENCE_SESSION_H__
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+
+namespace mini_cnn
+{
+
+/*
+	serving front end with dynamic request batching
+
+	predict() may be called from any number of client threads. requests are
+	copied into an open batch, a batch is closed when it holds max_batch
+	requests or when its first request has waited max_delay_us. worker threads
+	run closed batches through one inference_plan::forward_batch and fulfill
+	the futures of their requests.
+
+	all batch buffers (nworkers + 1 of them) and the worker contexts are
+	allocated up front. when every buffer is busy predict() blocks until one
+	is free (backpressure).
+*/
+class inference_session
+{
+private:
+	typedef std::chrono::steady_clock clock_type;
+
+	struct batch
+	{
+		varray m_input;  // max_batch samples
+		std::vector<std::promise<varray>> m_promises;
+		nn_int m_size;
+		clock_type::time_point m_deadline;
+	};
+
+	inference_plan m_plan;
+	nn_int m_max_batch;
+	std::chrono::microseconds m_max_delay;
+
+	std::vector<batch> m_batches;
+	std::vector<nn_int> m_free;   // batches nobody uses
+	nn_int m_open;                // batch being filled, -1 if none
+	std::deque<nn_int> m_ready;   // closed batches in arrival order
+	nn_int m_queue_depth;         // requests not yet taken by a worker
+
+	std::vector<long long> m_batch_hist;  // [k]: batches run with k requests
+	std::vector<long long> m_depth_hist;  // [k]: requests that found k requests queued
+
+	std::vector<std::thread> m_workers;
+	mutable std::mutex m_mutex;
+	std::condition_variable m_work_cv;
+	std::condition_variable m_space_cv;
+	bool m_stop;
+
+public:
+	inference_session(const inference_plan &plan, nn_int max_batch = 32, nn_int max_delay_us = 1000, nn_int nworkers = 1)
+		: m_plan(plan), m_max_batch(max_batch), m_max_delay(max_delay_us), m_open(-1), m_queue_depth(0), m_stop(false)
+	{
+		nn_assert(!plan.empty() && max_batch > 0 && nworkers > 0);
+		m_batches.resize(nworkers + 1);
+		for (nn_int i = 0; i < (nn_int)m_batches.size(); ++i)
+		{
+			batch &b = m_batches[i];
+			b.m_input.resize(plan.input_size() * max_batch);
+			b.m_promises.resize(max_batch);
+			b.m_size = 0;
+			m_free.push_back(i);
+		}
+		m_batch_hist.assign(max_batch + 1, 0);
+		m_depth_hist.assign(max_batch * (nn_int)m_batches.size() + 1, 0);
+		for (nn_int k = 0; k < nworkers; ++k)
+		{
+			m_workers.push_back(std::thread([this]() { work_loop(); }));
+		}
+	}
+
+	// every request already accepted is still answered
+	~inference_session()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_stop = true;
+		lock.unlock();
+		m_work_cv.notify_all();
+		for (auto &t : m_workers)
+		{
+			t.join();
+		}
+	}
+
+	inference_session(const inference_session&) = delete;
+	inference_session& operator=(const inference_session&) = delete;
+
+	// input: plan.input_size() values, the future holds plan.output_size() values
+	std::future<varray> predict(const varray &input)
+	{
+		nn_assert(input.size() == m_plan.input_size());
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_space_cv.wait(lock, [&]() { return m_open >= 0 || !m_free.empty(); });
+
+		m_depth_hist[m_queue_depth]++;
+		bool first = m_open < 0;
+		if (first)
+		{
+			m_open = m_free.back();
+			m_free.pop_back();
+			m_batches[m_open].m_deadline = clock_type::now() + m_max_delay;
+		}
+		batch &b = m_batches[m_open];
+		nn_int in_sz = m_plan.input_size();
+		::memcpy(&b.m_input[b.m_size * in_sz], &input[0], in_sz * sizeof(nn_float));
+		b.m_promises[b.m_size] = std::promise<varray>();
+		std::future<varray> result = b.m_promises[b.m_size].get_future();
+		++b.m_size;
+		++m_queue_depth;
+
+		bool full = b.m_size == m_max_batch;
+		if (full)
+		{
+			m_ready.push_back(m_open);
+			m_open = -1;
+		}
+		lock.unlock();
+		if (first || full)
+		{
+			m_work_cv.notify_one();
+		}
+		return result;
+	}
+
+	nn_int queue_depth() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_queue_depth;
+	}
+
+	std::vector<long long> batch_size_histogram() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_batch_hist;
+	}
+
+	std::vector<long long> queue_depth_histogram() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_depth_hist;
+	}
+
+	void reset_histograms()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::fill(m_batch_hist.begin(), m_batch_hist.end(), 0);
+		std::fill(m_depth_hist.begin(), m_depth_hist.end(), 0);
+	}
+
+private:
+	// next batch to run, -1 when stopped and nothing is left
+	nn_int take_batch(std::unique_lock<std::mutex> &lock)
+	{
+		while (true)
+		{
+			if (!m_ready.empty())
+			{
+				nn_int idx = m_ready.front();
+				m_ready.pop_front();
+				return idx;
+			}
+			if (m_open >= 0 && (m_stop || clock_type::now() >= m_batches[m_open].m_deadline))
+			{
+				nn_int idx = m_open;
+				m_open = -1;
+				return idx;
+			}
+			if (m_stop)
+			{
+				return -1;
+			}
+			if (m_open >= 0)
+			{
+				m_work_cv.wait_until(lock, m_batches[m_open].m_deadline);
+			}
+			else
+			{
+				m_work_cv.wait(lock);
+			}
+		}
+	}
+
+	void work_loop()
+	{
+		inference_context ctx = m_plan.create_context(m_max_batch);
+		nn_int out_sz = m_plan.output_size();
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true)
+		{
+			nn_int idx = take_batch(lock);
+			if (idx < 0)
+			{
+				return;
+			}
+			batch &b = m_batches[idx];
+			nn_int n = b.m_size;
+			m_queue_depth -= n;
+			m_batch_hist[n]++;
+			lock.unlock();
+
+			const nn_float *out = m_plan.forward_batch(&b.m_input[0], n, ctx);
+			for (nn_int k = 0; k < n; ++k)
+			{
+				varray result(out_sz);
+				::memcpy(&result[0], out + k * out_sz, out_sz * sizeof(nn_float));
+				b.m_promises[k].set_value(std::move(result));
+			}
+
+			lock.lock();
+			b.m_size = 0;
+			m_free.push_back(idx);
+			m_space_cv.notify_all();
+		}
+	}
+};
+
+}
+
+#endif //__INFERENCE_SESSION_H__
@@ -5,46 +5,132 @@ namespace mini_cnn
 {
 class input_layer : public layer_base
 {
+protected:
+	nn_float m_sparse_output_density;  // 0: dense output only
+
+	struct sparse_task_storage
+	{
+		_varray<nn_int> m_index;
+		varray m_value;
+		nn_int m_nnz;  // -1: the sample was too dense
+
+		sparse_task_storage() : m_nnz(-1)
+		{
+		}
+	};
+	std::vector<sparse_task_storage> m_sparse_task_storage;
+
 public:
-	input_layer(nn_int out_size) : layer_base()
+	input_layer(nn_int out_size) : layer_base(), m_sparse_output_density(0)
 	{
 		m_out_shape.set(out_size, 1, 1);
 	}
 
-	input_layer(nn_int img_width, nn_int img_height, nn_int img_depth) : layer_base()
+	input_layer(nn_int img_width, nn_int img_height, nn_int img_depth) : layer_base(), m_sparse_output_density(0)
 	{
 		m_out_shape.set(img_width, img_height, img_depth);
 	}
 
+	/*
+		mostly zero inputs (mnist is about 80% zeros): a sample with at most
+		max_density nonzero values is also kept as (index, value) pairs, the
+		first fully connected / convolutional layer then only multiplies those.
+		0 turns it off. takes effect on the next set_task_count
+	*/
+	void set_sparse_output(nn_float max_density)
+	{
+		nn_assert(max_density >= 0 && max_density <= 1);
+		m_sparse_output_density = max_density;
+	}
+
 	virtual void set_task_count(nn_int task_count)
 	{
 		m_task_storage.resize(task_count);
-		for (auto& ts : m_task_storage)
+		m_sparse_task_storage.resize(task_count);
+	}
+
+	virtual void describe(layer_desc &desc) const
+	{
+		desc.m_type = layer_type::eInputLayer;
+		desc.m_args[0] = m_out_shape.m_w;
+		desc.m_args[1] = m_out_shape.m_h;
+		desc.m_args[2] = m_out_shape.m_d;
+	}
+
+	virtual void alloc_task_storage(memory_arena &arena, nn_int task_idx)
+	{
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		if (m_out_shape.is_img())
 		{
-			if (m_out_shape.is_img())
-			{
-				ts.m_x.resize(m_out_shape.m_w, m_out_shape.m_h, m_out_shape.m_d);
-			}
-			else
-			{
-				ts.m_x.resize(m_out_shape.size());
-			}
+			arena.alloc(ts.m_x, storage_type::eOutput, m_out_shape.m_w, m_out_shape.m_h, m_out_shape.m_d);
+		}
+		else
+		{
+			arena.alloc(ts.m_x, storage_type::eOutput, m_out_shape.size());
+		}
+
+		sparse_task_storage &ss = m_sparse_task_storage[task_idx];
+		ss.m_nnz = -1;
+		if (m_sparse_output_density > 0)
+		{
+			arena.alloc(ss.m_index, storage_type::eOutput, m_out_shape.size());
+			arena.alloc(ss.m_value, storage_type::eOutput, m_out_shape.size());
 		}
 	}
 
 	virtual void forw_prop(const varray &input, nn_int task_idx)
 	{
-		nn_assert(m_next != nullptr);
-
 		varray &in = m_task_storage[task_idx].m_x;
 		in.copy(input);
-		m_next->forw_prop(in, task_idx);
+
+		if (m_sparse_output_density > 0)
+		{
+			compact(in, m_sparse_task_storage[task_idx]);
+		}
+	}
+
+	virtual nn_int get_sparse_output(nn_int task_idx, const nn_int *&index, const nn_float *&value) const
+	{
+		if (m_sparse_output_density <= 0)
+		{
+			return -1;
+		}
+		const sparse_task_storage &ss = m_sparse_task_storage[task_idx];
+		index = &ss.m_index[0];
+		value = &ss.m_value[0];
+		return ss.m_nnz;
 	}
 
 	virtual void back_prop(const varray &next_wd, nn_int task_idx)
 	{
 	}
 
+private:
+	void compact(const varray &in, sparse_task_storage &ss) const
+	{
+		nn_int len = in.size();
+		nn_int limit = (nn_int)(m_sparse_output_density * len);
+		const nn_float *nn_restrict src = &in[0];
+		nn_int *nn_restrict index = &ss.m_index[0];
+		nn_float *nn_restrict value = &ss.m_value[0];
+		nn_int nnz = 0;
+		for (nn_int i = 0; i < len; ++i)
+		{
+			if (src[i] != 0)
+			{
+				if (nnz == limit)
+				{
+					ss.m_nnz = -1;
+					return;
+				}
+				index[nnz] = i;
+				value[nnz] = src[i];
+				++nnz;
+			}
+		}
+		ss.m_nnz = nnz;
+	}
+
 };
 }
 #endif //__INPUT_LAYER_H__
@@ -23,6 +23,7 @@ enum activation_type
 	eTanh,
 	eRelu,
 	eSoftMax,
+	eIdentity,  // no activation, lets a following batch norm fold into the weights
 };
 
 enum lossfunc_type
@@ -32,6 +33,39 @@ enum lossfunc_type
 	eSoftMax_LogLikelihood,
 };
 
+enum layer_type
+{
+	eInputLayer,
+	eFullyConnectedLayer,
+	eOutputLayer,
+	eConvolutionalLayer,
+	eMaxPoolingLayer,
+	eAvgPoolingLayer,
+	eDropoutLayer,
+	eBatchNormLayer,
+	eDepthwiseConvLayer,
+	eGroupedConvLayer,
+	eGlobalAvgPoolingLayer,
+};
+
+/*
+	constructor arguments of a layer, enough to create it again (model files)
+*/
+struct layer_desc
+{
+	nn_int m_type;
+	nn_int m_args[8];
+	nn_float m_prob;     // dropout probability, batch norm epsilon
+
+	layer_desc() : m_type(0), m_prob(0)
+	{
+		for (nn_int i = 0; i < 8; ++i)
+		{
+			m_args[i] = 0;
+		}
+	}
+};
+
 class shape3d
 {
 public:
@@ -78,26 +112,168 @@ class layer_base
 protected:
 	layer_base* m_next;
 	layer_base* m_prev;
+
+	/*
+		gradient checkpointing
+		m_keep_activation: false when the forward buffers of this layer are shared
+			with other segments and recomputed during back propagation
+	*/
+	bool m_keep_activation;
+
+	/*
+		sparse backward: when at most this share of a sample's delta is nonzero,
+		back_prop only visits the nonzero entries (see compact_delta). 0: off
+	*/
+	nn_float m_sparse_density;
+
+	/*
+		false when no layer below this one has parameters (the input is a
+		constant): nobody reads m_wd, back_prop neither allocates nor computes it.
+		set by the network before every allocation, see set_need_input_gradient
+	*/
+	bool m_need_input_gradient;
 public:
 	shape3d m_out_shape;
 	varray m_w;          // weight vector
 	varray m_b;          // bias vector
+	varray m_stats;      // statistics that are saved with the weights but not trained (batch norm)
+
+protected:
+	/*
+		weight gradient shared by all tasks (sharded accumulation, see
+		fully_connected_layer::set_gradient_shards), the tasks then have no m_dw.
+		empty: every task accumulates into its own m_dw
+	*/
+	varray m_shared_dw;
 
 protected:
 	struct task_storage
 	{
 		varray m_dw;
 		varray m_db;
-		varray m_z;      // z vector
+		varray m_z;      // z vector, not allocated for relu (m_relu_mask)
 		varray m_x;      // output vector
 		varray m_delta;
 		varray m_wd;	 // w' * delta
+		_varray<nn_uint> m_relu_mask;  // relu: sign bits of z, see relu_mask
+		_varray<nn_int> m_nz;          // sparse backward: indices of the nonzero deltas
+		bool m_recompute; // replaying the forward pass of a checkpoint segment
+
+		task_storage() : m_recompute(false)
+		{
+		}
 	};
 
 	std::vector<task_storage> m_task_storage;
 
+	/*
+		z of forw_prop. a relu layer keeps no z: z is written into m_x and
+		rectified in place, back_prop only needs its sign bits.
+	*/
+	void alloc_z(memory_arena &arena, nn_int task_idx, activation_type ac_type, nn_int w, nn_int h = 1, nn_int d = 1)
+	{
+		task_storage &ts = m_task_storage[task_idx];
+		if (ac_type == activation_type::eRelu)
+		{
+			arena.alloc(ts.m_relu_mask, storage_type::eBackward, (w * h * d + 31) / 32);
+		}
+		else
+		{
+			arena.alloc(ts.m_z, storage_type::eTemporary, w, h, d);
+		}
+	}
+
+	varray& z_buffer(task_storage &ts, activation_type ac_type)
+	{
+		return ac_type == activation_type::eRelu ? ts.m_x : ts.m_z;
+	}
+
+	// x := f(z)
+	void activate(task_storage &ts, activation_type ac_type, active_func f)
+	{
+		if (ac_type == activation_type::eRelu)
+		{
+			relu_mask(ts.m_x, ts.m_relu_mask);
+		}
+		else
+		{
+			f(ts.m_z, ts.m_x);
+		}
+	}
+
+	// m_wd, only when a layer below learns
+	void alloc_wd(memory_arena &arena, nn_int task_idx, nn_int w, nn_int h = 1, nn_int d = 1)
+	{
+		varray &wd = m_task_storage[task_idx].m_wd;
+		if (m_need_input_gradient)
+		{
+			arena.alloc(wd, storage_type::eBackward, w, h, d);
+		}
+		else
+		{
+			wd.resize(0);
+		}
+	}
+
+	// sparse backward only
+	void alloc_nz(memory_arena &arena, nn_int task_idx)
+	{
+		if (m_sparse_density > 0)
+		{
+			arena.alloc(m_task_storage[task_idx].m_nz, storage_type::eBackward, m_out_shape.size());
+		}
+	}
+
+	/*
+		indices of the nonzero values of m_delta into m_nz, returns their count.
+		-1 (dense backward) when sparse backward is off or once the count
+		exceeds the density limit
+	*/
+	nn_int compact_delta(task_storage &ts) const
+	{
+		if (m_sparse_density <= 0)
+		{
+			return -1;
+		}
+		nn_int len = ts.m_delta.size();
+		nn_int limit = (nn_int)(m_sparse_density * len);
+		const nn_float *nn_restrict delta = &ts.m_delta[0];
+		nn_int *nn_restrict nz = &ts.m_nz[0];
+		nn_int nnz = 0;
+		for (nn_int i = 0; i < len; ++i)
+		{
+			if (delta[i] != 0)
+			{
+				if (nnz == limit)
+				{
+					return -1;
+				}
+				nz[nnz++] = i;
+			}
+		}
+		return nnz;
+	}
+
+	// delta := next_wd * df(z)
+	void activation_delta(task_storage &ts, activation_type ac_type, active_func df, const varray &next_wd)
+	{
+		if (ac_type == activation_type::eRelu)
+		{
+			deriv_relu_mask(ts.m_relu_mask, next_wd, ts.m_delta);
+			return;
+		}
+		df(ts.m_z, ts.m_delta);
+		nn_int len = next_wd.size();
+		nn_float *nn_restrict vec_delta = &ts.m_delta[0];
+		const nn_float *nn_restrict vec_next_wd = &next_wd[0];
+		for (nn_int i = 0; i < len; ++i)
+		{
+			vec_delta[i] *= vec_next_wd[i];
+		}
+	}
+
 public:
-	layer_base()
+	layer_base() : m_next(nullptr), m_prev(nullptr), m_keep_activation(true), m_sparse_density(0), m_need_input_gradient(true)
 	{
 	}
 
@@ -116,18 +292,45 @@ public:
 		return m_task_storage[task_idx].m_x;
 	}
 
+	/*
+		output of task task_idx as nnz (index, value) pairs of its nonzero values,
+		only the input layer provides them (input_layer::set_sparse_output).
+		-1: the output is dense only
+	*/
+	virtual nn_int get_sparse_output(nn_int task_idx, const nn_int *&index, const nn_float *&value) const
+	{
+		return -1;
+	}
+
 	task_storage& get_task_storage(nn_int task_idx)
 	{
 		return m_task_storage[task_idx];
 	}
 
-	void clear_grident()
+	// weight gradient of task task_idx, or the shared one
+	varray& weight_gradient(nn_int task_idx)
+	{
+		return m_shared_dw.size() > 0 ? m_shared_dw : m_task_storage[task_idx].m_dw;
+	}
+
+	virtual void clear_grident()
 	{
 		for (auto &ts : m_task_storage)
 		{
 			ts.m_dw.make_zero();
 			ts.m_db.make_zero();
 		}
+		m_shared_dw.make_zero();
+	}
+
+	bool keep_activation() const
+	{
+		return m_keep_activation;
+	}
+
+	void set_keep_activation(bool keep_activation)
+	{
+		m_keep_activation = keep_activation;
 	}
 
 	virtual void connect(layer_base *next)
@@ -139,6 +342,33 @@ public:
 		}
 	}
 
+	/*
+		layers with a sparse path (fully connected, convolutional) switch to it
+		for samples whose delta has at most max_density nonzero values.
+		takes effect on the next set_task_count
+	*/
+	void set_sparse_backward(nn_float max_density)
+	{
+		nn_assert(max_density >= 0 && max_density <= 1);
+		m_sparse_density = max_density;
+	}
+
+	bool need_input_gradient() const
+	{
+		return m_need_input_gradient;
+	}
+
+	void set_need_input_gradient(bool need)
+	{
+		m_need_input_gradient = need;
+	}
+
+	// back_prop has to run: this layer learns or a layer below it does
+	bool need_gradient() const
+	{
+		return paramters_count() > 0 || m_need_input_gradient;
+	}
+
 	virtual void set_phase_type(phase_type phase)
 	{
 	}
@@ -157,70 +387,80 @@ public:
 		return out_size();
 	}
 
-	virtual void set_task_count(nn_int task_count) = 0;
+	virtual void set_task_count(nn_int task_count)
+	{
+		m_task_storage.resize(task_count);
+	}
+
+	virtual void describe(layer_desc &desc) const = 0;
+
+	/*
+		request every buffer of task task_idx from arena,
+		they are bound after the network commits the arena
+	*/
+	virtual void alloc_task_storage(memory_arena &arena, nn_int task_idx) = 0;
 
 	/*
 		input: input of this layer
+		the network runs the layers in order (see network::forward),
+		a layer never calls its neighbours
 	*/
 	virtual void forw_prop(const varray &input, nn_int task_idx) = 0;
 
 	/*
 		next_wd: next layer's transpose(weight) * delta
+		leaves this layer's transpose(weight) * delta in m_wd for the layer below
 	*/
 	virtual void back_prop(const varray &next_wd, nn_int task_idx) = 0;
 
-	virtual void update_weights(nn_float eff)
+	// called after the last back_prop of task_idx in a minibatch, gradients still held back are added up
+	virtual void flush_gradient(nn_int task_idx)
 	{
-		nn_int b_sz = m_b.size();
-		nn_int w_sz = m_w.size();
-		if (b_sz == 0 || w_sz == 0)
-		{
-			return;
-		}
+	}
 
-		// merge weights from all task
-		nn_int task_count = (nn_int)m_task_storage.size();
-		auto& ts_sum = m_task_storage[0];
-		
-		nn_float *nn_restrict vec_sum_db = &ts_sum.m_db[0];
-		nn_float *nn_restrict vec_sum_dw = &ts_sum.m_dw[0];
+	// called once per minibatch after all tasks finished, before the weights are updated
+	virtual void reduce_statistics()
+	{
+	}
 
-		for (nn_int k = 1; k < task_count; ++k)
-		{
-			auto& ts = m_task_storage[k];
-			const nn_float *nn_restrict vec_task_db = &ts.m_db[0];
-			for (nn_int i = 0; i < b_sz; ++i)
-			{
-				vec_sum_db[i] += vec_task_db[i];
-			}
+	// parameters that start at a fixed value, set after the weight initializer ran
+	virtual void init_fixed_weight()
+	{
+	}
 
-			const nn_float *nn_restrict vec_task_dw = &ts.m_dw[0];
-			for (nn_int i = 0; i < w_sz; ++i)
-			{
-				vec_sum_dw[i] += vec_task_dw[i];
-			}
-		}
+	// l2 weight decay applies to m_w, biases never decay
+	virtual bool decays_weight() const
+	{
+		return true;
+	}
 
-		// update weights
-		nn_float *nn_restrict vec_b = &m_b[0];
-		for (nn_int i = 0; i < b_sz; ++i)
+	/*
+		sum the gradient slice [begin, end) of m_w (bias: m_b) of all tasks into
+		task 0 and clear it in the other tasks, returns task 0's gradient vector.
+		a shared weight gradient already is the sum.
+	*/
+	nn_float* reduce_gradient(bool bias, nn_int begin, nn_int end)
+	{
+		if (!bias && m_shared_dw.size() > 0)
 		{
-			vec_b[i] -= vec_sum_db[i] * eff;
+			return &m_shared_dw[0];
 		}
 
-		nn_float *nn_restrict vec_w = &m_w[0];
-		for (nn_int i = 0; i < w_sz; ++i)
-		{
-			vec_w[i] -= vec_sum_dw[i] * eff;
-		}
+		varray &sum = bias ? m_task_storage[0].m_db : m_task_storage[0].m_dw;
+		nn_float *nn_restrict vec_sum = &sum[0];
 
-		// clear task storage
-		for (auto& ts : m_task_storage)
+		nn_int task_count = (nn_int)m_task_storage.size();
+		for (nn_int k = 1; k < task_count; ++k)
 		{
-			ts.m_dw.make_zero();
-			ts.m_db.make_zero();
+			varray &grad = bias ? m_task_storage[k].m_db : m_task_storage[k].m_dw;
+			nn_float *nn_restrict vec_task = &grad[0];
+			for (nn_int i = begin; i < end; ++i)
+			{
+				vec_sum[i] += vec_task[i];
+				vec_task[i] = 0;
+			}
 		}
-
+		return vec_sum;
 	}
 
 };
@@ -0,0 +1,182 @@
+#ifndef __MAPPED_FILE_H__
+#define __MAPPED_FILE_H__
+
+#include <string>
+#include <cstddef>
+#include <algorithm>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace mini_cnn
+{
+
+/*
+	whole file memory mapping
+
+	read only by default. a copy on write mapping can be written, the changes
+	stay private to the process, pages that are never written are shared with
+	every other process mapping the same file (one page cache copy).
+*/
+class mapped_file
+{
+private:
+	unsigned char *m_data;
+	size_t m_size;
+
+#if defined(_WIN32)
+	HANDLE m_file;
+	HANDLE m_mapping;
+#endif
+
+public:
+	mapped_file() : m_data(nullptr), m_size(0)
+#if defined(_WIN32)
+		, m_file(INVALID_HANDLE_VALUE), m_mapping(NULL)
+#endif
+	{
+	}
+
+	~mapped_file()
+	{
+		close();
+	}
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	bool open(const std::string &file_path, bool copy_on_write = false)
+	{
+		close();
+#if defined(_WIN32)
+		m_file = ::CreateFileA(file_path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING
+			, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (m_file == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+		LARGE_INTEGER file_size;
+		if (!::GetFileSizeEx(m_file, &file_size) || file_size.QuadPart == 0)
+		{
+			close();
+			return false;
+		}
+		m_mapping = ::CreateFileMappingA(m_file, NULL, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+		if (m_mapping == NULL)
+		{
+			close();
+			return false;
+		}
+		m_data = (unsigned char*)::MapViewOfFile(m_mapping, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+		if (m_data == nullptr)
+		{
+			close();
+			return false;
+		}
+		m_size = (size_t)file_size.QuadPart;
+		return true;
+#else
+		int fd = ::open(file_path.c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			return false;
+		}
+		struct stat st;
+		if (::fstat(fd, &st) != 0 || st.st_size == 0)
+		{
+			::close(fd);
+			return false;
+		}
+		int prot = copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ;
+		int flags = copy_on_write ? MAP_PRIVATE : MAP_SHARED;
+		void *mem = ::mmap(nullptr, (size_t)st.st_size, prot, flags, fd, 0);
+		// the mapping keeps its own reference to the file
+		::close(fd);
+		if (mem == MAP_FAILED)
+		{
+			return false;
+		}
+		m_data = (unsigned char*)mem;
+		m_size = (size_t)st.st_size;
+		return true;
+#endif
+	}
+
+	void close()
+	{
+#if defined(_WIN32)
+		if (m_data != nullptr)
+		{
+			::UnmapViewOfFile(m_data);
+		}
+		if (m_mapping != NULL)
+		{
+			::CloseHandle(m_mapping);
+		}
+		if (m_file != INVALID_HANDLE_VALUE)
+		{
+			::CloseHandle(m_file);
+		}
+		m_mapping = NULL;
+		m_file = INVALID_HANDLE_VALUE;
+#else
+		if (m_data != nullptr)
+		{
+			::munmap(m_data, m_size);
+		}
+#endif
+		m_data = nullptr;
+		m_size = 0;
+	}
+
+	bool is_open() const
+	{
+		return m_data != nullptr;
+	}
+
+	unsigned char* data() const
+	{
+		return m_data;
+	}
+
+	size_t size() const
+	{
+		return m_size;
+	}
+
+	/*
+		access pattern hints (madvise), no-ops where not supported
+	*/
+	void advise_sequential() const
+	{
+#if !defined(_WIN32)
+		if (m_data != nullptr)
+		{
+			::madvise(m_data, m_size, MADV_SEQUENTIAL);
+		}
+#endif
+	}
+
+	void advise_random() const
+	{
+#if !defined(_WIN32)
+		if (m_data != nullptr)
+		{
+			::madvise(m_data, m_size, MADV_RANDOM);
+		}
+#endif
+	}
+};
+
+}
+
+#endif //__MAPPED_FILE_H__
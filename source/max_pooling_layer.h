@@ -17,15 +17,15 @@ protected:
 	{
 		/*
 			https://software.intel.com/sites/products/documentation/doclib/daal/daal-user-and-reference-guides/daal_prog_guide/GUID-2C3AA967-AE6A-4162-84EB-93BE438E3A05.htm
-			m_idx_maps[d]: index map of channel d
-			m_idx_maps[d][i]: the i-th element of downsample output is choosed from the m_idx_maps[d][i] (index of pool window)
+			m_idx_map(., d): index map of channel d
+			m_idx_map(i, d): the i-th element of downsample output is choosed from the m_idx_map(i, d) (index of pool window)
 			for example
 			input: 2X3		    pool: size 2X2,		    output: 1X2
 									  stride 1X1						idx_map: 1X2
 			| 0  2  1 |         forward																								 | 2  1 |
 			| 3  5  4 |            =>					| 5  5 |        | 3  2 | : 5 in output[1] is the 2-th element of pool windos | 5  4 |
 		*/ 
-		std::vector<index_vec> m_idx_maps;
+		_varray<nn_int> m_idx_map;
 	};
 
 	std::vector<max_pooling_task_storage> m_max_pooling_task_storage;
@@ -40,6 +40,15 @@ public:
 		nn_assert(stride_h > 0 && stride_h <= pool_h);
 	}
 
+	virtual void describe(layer_desc &desc) const
+	{
+		desc.m_type = layer_type::eMaxPoolingLayer;
+		desc.m_args[0] = m_pool_w;
+		desc.m_args[1] = m_pool_h;
+		desc.m_args[2] = m_stride_w;
+		desc.m_args[3] = m_stride_h;
+	}
+
 	virtual void connect(layer_base *next)
 	{
 		layer_base::connect(next);
@@ -55,6 +64,12 @@ public:
 	}
 
 	virtual void set_task_count(nn_int task_count)
+	{
+		m_task_storage.resize(task_count);
+		m_max_pooling_task_storage.resize(task_count);
+	}
+
+	virtual void alloc_task_storage(memory_arena &arena, nn_int task_idx)
 	{
 		nn_int in_w = m_prev->m_out_shape.m_w;
 		nn_int in_h = m_prev->m_out_shape.m_h;
@@ -64,58 +79,39 @@ public:
 		nn_int out_h = m_out_shape.m_h;
 		nn_int out_d = m_out_shape.m_d;
 
-		m_task_storage.resize(task_count);
-		for (auto& ts : m_task_storage)
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		if (!m_out_shape.is_img())
 		{
-			if (!m_out_shape.is_img())
-			{
-				ts.m_x.resize(out_w * out_h * out_d);
-			}
-			else
-			{
-				ts.m_x.resize(out_w, out_h, out_d);
-			}
-			ts.m_wd.resize(in_w, in_h, in_d);
+			arena.alloc(ts.m_x, storage_type::eOutput, out_w * out_h * out_d);
 		}
-
-		m_max_pooling_task_storage.resize(task_count);
-		for (auto &pooling_ts : m_max_pooling_task_storage)
+		else
 		{
-			pooling_ts.m_idx_maps.resize(in_d);
-			for (auto &mp : pooling_ts.m_idx_maps)
-			{
-				mp.resize(out_w * out_h);
-			}
+			arena.alloc(ts.m_x, storage_type::eOutput, out_w, out_h, out_d);
 		}
+		alloc_wd(arena, task_idx, in_w, in_h, in_d);
+
+		arena.alloc(m_max_pooling_task_storage[task_idx].m_idx_map, storage_type::eTemporary, out_w * out_h, in_d);
 	}
 
 	virtual void forw_prop(const varray &input, nn_int task_idx)
 	{
 		varray &out_x = m_task_storage[task_idx].m_x;
 
-		std::vector<index_vec> &idx_maps = m_max_pooling_task_storage[task_idx].m_idx_maps;
-
-		down_sample(input, out_x, idx_maps, m_pool_w, m_pool_h, m_stride_w, m_stride_h);
+		_varray<nn_int> &idx_map = m_max_pooling_task_storage[task_idx].m_idx_map;
 
-		if (m_next != nullptr)
-		{
-			m_next->forw_prop(out_x, task_idx);
-		}
+		down_sample(input, out_x, idx_map, m_pool_w, m_pool_h, m_stride_w, m_stride_h);
 	}
 
 	virtual void back_prop(const varray &next_wd, nn_int task_idx)
 	{
 		layer_base::task_storage &ts = m_task_storage[task_idx];
-		std::vector<index_vec> &idx_maps = m_max_pooling_task_storage[task_idx].m_idx_maps;
-
-		up_sample(next_wd, ts.m_wd, idx_maps, m_pool_w, m_pool_h, m_stride_w, m_stride_h);
-
-		m_prev->back_prop(ts.m_wd, task_idx);
+		_varray<nn_int> &idx_map = m_max_pooling_task_storage[task_idx].m_idx_map;
 
+		up_sample(next_wd, ts.m_wd, idx_map, m_pool_w, m_pool_h, m_stride_w, m_stride_h);
 	}
 
 private:
-	static void down_sample(const varray &in_img, varray &out, std::vector<index_vec> &idx_map,
+	static void down_sample(const varray &in_img, varray &out, _varray<nn_int> &idx_map,
 		nn_int pool_w, nn_int pool_h,
 		nn_int pool_stride_w, nn_int pool_stride_h)
 	{
@@ -128,20 +124,18 @@ private:
 		nn_int h = out.height();
 		nn_int d = out.depth();
 
-		nn_int map_d = static_cast<nn_int>(idx_map.size());
+		nn_int map_d = idx_map.height();
 
 		nn_assert(map_d == in_d && map_d == d && map_d > 0);
 
-		nn_int map_sz = static_cast<nn_int>(idx_map[0].size());
+		nn_int map_sz = idx_map.width();
 
 		nn_assert(map_sz == w * h);
 
-		for (auto &mp : idx_map)
+		nn_int *nn_restrict vec_map = &idx_map[0];
+		for (nn_int i = 0; i < map_sz * map_d; ++i)
 		{
-			for (nn_int i = 0; i < map_sz; ++i)
-			{
-				mp[i] = -1;
-			}
+			vec_map[i] = -1;
 		}
 
 		for (nn_int c = 0; c < d; ++c)
@@ -172,7 +166,7 @@ private:
 					if (pool_idx >= 0)
 					{
 						nn_int out_idx = i + j * w;
-						idx_map[c][out_idx] = pool_idx;
+						idx_map(out_idx, c) = pool_idx;
 					}
 				}
 			}
@@ -180,7 +174,7 @@ private:
 
 	}
 
-	static void up_sample(const varray &in_img, varray &out, const std::vector<index_vec> &idx_map,
+	static void up_sample(const varray &in_img, varray &out, const _varray<nn_int> &idx_map,
 		nn_int pool_w, nn_int pool_h,
 		nn_int pool_stride_w, nn_int pool_stride_h)
 	{
@@ -192,11 +186,11 @@ private:
 		nn_int h = out.height();
 		nn_int d = out.depth();
 
-		nn_int map_d = static_cast<nn_int>(idx_map.size());
+		nn_int map_d = idx_map.height();
 
 		nn_assert(map_d == in_d && map_d == d && map_d > 0);
 
-		nn_int map_sz = static_cast<nn_int>(idx_map[0].size());
+		nn_int map_sz = idx_map.width();
 
 		nn_assert(map_sz == in_w * in_h);
 
@@ -212,7 +206,7 @@ private:
 					nn_int start_h = j * pool_stride_h;
 
 					nn_int out_idx = i + j * in_w;
-					nn_int pool_idx = idx_map[c][out_idx];
+					nn_int pool_idx = idx_map(out_idx, c);
 					if (pool_idx >= 0)
 					{
 						nn_int v = pool_idx / pool_w;
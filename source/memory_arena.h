@@ -0,0 +1,421 @@
+#ifndef __MEMORY_ARENA_H__
+#define __MEMORY_ARENA_H__
+
+#include <vector>
+#include <functional>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <tuple>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace mini_cnn
+{
+
+class mem_block
+{
+public:
+	nn_int w;
+	nn_int h;
+	nn_float *data;
+	nn_int data_len;
+	mem_block() : data(nullptr), data_len(0), w(0), h(0), m_owner(true)
+	{
+	}
+	void resize(nn_int len)
+	{
+		release();
+		create(len);
+	}
+	// view external memory (e.g. a memory_arena block), the data is not owned
+	void attach(nn_float *mem, nn_int len)
+	{
+		release();
+		data = mem;
+		data_len = len;
+		m_owner = false;
+	}
+	~mem_block()
+	{
+		release();
+	}
+private:
+	bool m_owner;
+
+	void create(nn_int len)
+	{
+		data = (nn_float*)align_malloc(len * sizeof(nn_float), nn_align_size);
+		memset(data, 0, len * sizeof(nn_float));
+		data_len = len;
+		m_owner = true;
+		w = 0;
+		h = 0;
+	}
+	void release()
+	{
+		if (data != nullptr && m_owner)
+		{
+			align_free(data);
+		}
+		data = nullptr;
+		data_len = 0;
+		m_owner = true;
+		w = 0;
+		h = 0;
+	}
+};
+
+/*
+	lifetime of a per-task buffer, seen from a pure forward (inference) pass
+*/
+enum storage_type
+{
+	eOutput,     // layer output, read by the next layer's forw_prop
+	eTemporary,  // only used inside the layer's own forw_prop
+	eBackward,   // only used by back_prop (gradients, deltas, masks)
+};
+
+/*
+	one big memory region for all per-task buffers of a network
+
+	usage:
+		arena.begin_plan(reuse);
+		arena.set_step(task_idx, layer_idx);
+		arena.alloc(ts.m_x, storage_type::eOutput, w, h, d);   // only records size and target
+		...
+		arena.commit();         // allocates once, zero fills and binds every target
+
+	blocks are carved in request order and each one starts at a cache line,
+	so requesting task by task keeps every task's buffers contiguous.
+	the region is kept while the planned size fits in it, a smaller task count reuses it.
+
+	a step may also pass a share key (gradient checkpointing): forward buffers of
+	steps with the same share key use the same memory, the k-th forward request
+	of one step aliases the k-th forward request of the others.
+
+	with reuse (inference only) eBackward buffers are not allocated at all and
+	the forward buffers of one task share memory by liveness:
+		output of step i is live in [i, i + 1]
+		temporary of step i is live in [i, i]
+	buffers with disjoint lifetimes are packed into the same slot, for a chain
+	of layers this ends up as 3 or 4 ping-pong slots per task.
+*/
+class memory_arena
+{
+private:
+	struct request
+	{
+		size_t m_bytes;
+		size_t m_offset;
+		storage_type m_type;
+		nn_int m_group;
+		nn_int m_step;
+		nn_int m_share;
+		nn_int m_ordinal;  // index among the forward requests of its step
+		std::function<void(unsigned char*)> m_bind;
+	};
+
+	std::vector<request> m_requests;
+	unsigned char *m_data;
+	size_t m_capacity;
+	size_t m_used;
+	nn_int m_group;
+	nn_int m_step;
+	nn_int m_share;
+	nn_int m_ordinal;
+	bool m_reuse;
+	bool m_huge_pages;
+	bool m_mapped;
+
+public:
+	memory_arena(bool huge_pages = false)
+		: m_data(nullptr), m_capacity(0), m_used(0), m_group(0), m_step(0), m_share(-1), m_ordinal(0), m_reuse(false)
+		, m_huge_pages(huge_pages), m_mapped(false)
+	{
+	}
+
+	~memory_arena()
+	{
+		release();
+	}
+
+	memory_arena(const memory_arena&) = delete;
+	memory_arena& operator=(const memory_arena&) = delete;
+
+	memory_arena(memory_arena &&other)
+		: m_requests(std::move(other.m_requests)), m_data(other.m_data), m_capacity(other.m_capacity), m_used(other.m_used)
+		, m_group(other.m_group), m_step(other.m_step), m_share(other.m_share), m_ordinal(other.m_ordinal), m_reuse(other.m_reuse)
+		, m_huge_pages(other.m_huge_pages), m_mapped(other.m_mapped)
+	{
+		other.m_data = nullptr;
+		other.m_capacity = 0;
+		other.m_used = 0;
+		other.m_mapped = false;
+	}
+
+	// huge pages only take effect on the next region allocation
+	void set_huge_pages(bool huge_pages)
+	{
+		m_huge_pages = huge_pages;
+	}
+
+	size_t used_size() const
+	{
+		return m_used;
+	}
+
+	size_t capacity() const
+	{
+		return m_capacity;
+	}
+
+	/*
+		reuse: plan for inference, drop eBackward buffers and share the rest by liveness
+	*/
+	void begin_plan(bool reuse = false)
+	{
+		m_requests.clear();
+		m_used = 0;
+		m_group = 0;
+		m_step = 0;
+		m_share = -1;
+		m_ordinal = 0;
+		m_reuse = reuse;
+	}
+
+	/*
+		group: buffers of different groups (tasks) never share memory
+		step: position of the requesting layer in the forward pass
+		share: steps of one group with the same key >= 0 alias their forward buffers
+	*/
+	void set_step(nn_int group, nn_int step, nn_int share = -1)
+	{
+		m_group = group;
+		m_step = step;
+		m_share = share;
+		m_ordinal = 0;
+	}
+
+	template<class T>
+	void alloc(_varray<T> &arr, storage_type type, nn_int w, nn_int h = 1, nn_int d = 1, nn_int n = 1)
+	{
+		_varray<T> *parr = &arr;
+		add_request(w * h * d * n * sizeof(T), type, [parr, w, h, d, n](unsigned char *mem) {
+			if (mem != nullptr)
+			{
+				parr->attach((T*)mem, w, h, d, n);
+			}
+			else
+			{
+				parr->attach(nullptr, 0, 0, 0, 0);
+			}
+		});
+	}
+
+	void alloc(mem_block &block, storage_type type, nn_int len)
+	{
+		mem_block *pblock = &block;
+		add_request(len * sizeof(nn_float), type, [pblock, len](unsigned char *mem) {
+			pblock->attach((nn_float*)mem, mem != nullptr ? len : 0);
+		});
+	}
+
+	void commit()
+	{
+		if (m_reuse)
+		{
+			assign_shared_offsets();
+		}
+		else
+		{
+			assign_offsets();
+		}
+
+		if (m_used > m_capacity)
+		{
+			release();
+			m_data = alloc_region(m_used);
+			m_capacity = m_used;
+		}
+
+		if (m_used > 0)
+		{
+			::memset(m_data, 0, m_used);
+		}
+
+		for (auto &req : m_requests)
+		{
+			bool skip = m_reuse && req.m_type == storage_type::eBackward;
+			req.m_bind(skip ? nullptr : m_data + req.m_offset);
+		}
+	}
+
+private:
+	void add_request(size_t bytes, storage_type type, std::function<void(unsigned char*)> bind)
+	{
+		request req;
+		req.m_bytes = bytes;
+		req.m_offset = 0;
+		req.m_type = type;
+		req.m_group = m_group;
+		req.m_step = m_step;
+		req.m_share = type != storage_type::eBackward ? m_share : -1;
+		req.m_ordinal = type != storage_type::eBackward ? m_ordinal++ : -1;
+		req.m_bind = bind;
+		m_requests.push_back(req);
+	}
+
+	/*
+		request order, except that aliased requests take the block
+		reserved by the first of them (sized for the largest)
+	*/
+	void assign_offsets()
+	{
+		std::map<std::tuple<nn_int, nn_int, nn_int>, size_t> shared_bytes;
+		for (auto &req : m_requests)
+		{
+			if (req.m_share >= 0)
+			{
+				size_t &bytes = shared_bytes[std::make_tuple(req.m_group, req.m_share, req.m_ordinal)];
+				bytes = std::max(bytes, req.m_bytes);
+			}
+		}
+
+		std::map<std::tuple<nn_int, nn_int, nn_int>, size_t> shared_offset;
+		m_used = 0;
+		for (auto &req : m_requests)
+		{
+			if (req.m_share < 0)
+			{
+				req.m_offset = m_used;
+				m_used += align_up(req.m_bytes);
+				continue;
+			}
+
+			auto key = std::make_tuple(req.m_group, req.m_share, req.m_ordinal);
+			auto it = shared_offset.find(key);
+			if (it == shared_offset.end())
+			{
+				it = shared_offset.insert(std::make_pair(key, m_used)).first;
+				m_used += align_up(shared_bytes[key]);
+			}
+			req.m_offset = it->second;
+		}
+	}
+
+	/*
+		greedy interval coloring per group, requests arrive in step order
+	*/
+	void assign_shared_offsets()
+	{
+		struct slot
+		{
+			size_t m_bytes;
+			nn_int m_last_step;
+			std::vector<nn_int> m_members;
+		};
+
+		m_used = 0;
+		nn_int req_count = (nn_int)m_requests.size();
+		nn_int i = 0;
+		while (i < req_count)
+		{
+			nn_int group = m_requests[i].m_group;
+			std::vector<slot> slots;
+			for (; i < req_count && m_requests[i].m_group == group; ++i)
+			{
+				request &req = m_requests[i];
+				if (req.m_type == storage_type::eBackward)
+				{
+					continue;
+				}
+
+				nn_int last_step = req.m_type == storage_type::eOutput ? req.m_step + 1 : req.m_step;
+				nn_int best = -1;
+				for (nn_int k = 0; k < (nn_int)slots.size(); ++k)
+				{
+					if (slots[k].m_last_step >= req.m_step)
+					{
+						continue;
+					}
+					// prefer the free slot whose size is closest to the request
+					if (best < 0 || std::abs((long long)slots[k].m_bytes - (long long)req.m_bytes)
+						< std::abs((long long)slots[best].m_bytes - (long long)req.m_bytes))
+					{
+						best = k;
+					}
+				}
+				if (best < 0)
+				{
+					slots.push_back(slot());
+					best = (nn_int)slots.size() - 1;
+					slots[best].m_bytes = 0;
+				}
+				slot &s = slots[best];
+				s.m_bytes = std::max(s.m_bytes, req.m_bytes);
+				s.m_last_step = last_step;
+				s.m_members.push_back(i);
+			}
+
+			for (auto &s : slots)
+			{
+				for (nn_int idx : s.m_members)
+				{
+					m_requests[idx].m_offset = m_used;
+				}
+				m_used += align_up(s.m_bytes);
+			}
+		}
+	}
+
+	static size_t align_up(size_t bytes)
+	{
+		return (bytes + nn_cache_line_size - 1) & ~(size_t)(nn_cache_line_size - 1);
+	}
+
+	unsigned char* alloc_region(size_t bytes)
+	{
+		m_mapped = false;
+#if defined(__linux__)
+		if (m_huge_pages)
+		{
+			// anonymous mappings are page aligned, madvise lets the kernel back them with transparent huge pages
+			void *mem = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (mem != MAP_FAILED)
+			{
+				::madvise(mem, bytes, MADV_HUGEPAGE);
+				m_mapped = true;
+				return (unsigned char*)mem;
+			}
+		}
+#endif
+		return (unsigned char*)align_malloc(bytes, nn_cache_line_size);
+	}
+
+	void release()
+	{
+		if (m_data != nullptr)
+		{
+#if defined(__linux__)
+			if (m_mapped)
+			{
+				::munmap(m_data, m_capacity);
+			}
+			else
+#endif
+			{
+				align_free(m_data);
+			}
+		}
+		m_data = nullptr;
+		m_capacity = 0;
+		m_mapped = false;
+	}
+};
+
+}
+
+#endif //__MEMORY_ARENA_H__
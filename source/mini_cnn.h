@@ -6,15 +6,34 @@
 #include "varray.h"
 #include "utils.h"
 #include "fast_matrix_operation.h"
+#include "memory_arena.h"
 #include "layer.h"
 #include "fully_connected_layer.h"
 #include "input_layer.h"
 #include "output_layer.h"
 #include "convolutional_layer.h"
+#include "depthwise_convolutional_layer.h"
+#include "grouped_convolutional_layer.h"
 #include "max_pooling_layer.h"
 #include "avg_pooling_layer.h"
+#include "global_avg_pooling_layer.h"
 #include "dropout_layer.h"
+#include "batch_norm_layer.h"
 #include "weight_initializer.h"
+#include "optimizer.h"
+#include "dataset_source.h"
+#include "compact_dataset.h"
+#include "mapped_file.h"
+#include "idx_file.h"
+#include "idx_dataset.h"
+#include "cifar10_dataset.h"
+#include "record_dataset.h"
+#include "data_augmentation.h"
+#include "batch_loader.h"
+#include "checkpoint.h"
+#include "inference_plan.h"
+#include "inference_session.h"
 #include "network.h"
+#include "model_file.h"
 
 #endif // __MINI_CNN_H__
@@ -2,7 +2,6 @@
 #define __MNIST_DATASET_PARSER_H__
 
 #include <string>
-#include <fstream>
 
 using namespace mini_cnn;
 
@@ -30,109 +29,124 @@ public:
 
 	void read_dataset(varray_vec &img_vec, varray_vec &lab_vec, varray_vec &test_img_vec, index_vec &test_lab_vec)
 	{
-		// read train data
-		// train images
-		unsigned char *images = read_file(m_train_img_file);
-		int index = 0;
-		int img_migic = read_int(images, index);
-		int img_count = read_int(images, index);
-		int col = read_int(images, index);
-		int row = read_int(images, index);
-
-		// train labels
-		unsigned char *labels = read_file(m_train_label_file);
-		int idx = 0;
-		int lab_migic = read_int(labels, idx);
-		int lab_count = read_int(labels, idx);
-
-		nn_assert(img_count == lab_count);
-
-		img_vec.resize(img_count);
-		for (int k = 0; k < img_count; ++k)
+		if (!map_files())
 		{
-			img_vec[k] = new varray(N_inputCount);
-			for (int i = 0; i < N_inputCount; ++i)
-			{
-				float v = images[index + k * N_inputCount + i] * 1.0f / 255.0f;
-				(*img_vec[k])[i] = v;
-			}
+			return;
 		}
 
+		nn_int img_count = m_train_images.count();
+		nn_int img_size = m_train_images.sample_size();
+		img_vec.resize(img_count);
 		lab_vec.resize(img_count);
-		for (int k = 0; k < img_count; ++k)
+		for (nn_int k = 0; k < img_count; ++k)
 		{
+			const unsigned char *img = m_train_images.sample(k);
+			img_vec[k] = new varray(img_size);
+			for (nn_int i = 0; i < img_size; ++i)
+			{
+				(*img_vec[k])[i] = img[i] * 1.0f / 255.0f;
+			}
 			lab_vec[k] = new varray(C_classCount);
-			int lab = labels[idx + k];
-			(*lab_vec[k])[lab] = 1.0f;
+			(*lab_vec[k])[*m_train_labels.sample(k)] = 1.0f;
 		}
 
-		// read test data
-		// test images
-		unsigned char *test_images = read_file(m_test_img_file);
-		int test_idx = 0;
-		int test_img_migic = read_int(test_images, test_idx);
-		int test_img_count = read_int(test_images, test_idx);
-		col = read_int(test_images, test_idx);
-		row = read_int(test_images, test_idx);
-
-		// test labels
-		unsigned char *test_labels = read_file(m_test_label_file);
-		int lab_idx = 0;
-		int test_lab_migic = read_int(test_labels, lab_idx);
-		int test_lab_count = read_int(test_labels, lab_idx);
-
-		nn_assert(test_img_count == test_lab_count);
-
+		nn_int test_img_count = m_test_images.count();
+		nn_int test_img_size = m_test_images.sample_size();
 		test_img_vec.resize(test_img_count);
-		for (int k = 0; k < test_img_count; ++k)
+		test_lab_vec.resize(test_img_count);
+		for (nn_int k = 0; k < test_img_count; ++k)
 		{
-			test_img_vec[k] = new varray(N_inputCount);
-			for (int i = 0; i < N_inputCount; ++i)
+			const unsigned char *img = m_test_images.sample(k);
+			test_img_vec[k] = new varray(test_img_size);
+			for (nn_int i = 0; i < test_img_size; ++i)
 			{
-				float v = test_images[test_idx + k * N_inputCount + i] * 1.0f / 255.0f;
-				(*test_img_vec[k])[i] = v;
+				(*test_img_vec[k])[i] = img[i] * 1.0f / 255.0f;
 			}
+			test_lab_vec[k] = *m_test_labels.sample(k);
 		}
 
-		test_lab_vec.resize(test_lab_count);
-		for (int k = 0; k < test_lab_count; ++k)
+		close_files();
+	}
+
+	/*
+		zero copy: the sets view the mapped files, which stay open until
+		the parser is destroyed, pages are read in on first access
+	*/
+	bool read_dataset(compact_dataset &train_set, compact_dataset &test_set)
+	{
+		if (!map_files())
 		{
-			test_lab_vec[k] = test_labels[lab_idx + k];
+			return false;
 		}
+		attach(m_train_images, m_train_labels, train_set);
+		attach(m_test_images, m_test_labels, test_set);
+		return true;
 	}
 
 private:
-	int read_int(unsigned char *buffer, int &index)
-	{
-		int vint = (buffer[index] << 24) | (buffer[index + 1] << 16) |
-			(buffer[index + 2] << 8) | (buffer[index + 3]);
-		index += 4;
-		return vint;
-	}
+	idx_file m_train_images;
+	idx_file m_train_labels;
+	idx_file m_test_images;
+	idx_file m_test_labels;
 
-	unsigned char* read_file(std::string file_path)
+	bool map_files()
 	{
-		std::fstream fsread(file_path, std::fstream::in | std::fstream::binary);
-		if (!fsread)
+		if (!m_train_images.open(m_train_img_file) || !m_train_labels.open(m_train_label_file)
+			|| !m_test_images.open(m_test_img_file) || !m_test_labels.open(m_test_label_file))
 		{
-			std::cerr << "Open failed!" << file_path << std::endl;
-			fsread.exceptions(std::ios::failbit);
-			return nullptr;
+			close_files();
+			return false;
 		}
+		if (!check_pair(m_train_images, m_train_labels) || !check_pair(m_test_images, m_test_labels))
+		{
+			std::cerr << "Images and labels do not match!" << std::endl;
+			close_files();
+			return false;
+		}
+		if (!check_labels(m_train_labels) || !check_labels(m_test_labels))
+		{
+			std::cerr << "Invalid label!" << std::endl;
+			close_files();
+			return false;
+		}
+		return true;
+	}
 
-		unsigned char *buffer;
-		long size;
+	void close_files()
+	{
+		m_train_images.close();
+		m_train_labels.close();
+		m_test_images.close();
+		m_test_labels.close();
+	}
 
-		//get length of file:
-		fsread.seekg(0, std::ios::end);
-		size = (long)fsread.tellg();
-		fsread.seekg(0, std::ios::beg);
+	// images: count * rows * cols (* depth), labels: count
+	bool check_pair(const idx_file &images, const idx_file &labels)
+	{
+		return images.dim_count() >= 2 && labels.dim_count() == 1 && images.count() == labels.count();
+	}
 
-		buffer = new unsigned char[size];
-		fsread.read(reinterpret_cast<char*>(buffer), size);
-		fsread.close();
+	// a label past the class count would index past the one-hot vector / the output
+	bool check_labels(const idx_file &labels)
+	{
+		for (nn_int k = 0; k < labels.count(); ++k)
+		{
+			if (*labels.sample(k) >= C_classCount)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
 
-		return buffer;
+	void attach(const idx_file &images, const idx_file &labels, compact_dataset &data_set)
+	{
+		nn_int ndim = images.dim_count();
+		nn_int height = ndim >= 3 ? images.dim(1) : 1;
+		nn_int width = ndim >= 3 ? images.dim(2) : images.dim(1);
+		nn_int depth = images.sample_size() / (width * height);
+		data_set.attach(images.count() > 0 ? images.sample(0) : nullptr, labels.count() > 0 ? labels.sample(0) : nullptr
+			, images.count(), width, height, depth, C_classCount);
 	}
 
 };
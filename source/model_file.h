@@ -0,0 +1,314 @@
+#ifndef __MODEL_FILE_H__
+#define __MODEL_FILE_H__
+
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+
+namespace mini_cnn
+{
+
+/*
+	binary model file, little endian
+
+	offset      size
+	0           64          file header
+	64          128 * n     one record per layer: layer_desc, offset and size of m_w, m_b and m_stats
+	...                     tensor sections, raw nn_float in varray order,
+	                        each one starting at a 64-byte boundary
+
+	the tensors can be used in place, model_file::load(..., true) maps the file
+	and points every m_w / m_b / m_stats at its section. the mapping is copy on write, so
+	all processes loading the same file share one page cache copy of the weights.
+*/
+class model_file
+{
+public:
+	static const uint32_t cVersion = 1;
+	static const uint32_t cByteOrder = 0x01020304;
+	static const size_t cAlign = 64;
+
+private:
+	struct file_header
+	{
+		char m_magic[8];
+		uint32_t m_version;
+		uint32_t m_byte_order;
+		uint32_t m_float_size;
+		uint32_t m_layer_count;
+		uint64_t m_file_size;
+		uint8_t m_reserved[32];
+	};
+
+	struct layer_record
+	{
+		uint64_t m_w_offset;
+		uint64_t m_b_offset;
+		uint32_t m_w_count;
+		uint32_t m_b_count;
+		int32_t m_type;
+		int32_t m_args[8];
+		float m_prob;
+		uint64_t m_s_offset;  // m_stats, zero count in files of networks without statistics
+		uint32_t m_s_count;
+		uint8_t m_reserved[52];
+	};
+
+	static_assert(sizeof(file_header) == 64, "model file header must be 64 bytes");
+	static_assert(sizeof(layer_record) == 128, "model layer record must be 128 bytes");
+
+	mapped_file m_file;
+
+public:
+	model_file()
+	{
+	}
+
+	model_file(const model_file&) = delete;
+	model_file& operator=(const model_file&) = delete;
+
+	static bool save(const network &nn, const std::string &file_path)
+	{
+		const std::vector<layer_base*> &layers = nn.layers();
+		nn_int layer_count = (nn_int)layers.size();
+
+		file_header header;
+		::memset(&header, 0, sizeof(header));
+		::memcpy(header.m_magic, "MINICNN", 8);
+		header.m_version = cVersion;
+		header.m_byte_order = cByteOrder;
+		header.m_float_size = sizeof(nn_float);
+		header.m_layer_count = layer_count;
+
+		std::vector<layer_record> records(layer_count);
+		size_t offset = align_up(sizeof(file_header) + layer_count * sizeof(layer_record));
+		for (nn_int i = 0; i < layer_count; ++i)
+		{
+			const layer_base *layer = layers[i];
+			layer_desc desc;
+			layer->describe(desc);
+
+			layer_record &rec = records[i];
+			::memset(&rec, 0, sizeof(rec));
+			rec.m_type = desc.m_type;
+			for (nn_int k = 0; k < 8; ++k)
+			{
+				rec.m_args[k] = desc.m_args[k];
+			}
+			rec.m_prob = (float)desc.m_prob;
+
+			rec.m_w_count = layer->m_w.size();
+			rec.m_w_offset = offset;
+			offset = align_up(offset + rec.m_w_count * sizeof(nn_float));
+			rec.m_b_count = layer->m_b.size();
+			rec.m_b_offset = offset;
+			offset = align_up(offset + rec.m_b_count * sizeof(nn_float));
+			rec.m_s_count = layer->m_stats.size();
+			rec.m_s_offset = offset;
+			offset = align_up(offset + rec.m_s_count * sizeof(nn_float));
+		}
+		header.m_file_size = offset;
+
+		std::ofstream fs(file_path, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!fs)
+		{
+			std::cerr << "Open failed!" << file_path << std::endl;
+			return false;
+		}
+		fs.write((const char*)&header, sizeof(header));
+		if (layer_count > 0)
+		{
+			fs.write((const char*)&records[0], layer_count * sizeof(layer_record));
+		}
+		for (nn_int i = 0; i < layer_count; ++i)
+		{
+			const layer_base *layer = layers[i];
+			write_section(fs, records[i].m_w_offset, layer->m_w);
+			write_section(fs, records[i].m_b_offset, layer->m_b);
+			write_section(fs, records[i].m_s_offset, layer->m_stats);
+		}
+		pad_to(fs, offset);
+		return (bool)fs;
+	}
+
+	/*
+		rebuild the layers of file_path into the empty network nn
+		map_weights: m_w / m_b view the mapped file instead of owning a copy,
+			this model_file must then outlive nn
+	*/
+	bool load(network &nn, const std::string &file_path, bool map_weights = false)
+	{
+		if (!nn.layers().empty())
+		{
+			std::cerr << "Load into a network that has layers!" << std::endl;
+			return false;
+		}
+		if (!m_file.open(file_path, true))
+		{
+			std::cerr << "Open failed!" << file_path << std::endl;
+			return false;
+		}
+		if (!check(file_path))
+		{
+			m_file.close();
+			return false;
+		}
+
+		const file_header *header = (const file_header*)m_file.data();
+		const layer_record *records = (const layer_record*)(m_file.data() + sizeof(file_header));
+		for (uint32_t i = 0; i < header->m_layer_count; ++i)
+		{
+			layer_base *layer = create_layer(records[i]);
+			if (layer == nullptr)
+			{
+				std::cerr << "Unknown layer type!" << file_path << std::endl;
+				m_file.close();
+				return false;
+			}
+			nn.add_layer(layer);
+		}
+
+		const std::vector<layer_base*> &layers = nn.layers();
+		for (uint32_t i = 0; i < header->m_layer_count; ++i)
+		{
+			layer_base *layer = layers[i];
+			const layer_record &rec = records[i];
+			if (layer->m_w.size() != (nn_int)rec.m_w_count || layer->m_b.size() != (nn_int)rec.m_b_count
+				|| layer->m_stats.size() != (nn_int)rec.m_s_count)
+			{
+				std::cerr << "Parameter count mismatch!" << file_path << std::endl;
+				m_file.close();
+				return false;
+			}
+			bind_section(layer->m_w, rec.m_w_offset, map_weights);
+			bind_section(layer->m_b, rec.m_b_offset, map_weights);
+			bind_section(layer->m_stats, rec.m_s_offset, map_weights);
+		}
+
+		if (!map_weights)
+		{
+			m_file.close();
+		}
+		return true;
+	}
+
+	// release the mapping, only after the network using the mapped weights is gone
+	void close()
+	{
+		m_file.close();
+	}
+
+private:
+	static size_t align_up(size_t bytes)
+	{
+		return (bytes + cAlign - 1) & ~(cAlign - 1);
+	}
+
+	static void pad_to(std::ofstream &fs, size_t offset)
+	{
+		static const char zeros[cAlign] = { 0 };
+		size_t pos = (size_t)fs.tellp();
+		nn_assert(pos <= offset && offset - pos < cAlign);
+		fs.write(zeros, offset - pos);
+	}
+
+	static void write_section(std::ofstream &fs, size_t offset, const varray &arr)
+	{
+		pad_to(fs, offset);
+		if (arr.size() > 0)
+		{
+			fs.write((const char*)&arr[0], arr.size() * sizeof(nn_float));
+		}
+	}
+
+	bool check(const std::string &file_path) const
+	{
+		size_t size = m_file.size();
+		const file_header *header = (const file_header*)m_file.data();
+		if (size < sizeof(file_header) || ::memcmp(header->m_magic, "MINICNN", 8) != 0)
+		{
+			std::cerr << "Not a model file!" << file_path << std::endl;
+			return false;
+		}
+		if (header->m_version != cVersion || header->m_byte_order != cByteOrder || header->m_float_size != sizeof(nn_float))
+		{
+			std::cerr << "Unsupported model file version or format!" << file_path << std::endl;
+			return false;
+		}
+		if (header->m_file_size != size || sizeof(file_header) + header->m_layer_count * sizeof(layer_record) > size)
+		{
+			std::cerr << "Truncated model file!" << file_path << std::endl;
+			return false;
+		}
+
+		const layer_record *records = (const layer_record*)(m_file.data() + sizeof(file_header));
+		for (uint32_t i = 0; i < header->m_layer_count; ++i)
+		{
+			const layer_record &rec = records[i];
+			if (rec.m_w_offset % cAlign != 0 || rec.m_b_offset % cAlign != 0 || rec.m_s_offset % cAlign != 0
+				|| rec.m_w_offset + rec.m_w_count * sizeof(nn_float) > size
+				|| rec.m_b_offset + rec.m_b_count * sizeof(nn_float) > size
+				|| rec.m_s_offset + rec.m_s_count * sizeof(nn_float) > size)
+			{
+				std::cerr << "Invalid tensor section!" << file_path << std::endl;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void bind_section(varray &arr, uint64_t offset, bool map_weights)
+	{
+		if (arr.size() == 0)
+		{
+			return;
+		}
+		nn_float *data = (nn_float*)(m_file.data() + offset);
+		if (map_weights)
+		{
+			arr.attach(data, arr.width(), arr.height(), arr.depth(), arr.count());
+		}
+		else
+		{
+			::memcpy(&arr[0], data, arr.size() * sizeof(nn_float));
+		}
+	}
+
+	static layer_base* create_layer(const layer_record &rec)
+	{
+		const int32_t *a = rec.m_args;
+		switch (rec.m_type)
+		{
+		case layer_type::eInputLayer:
+			return new input_layer(a[0], a[1], a[2]);
+		case layer_type::eFullyConnectedLayer:
+			return new fully_connected_layer(a[0], (activation_type)a[1]);
+		case layer_type::eOutputLayer:
+			return new output_layer(a[0], (lossfunc_type)a[2], (activation_type)a[1]);
+		case layer_type::eConvolutionalLayer:
+			return new convolutional_layer(a[0], a[1], a[2], a[3], a[4], a[5], (padding_type)a[6], (activation_type)a[7]);
+		case layer_type::eMaxPoolingLayer:
+			return new max_pooling_layer(a[0], a[1], a[2], a[3]);
+		case layer_type::eAvgPoolingLayer:
+			return new avg_pooling_layer(a[0], a[1], a[2], a[3]);
+		case layer_type::eGlobalAvgPoolingLayer:
+			return new global_avg_pooling_layer();
+		case layer_type::eDropoutLayer:
+			return new dropout_layer(rec.m_prob);
+		case layer_type::eBatchNormLayer:
+			return new batch_norm_layer((activation_type)a[0], a[1] * 1e-6f, rec.m_prob);
+		case layer_type::eDepthwiseConvLayer:
+			return new depthwise_convolutional_layer(a[0], a[1], a[2], a[3], a[4], (activation_type)a[5]);
+		case layer_type::eGroupedConvLayer:
+			return new grouped_convolutional_layer(a[0], a[1], a[2], a[3], a[4], a[5], a[6], (activation_type)a[7]);
+		default:
+			return nullptr;
+		}
+	}
+};
+
+}
+
+#endif //__MODEL_FILE_H__
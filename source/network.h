@@ -7,6 +7,9 @@
 #include <algorithm>
 #include <thread>
 #include <future>
+#include <memory>
+#include <string>
+#include <stdexcept>
 
 namespace mini_cnn
 {
@@ -16,9 +19,23 @@ private:
 	input_layer *m_input_layer;
 	output_layer *m_output_layer;
 	std::vector<layer_base*> m_layers;
+	index_vec m_segment_begin; // for a checkpoint, the first recomputed layer below it, -1 if none
+	index_vec m_norm_layers;   // indices of the batch norm layers, bottom up (see train_stages)
+	index_vec m_norm_dropouts; // dropout layers below a batch norm layer, their segments run forward twice
+	memory_arena m_arena;      // per-task buffers of all layers
+	nn_int m_loader_threads;   // batch_loader threads used by SGD
+	nn_int m_prefetch_count;   // minibatches prepared ahead of training
+	const augment_pipeline *m_augment;  // applied to training samples by the loader, not owned
+	std::unique_ptr<optimizer> m_optimizer;
+	std::unique_ptr<lr_schedule> m_lr_schedule;  // nullptr: constant learning rate
+	std::unique_ptr<checkpoint_writer> m_checkpoint;
+	nn_int m_checkpoint_interval;  // minibatches between two checkpoints, 0: only after every epoch
+	train_state m_resume;          // where the next SGD continues, valid when m_resume_pending
+	bool m_resume_pending;
 
 public:
-	network()
+	network() : m_input_layer(nullptr), m_output_layer(nullptr), m_loader_threads(1), m_prefetch_count(2), m_augment(nullptr)
+		, m_optimizer(new sgd_optimizer()), m_checkpoint_interval(0), m_resume_pending(false)
 	{
 	}
 
@@ -37,13 +54,28 @@ public:
 				throw std::exception("must add input layer first!");
 			}
 			m_layers.push_back(layer);
+			m_segment_begin.push_back(-1);
 			m_input_layer = in;
 		}
 		else
 		{
+			if (dynamic_cast<batch_norm_layer*>(layer) != nullptr)
+			{
+				m_norm_dropouts.clear();
+				for (nn_int i = 0; i < (nn_int)m_layers.size(); ++i)
+				{
+					if (dynamic_cast<dropout_layer*>(m_layers[i]) != nullptr)
+					{
+						m_norm_dropouts.push_back(i);
+					}
+				}
+				m_norm_layers.push_back((nn_int)m_layers.size());
+			}
+
 			layer_base* last = *m_layers.rbegin();
 			last->connect(layer);
 			m_layers.push_back(layer);
+			m_segment_begin.push_back(-1);
 
 			output_layer *out = dynamic_cast<output_layer*>(layer);
 			if (out != nullptr)
@@ -54,6 +86,19 @@ public:
 		}
 	}
 
+	const std::vector<layer_base*>& layers() const
+	{
+		return m_layers;
+	}
+
+	// frozen copy of the current weights for serving, see inference_plan
+	inference_plan compile_for_inference() const
+	{
+		inference_plan plan;
+		plan.compile(m_layers);
+		return plan;
+	}
+
 	nn_int paramters_count() const
 	{
 		nn_int cnt = 0;
@@ -67,16 +112,171 @@ public:
 	void init_all_weight(weight_initializer &initializer)
 	{
 		initializer(m_layers);
+		for (auto &layer : m_layers)
+		{
+			layer->init_fixed_weight();
+		}
+	}
+
+	/*
+		update rule used by SGD, owned by the network (default: plain sgd_optimizer).
+		the learning rate passed to SGD is the optimizer's learning rate.
+	*/
+	void set_optimizer(optimizer *opt)
+	{
+		nn_assert(opt != nullptr);
+		m_optimizer.reset(opt);
 	}
 
+	optimizer& get_optimizer()
+	{
+		return *m_optimizer;
+	}
+
+	/*
+		learning rate schedule of SGD (warmup, step or cosine decay), owned by the network.
+		the learning rate passed to SGD is the base rate, nullptr keeps it constant.
+	*/
+	void set_lr_schedule(lr_schedule *schedule)
+	{
+		m_lr_schedule.reset(schedule);
+	}
+
+	// threads assembling minibatches for SGD and how many batches they may run ahead
+	void set_data_loader(nn_int nthreads, nn_int prefetch_count)
+	{
+		nn_assert(nthreads > 0 && prefetch_count > 0);
+		m_loader_threads = nthreads;
+		m_prefetch_count = prefetch_count;
+	}
+
+	// augment training samples on the loader threads, nullptr turns it off
+	void set_augmentation(const augment_pipeline *augment)
+	{
+		m_augment = augment;
+	}
+
+	// back per-task buffers with (transparent) huge pages, takes effect when the arena grows
+	void use_huge_pages(bool enable)
+	{
+		m_arena.set_huge_pages(enable);
+	}
+
+	/*
+		plan every per-task buffer up front and carve them out of one region,
+		task by task so that one thread's buffers are contiguous
+	*/
 	void set_task_count(nn_int task_count)
+	{
+		alloc_task_storage(task_count, false);
+	}
+
+	/*
+		inference only compilation of the per-task storage:
+		gradients and deltas are not allocated, layer outputs and temporaries
+		share a few ping-pong buffers per task by liveness (see memory_arena).
+		only test/get_cost may run afterwards, call set_task_count again before training.
+	*/
+	void compile_inference_storage(nn_int task_count)
+	{
+		set_phase(phase_type::eTest);
+		alloc_task_storage(task_count, true);
+	}
+
+	/*
+		gradient checkpointing: only the given layers (indices in add_layer order) keep
+		their forward activations, the layers between two checkpoints share buffers with
+		the other segments and are recomputed from the checkpoint below during back propagation.
+		input, output and batch norm layers are always checkpoints. takes effect on the next set_task_count.
+	*/
+	void set_checkpoints(const index_vec &layer_indices)
+	{
+		nn_int layer_count = (nn_int)m_layers.size();
+		nn_assert(layer_count >= 2);
+		std::vector<bool> keep(layer_count, false);
+		keep[0] = true;
+		keep[layer_count - 1] = true;
+		for (nn_int idx : m_norm_layers)
+		{
+			keep[idx] = true;
+		}
+		for (nn_int idx : layer_indices)
+		{
+			nn_assert(idx >= 0 && idx < layer_count);
+			keep[idx] = true;
+		}
+
+		nn_int segment_begin = -1;
+		for (nn_int i = 0; i < layer_count; ++i)
+		{
+			m_layers[i]->set_keep_activation(keep[i]);
+			if (keep[i])
+			{
+				m_segment_begin[i] = segment_begin;
+				segment_begin = -1;
+			}
+			else
+			{
+				m_segment_begin[i] = -1;
+				if (segment_begin < 0)
+				{
+					segment_begin = i;
+				}
+			}
+		}
+	}
+
+	// a checkpoint every sqrt(L) hidden layers, O(sqrt(L)) activations alive per task
+	void set_auto_checkpoints()
+	{
+		nn_int hidden_count = (nn_int)m_layers.size() - 2;
+		nn_int interval = std::max(1, (nn_int)std::ceil(std::sqrt((nn_float)std::max(hidden_count, 0))));
+		index_vec layer_indices;
+		for (nn_int i = interval; i <= hidden_count; i += interval)
+		{
+			layer_indices.push_back(i);
+		}
+		set_checkpoints(layer_indices);
+	}
+
+	// every layer keeps its activations (default)
+	void clear_checkpoints()
+	{
+		for (nn_int i = 0; i < (nn_int)m_layers.size(); ++i)
+		{
+			m_layers[i]->set_keep_activation(true);
+			m_segment_begin[i] = -1;
+		}
+	}
+
+	/*
+		sparse backward for every layer that has one (see layer_base::set_sparse_backward),
+		0 turns it off. takes effect on the next set_task_count
+	*/
+	void set_sparse_backward(nn_float max_density)
 	{
 		for (auto &layer : m_layers)
 		{
-			layer->set_task_count(task_count);
+			layer->set_sparse_backward(max_density);
 		}
 	}
 
+	/*
+		mostly zero samples go to the first layer as (index, value) pairs (see
+		input_layer::set_sparse_output), 0 turns it off. takes effect on the next set_task_count
+	*/
+	void set_sparse_input(nn_float max_density)
+	{
+		nn_assert(m_input_layer != nullptr);
+		m_input_layer->set_sparse_output(max_density);
+	}
+
+	// bytes of all per-task buffers
+	size_t task_storage_size() const
+	{
+		return m_arena.used_size();
+	}
+
 	nn_float SGD(const varray_vec &img_vec, const varray_vec &lab_vec, const varray_vec &test_img_vec, const index_vec &test_lab_vec
 		, nn_int epoch, nn_int batch_size, nn_float learning_rate, nn_int nthreads
 		, std::function<void(nn_int, nn_int)> minibatch_callback
@@ -109,7 +309,7 @@ public:
 					batch_img_vec[k] = img_vec[j];
 					batch_label_vec[k] = lab_vec[j];
 				}
-				train_one_batch(batch_img_vec, batch_label_vec, learning_rate, nthreads);
+				train_one_batch(batch_img_vec, batch_label_vec, current_rate(learning_rate, c * batch + i, batch, epoch * batch), nthreads);
 				minibatch_callback((i + 1) * batch_size, img_count);
 			}
 			auto train_end = get_now_ms();
@@ -125,28 +325,130 @@ public:
 		return max_accuracy;
 	}
 
-	void train_one_batch(const varray_vec &batch_img_vec, const varray_vec &batch_label_vec, nn_float eta, const nn_int max_threads)
+	/*
+		SGD over dataset_source writes a checkpoint to path every every_batches minibatches
+		and after every epoch. the parameters are copied and written in the background.
+		with checkpoint_writer::install_stop_handler a SIGTERM ends SGD after the
+		current minibatch with a final checkpoint.
+	*/
+	void set_checkpoint(const std::string &path, nn_int every_batches)
 	{
-		nn_assert(batch_img_vec.size() == batch_label_vec.size());
-		nn_int batch_size = batch_img_vec.size();
-		nn_int nthreads = std::min(max_threads, batch_size);
-		nn_int nstep = (batch_size + nthreads - 1) / nthreads;
+		m_checkpoint.reset(new checkpoint_writer(path));
+		m_checkpoint_interval = every_batches;
+	}
 
-		std::vector<std::future<void>> futures;
-		for (nn_int k = 0; k < nthreads && k * nstep < batch_size; ++k)
+	/*
+		restore parameters, optimizer state, random generator and position from a checkpoint,
+		the next SGD call continues there. same layers, optimizer and batch size required.
+	*/
+	bool resume(const std::string &path)
+	{
+		m_optimizer->prepare(m_layers);
+		if (!checkpoint_writer::load(path, m_layers, *m_optimizer, m_resume))
 		{
-			nn_int begin = k * nstep;
-			nn_int end = std::min(batch_size, begin + nstep);
-			futures.push_back(std::move(std::async(std::launch::async, [&, begin, end, k]() {
-				train_task(batch_img_vec, batch_label_vec, begin, end, k);
-			})));
+			return false;
 		}
-		for (auto &future : futures)
+		checkpoint_writer::restore_rng(global_setting::m_rand_generator, m_resume.m_rng_state);
+		m_resume_pending = true;
+		return true;
+	}
+
+	/*
+		SGD over any dataset_source, minibatches are gathered and converted
+		to nn_float by the batch_loader threads while the previous one trains
+	*/
+	nn_float SGD(dataset_source &train_set, dataset_source &test_set
+		, nn_int epoch, nn_int batch_size, nn_float learning_rate, nn_int nthreads
+		, std::function<void(nn_int, nn_int)> minibatch_callback
+		, std::function<void(nn_int, nn_int, nn_float, nn_float, nn_float, nn_float)> epoch_callback)
+	{
+		nn_assert(train_set.sample_size() == m_input_layer->out_size());
+		nn_assert(train_set.class_count() == m_output_layer->out_size());
+		set_task_count(nthreads);
+
+		nn_float max_accuracy = 0;
+		nn_int img_count = train_set.count();
+		nn_int test_img_count = test_set.count();
+		nn_int batch = img_count / batch_size;
+
+		nn_int first_epoch = 0;
+		nn_int first_batch = 0;
+		if (m_resume_pending)
 		{
-			future.wait();
+			if (m_resume.m_batch_size != batch_size)
+			{
+				throw std::runtime_error("resume with a different batch size!");
+			}
+			first_epoch = m_resume.m_epoch;
+			first_batch = m_resume.m_batch;
+			max_accuracy = m_resume.m_max_accuracy;
+			m_resume_pending = false;
 		}
-		nn_float eff = eta / batch_size;
-		update_all_weight(eff);
+
+		batch_loader loader(train_set, batch_size, m_prefetch_count, m_loader_threads, m_augment);
+		loader.set_epoch(first_epoch);
+
+		for (nn_int c = first_epoch; c < epoch; ++c)
+		{
+			auto tstart = get_now_ms();
+			nn_int begin = (c == first_epoch) ? first_batch : 0;
+			// an epoch resumed in the middle keeps its seed, the generator was saved after drawing it
+			unsigned long long seed = begin > 0 ? m_resume.m_epoch_seed : global_setting::m_rand_generator();
+			loader.start_epoch(batch * batch_size, true, seed, begin);
+			for (nn_int i = begin; i < batch; ++i)
+			{
+				data_batch &cur_batch = loader.next();
+				train_one_batch(cur_batch.m_img_vec, cur_batch.m_label_idx, current_rate(learning_rate, c * batch + i, batch, epoch * batch), nthreads);
+				loader.release();
+				minibatch_callback((i + 1) * batch_size, img_count);
+
+				if (checkpoint_writer::stop_requested())
+				{
+					save_checkpoint(c, i + 1, seed, batch_size, max_accuracy);
+					if (m_checkpoint)
+					{
+						m_checkpoint->wait();
+					}
+					return max_accuracy;
+				}
+				if (m_checkpoint_interval > 0 && (i + 1) % m_checkpoint_interval == 0 && i + 1 < batch)
+				{
+					save_checkpoint(c, i + 1, seed, batch_size, max_accuracy);
+				}
+			}
+			auto train_end = get_now_ms();
+			nn_float train_elapse = (train_end - tstart) * 0.001f;
+			nn_int correct = test(test_set, nthreads);
+			nn_float cur_accuracy = (1.0f * correct / test_img_count);
+			max_accuracy = std::max(max_accuracy, cur_accuracy);
+			nn_float tot_cost = get_cost(train_set, nthreads);
+			auto test_end = get_now_ms();
+			nn_float test_elapse = (test_end - train_end) * 0.001f;
+			epoch_callback(c + 1, epoch, cur_accuracy, tot_cost, train_elapse, test_elapse);
+			save_checkpoint(c + 1, 0, 0, batch_size, max_accuracy);
+		}
+		if (m_checkpoint)
+		{
+			m_checkpoint->wait();
+		}
+		return max_accuracy;
+	}
+
+	/*
+		labels are either one-hot varrays (varray_vec) or class indices (index_vec),
+		class indices skip the label vectors and the argmax scans
+	*/
+	template<class label_vec_type>
+	void train_one_batch(const varray_vec &batch_img_vec, const label_vec_type &batch_label_vec, nn_float eta, const nn_int max_threads)
+	{
+		nn_assert(batch_img_vec.size() == batch_label_vec.size());
+		set_phase(phase_type::eTrain);
+		train_stages(batch_img_vec, batch_label_vec, max_threads);
+		for (auto &layer : m_layers)
+		{
+			layer->reduce_statistics();
+		}
+		update_all_weight(eta, (nn_int)batch_img_vec.size(), max_threads);
 	}
 
 	nn_int test(const varray_vec &test_img_vec, const index_vec &test_lab_vec, const nn_int max_threads)
@@ -178,69 +480,129 @@ public:
 	{
 		nn_assert(img_vec.size() == lab_vec.size());
 		nn_int tot_count = img_vec.size();
-
-		nn_int nthreads = max_threads;
-		nn_int nstep = (tot_count + nthreads - 1) / nthreads;
-
-		std::vector<std::future<nn_float>> futures;
-		for (nn_int k = 0; k < nthreads && k * nstep < tot_count; ++k)
+		nn_float tot_cost = cost_sum(img_vec, lab_vec, max_threads);
+		if (tot_count > 0)
 		{
-			nn_int begin = k * nstep;
-			nn_int end = std::min(tot_count, begin + nstep);
-			futures.push_back(std::move(std::async(std::launch::async, [&, begin, end, k]() {
-				return cost_task(img_vec, lab_vec, begin, end, k);
-			})));
+			tot_cost /= tot_count;
 		}
+		return tot_cost;
+	}
+
+	/*
+		evaluation streams the set through a batch_loader in file order,
+		each batch is spread over the tasks
+	*/
+	nn_int test(dataset_source &test_set, const nn_int max_threads)
+	{
+		nn_int correct = 0;
+		for_each_batch(test_set, [&](data_batch &cur_batch) {
+			correct += test(cur_batch.m_img_vec, cur_batch.m_label_idx, max_threads);
+		});
+		return correct;
+	}
+
+	nn_float get_cost(dataset_source &data_set, const nn_int max_threads)
+	{
 		nn_float tot_cost = 0;
-		for (auto &future : futures)
+		for_each_batch(data_set, [&](data_batch &cur_batch) {
+			tot_cost += cost_sum(cur_batch.m_img_vec, cur_batch.m_label_idx, max_threads);
+		});
+		if (data_set.count() > 0)
 		{
-			tot_cost += future.get();
-		}
-		if (tot_count > 0)
-		{
-			tot_cost /= tot_count;
+			tot_cost /= data_set.count();
 		}
 		return tot_cost;
 	}
 
+	// test_lab: one-hot varray or class index
 	bool gradient_check(const varray &test_img, const varray &test_lab)
 	{
-		nn_assert(!m_layers.empty());
+		varray img(test_img);
+		varray lab(test_lab);
+		return gradient_check(varray_vec(1, &img), varray_vec(1, &lab), 1);
+	}
+
+	bool gradient_check(const varray &test_img, nn_int test_lab)
+	{
+		varray img(test_img);
+		return gradient_check(varray_vec(1, &img), index_vec(1, test_lab), 1);
+	}
+
+	/*
+		the summed loss of a minibatch against the gradient of every weight / bias,
+		batch statistics make the loss of a sample depend on the whole minibatch
+	*/
+	template<class label_vec_type>
+	bool gradient_check(const varray_vec &batch_img_vec, const label_vec_type &batch_label_vec, nn_int nthreads)
+	{
+		nn_assert(!m_layers.empty() && batch_img_vec.size() == batch_label_vec.size());
 
 		set_phase(phase_type::eGradientCheck);
-		set_task_count(1);
+		set_task_count(nthreads);
 
 		bool check_ok = true;
 		for (auto &layer : m_layers)
 		{
-			auto &ts = layer->get_task_storage(0);
-			varray &w = layer->m_w;
-			varray &dw = ts.m_dw;
-			nn_int w_sz = w.size();
-			for (nn_int i = 0; i < w_sz; ++i)
+			for (nn_int bias = 0; bias < 2; ++bias)
 			{
-				if (!calc_gradient(test_img, test_lab, w[i], dw[i]))
+				varray &w = bias ? layer->m_b : layer->m_w;
+				nn_int w_sz = w.size();
+				for (nn_int i = 0; i < w_sz; ++i)
 				{
-					check_ok = false;
+					if (!calc_gradient(batch_img_vec, batch_label_vec, nthreads, layer, bias != 0, i))
+					{
+						check_ok = false;
+					}
 				}
 			}
+		}
+		return check_ok;
+	}
+
+private:
+	// snapshot for the background checkpoint writer, no-op without set_checkpoint
+	void save_checkpoint(nn_int epoch, nn_int batch, unsigned long long epoch_seed, nn_int batch_size, nn_float max_accuracy)
+	{
+		if (!m_checkpoint)
+		{
+			return;
+		}
+		train_state state;
+		state.m_epoch = epoch;
+		state.m_batch = batch;
+		state.m_batch_size = batch_size;
+		state.m_epoch_seed = epoch_seed;
+		state.m_max_accuracy = max_accuracy;
+		state.m_rng_state = checkpoint_writer::save_rng(global_setting::m_rand_generator);
+		m_checkpoint->write(m_layers, *m_optimizer, state);
+	}
 
-			varray &b = layer->m_b;
-			varray &db = ts.m_db;
-			nn_int b_sz = b.size();
-			for (nn_int i = 0; i < b_sz; ++i)
+	void alloc_task_storage(nn_int task_count, bool inference_only)
+	{
+		// the input is constant, a layer needs its input gradient once a layer below it learns
+		bool below_learns = false;
+		for (auto &layer : m_layers)
+		{
+			layer->set_task_count(task_count);
+			layer->set_need_input_gradient(below_learns);
+			below_learns = below_learns || layer->paramters_count() > 0;
+		}
+
+		m_arena.begin_plan(inference_only);
+		for (nn_int k = 0; k < task_count; ++k)
+		{
+			// recomputed layers share their forward buffers by position in the segment
+			nn_int segment_pos = -1;
+			for (nn_int i = 0; i < (nn_int)m_layers.size(); ++i)
 			{
-				if (!calc_gradient(test_img, test_lab, b[i], db[i]))
-				{
-					check_ok = false;
-				}
+				segment_pos = m_layers[i]->keep_activation() ? -1 : segment_pos + 1;
+				m_arena.set_step(k, i, segment_pos);
+				m_layers[i]->alloc_task_storage(m_arena, k);
 			}
-
 		}
-		return check_ok;
+		m_arena.commit();
 	}
 
-private:
 	void clear_all_grident()
 	{
 		for (auto &layer : m_layers)
@@ -265,31 +627,348 @@ private:
 		}
 	}
 
+	/*
+		the network drives the layers, one loop per direction instead of
+		every layer calling its neighbour, so the stack depth does not grow
+		with the network depth.
+		forward: layer i reads the output of layer i - 1
+	*/
 	void forward(const varray& input, nn_int task_idx)
 	{
 		m_input_layer->forw_prop(input, task_idx);
+		forward_range(1, (nn_int)m_layers.size(), task_idx);
 	}
 
-	void backward(const varray &label, nn_int task_idx)
+	void forward_range(nn_int begin, nn_int end, nn_int task_idx)
 	{
-		m_output_layer->backward(label, task_idx);
+		for (nn_int i = begin; i < end; ++i)
+		{
+			m_layers[i]->forw_prop(m_layers[i - 1]->get_output(task_idx), task_idx);
+		}
 	}
 
-	void update_all_weight(nn_float eff)
+	/*
+		layers top down to bottom + 1, layer i reads m_wd of layer i + 1. the input
+		layer has nothing to do, neither has any layer below the lowest one with parameters.
+		the activations below a checkpoint may have been overwritten by later
+		segments, they are replayed from the checkpoint below first.
+	*/
+	void backward_range(nn_int top, nn_int bottom, nn_int task_idx)
 	{
-		for (auto &layer : m_layers)
+		for (nn_int i = top; i > bottom && i > 0 && m_layers[i]->need_gradient(); --i)
 		{
-			layer->update_weights(eff);
+			if (m_segment_begin[i] >= 0)
+			{
+				recompute_segment(m_segment_begin[i], i, task_idx);
+			}
+			m_layers[i]->back_prop(m_layers[i + 1]->get_task_storage(task_idx).m_wd, task_idx);
 		}
 	}
 
-	void train_task(const varray_vec &batch_img_vec, const varray_vec &batch_label_vec, nn_int begin, nn_int end, nn_int task_idx)
+	// forward again over layers [begin, end), dropout replays its mask
+	void recompute_segment(nn_int begin, nn_int end, nn_int task_idx)
 	{
-		set_phase(phase_type::eTrain);
 		for (nn_int i = begin; i < end; ++i)
 		{
-			forward(*batch_img_vec[i], task_idx);
-			backward(*batch_label_vec[i], task_idx);
+			m_layers[i]->get_task_storage(task_idx).m_recompute = true;
+		}
+		forward_range(begin, end, task_idx);
+		for (nn_int i = begin; i < end; ++i)
+		{
+			m_layers[i]->get_task_storage(task_idx).m_recompute = false;
+		}
+	}
+
+	static const varray& label_at(const varray_vec &label_vec, nn_int i)
+	{
+		return *label_vec[i];
+	}
+
+	static nn_int label_at(const index_vec &label_vec, nn_int i)
+	{
+		return label_vec[i];
+	}
+
+	nn_float current_rate(nn_float base_lr, nn_int step, nn_int steps_per_epoch, nn_int total_steps) const
+	{
+		return m_lr_schedule ? m_lr_schedule->rate(base_lr, step, steps_per_epoch, total_steps) : base_lr;
+	}
+
+	/*
+		the parameters are cut into slices, every slice is reduced over the tasks
+		and updated by the optimizer while it is in cache, slices run in parallel.
+		layer-wise optimizers need the norms of whole parameter vectors first,
+		they get a parallel measure pass over the reduced slices before the update.
+	*/
+	void update_all_weight(nn_float eta, nn_int batch_size, nn_int max_threads)
+	{
+		struct param_slice
+		{
+			nn_int m_layer;
+			bool m_bias;
+			nn_int m_begin;
+			nn_int m_end;
+		};
+
+		const nn_int slice_size = 16 * 1024;  // multiple of a cache line of floats
+		std::vector<param_slice> slices;
+		for (nn_int i = 0; i < (nn_int)m_layers.size(); ++i)
+		{
+			for (bool bias : { false, true })
+			{
+				nn_int sz = bias ? m_layers[i]->m_b.size() : m_layers[i]->m_w.size();
+				for (nn_int begin = 0; begin < sz; begin += slice_size)
+				{
+					slices.push_back({ i, bias, begin, std::min(sz, begin + slice_size) });
+				}
+			}
+		}
+
+		m_optimizer->prepare(m_layers);
+		m_optimizer->begin_step();
+		nn_float grad_scale = nn_float(1) / batch_size;
+		nn_int slice_count = (nn_int)slices.size();
+		bool layer_wise = m_optimizer->layer_wise();
+		std::vector<nn_float*> grads(slice_count, nullptr);
+
+		if (layer_wise)
+		{
+			std::vector<double> sums(slice_count * 2, 0);
+			parallel_for(slice_count, max_threads, [&](nn_int first, nn_int last) {
+				for (nn_int k = first; k < last; ++k)
+				{
+					const param_slice &ps = slices[k];
+					layer_base *layer = m_layers[ps.m_layer];
+					grads[k] = layer->reduce_gradient(ps.m_bias, ps.m_begin, ps.m_end);
+					const nn_float *w = ps.m_bias ? &layer->m_b[0] : &layer->m_w[0];
+					m_optimizer->measure(ps.m_layer, ps.m_bias, w, grads[k], ps.m_begin, ps.m_end, grad_scale, &sums[k * 2]);
+				}
+			});
+			// the slices of one parameter vector are adjacent
+			for (nn_int k = 0; k < slice_count; )
+			{
+				double w_sqr_sum = 0;
+				double d_sqr_sum = 0;
+				nn_int j = k;
+				for (; j < slice_count && slices[j].m_layer == slices[k].m_layer && slices[j].m_bias == slices[k].m_bias; ++j)
+				{
+					w_sqr_sum += sums[j * 2];
+					d_sqr_sum += sums[j * 2 + 1];
+				}
+				m_optimizer->set_norms(slices[k].m_layer, slices[k].m_bias, w_sqr_sum, d_sqr_sum);
+				k = j;
+			}
+		}
+
+		parallel_for(slice_count, max_threads, [&](nn_int first, nn_int last) {
+			for (nn_int k = first; k < last; ++k)
+			{
+				const param_slice &ps = slices[k];
+				layer_base *layer = m_layers[ps.m_layer];
+				nn_float *grad = layer_wise ? grads[k] : layer->reduce_gradient(ps.m_bias, ps.m_begin, ps.m_end);
+				nn_float *w = ps.m_bias ? &layer->m_b[0] : &layer->m_w[0];
+				m_optimizer->update(ps.m_layer, ps.m_bias, w, grad, ps.m_begin, ps.m_end, eta, grad_scale);
+				::memset(grad + ps.m_begin, 0, (ps.m_end - ps.m_begin) * sizeof(nn_float));
+			}
+		});
+	}
+
+	// func(first, last) over contiguous ranges of [0, count), one per thread
+	static void parallel_for(nn_int count, nn_int max_threads, std::function<void(nn_int, nn_int)> func)
+	{
+		nn_int nthreads = std::min(max_threads, count);
+		if (nthreads <= 1)
+		{
+			func(0, count);
+			return;
+		}
+		std::vector<std::future<void>> futures;
+		for (nn_int k = 0; k < nthreads; ++k)
+		{
+			futures.push_back(std::async(std::launch::async, func, count * k / nthreads, count * (k + 1) / nthreads));
+		}
+		for (auto &future : futures)
+		{
+			future.wait();
+		}
+	}
+
+	/*
+		forward and backward of a minibatch, the gradients are summed in the tasks.
+		a batch norm layer needs the statistics of all samples before any sample
+		passes it, the layers form segments between the batch norm layers and the
+		tasks run in stages with a barrier in between:
+		- one stage per batch norm layer bottom up: the segment below it runs
+		  forward, the layer keeps the inputs and reduces mean / var
+		- the top segment runs forward and backward, the top batch norm layer
+		  keeps the deltas and reduces their sums
+		- one stage per batch norm layer top down, while a layer below learns: the
+		  segment below it runs forward again and backward from its input gradient,
+		  dropout replays the masks of the first pass
+		without batch norm layers this is one stage, forward and backward per sample.
+	*/
+	template<class label_vec_type>
+	void train_stages(const varray_vec &batch_img_vec, const label_vec_type &batch_label_vec, nn_int max_threads)
+	{
+		nn_int batch_size = (nn_int)batch_img_vec.size();
+		nn_int top = (nn_int)m_norm_layers.size();
+		forward_statistics(batch_img_vec, max_threads);
+
+		run_tasks(batch_size, max_threads, [&](nn_int begin, nn_int end, nn_int task_idx) {
+			for (nn_int i = begin; i < end; ++i)
+			{
+				forward_segment(top, batch_img_vec, i, task_idx);
+				m_output_layer->backward(label_at(batch_label_vec, i), task_idx);
+				backward_segment(top, i, task_idx);
+			}
+			flush_gradients(task_idx);
+		});
+
+		for (nn_int j = top - 1; j >= 0 && norm_layer(j)->need_input_gradient(); --j)
+		{
+			norm_layer(j)->reduce_delta();
+			run_tasks(batch_size, max_threads, [&, j](nn_int begin, nn_int end, nn_int task_idx) {
+				for (nn_int i = begin; i < end; ++i)
+				{
+					forward_segment(j, batch_img_vec, i, task_idx, true);
+					norm_layer(j)->backward_sample(i, task_idx);
+					backward_segment(j, i, task_idx);
+				}
+				flush_gradients(task_idx);
+			});
+		}
+	}
+
+	// the forward stages of train_stages
+	void forward_statistics(const varray_vec &batch_img_vec, nn_int max_threads)
+	{
+		nn_int batch_size = (nn_int)batch_img_vec.size();
+		for (nn_int d : m_norm_dropouts)
+		{
+			static_cast<dropout_layer*>(m_layers[d])->begin_batch(batch_size);
+		}
+		for (nn_int j = 0; j < (nn_int)m_norm_layers.size(); ++j)
+		{
+			batch_norm_layer *norm = norm_layer(j);
+			norm->begin_batch(batch_size);
+			run_tasks(batch_size, max_threads, [&, j](nn_int begin, nn_int end, nn_int task_idx) {
+				for (nn_int i = begin; i < end; ++i)
+				{
+					forward_segment(j, batch_img_vec, i, task_idx);
+					norm->collect_input(m_layers[m_norm_layers[j] - 1]->get_output(task_idx), i, task_idx);
+				}
+			});
+			norm->reduce_input();
+		}
+	}
+
+	// summed loss of a minibatch as train_stages sees it
+	template<class label_vec_type>
+	nn_float batch_cost(const varray_vec &batch_img_vec, const label_vec_type &batch_label_vec, nn_int max_threads)
+	{
+		nn_int batch_size = (nn_int)batch_img_vec.size();
+		nn_int top = (nn_int)m_norm_layers.size();
+		forward_statistics(batch_img_vec, max_threads);
+
+		std::vector<nn_float> costs(max_threads, 0);
+		run_tasks(batch_size, max_threads, [&](nn_int begin, nn_int end, nn_int task_idx) {
+			for (nn_int i = begin; i < end; ++i)
+			{
+				forward_segment(top, batch_img_vec, i, task_idx);
+				costs[task_idx] += m_output_layer->calc_cost(true, label_at(batch_label_vec, i), task_idx);
+			}
+		});
+		nn_float tot_cost = 0;
+		for (nn_float cost : costs)
+		{
+			tot_cost += cost;
+		}
+		return tot_cost;
+	}
+
+	batch_norm_layer* norm_layer(nn_int j) const
+	{
+		return static_cast<batch_norm_layer*>(m_layers[m_norm_layers[j]]);
+	}
+
+	/*
+		segment j: the layers between batch norm layer j - 1 (the input layer for
+		j = 0) and batch norm layer j (the output layer for the top segment).
+		forward: from the image or the kept input of batch norm layer j - 1. the
+		first pass keeps the dropout masks of sample, a second pass (replay) reuses them
+	*/
+	void forward_segment(nn_int j, const varray_vec &batch_img_vec, nn_int sample, nn_int task_idx, bool replay = false)
+	{
+		nn_int begin = 0;
+		if (j == 0)
+		{
+			m_input_layer->forw_prop(*batch_img_vec[sample], task_idx);
+		}
+		else
+		{
+			begin = m_norm_layers[j - 1];
+			norm_layer(j - 1)->forward_sample(sample, task_idx);
+		}
+		nn_int end = j < (nn_int)m_norm_layers.size() ? m_norm_layers[j] : (nn_int)m_layers.size();
+		if (replay)
+		{
+			for (nn_int d : m_norm_dropouts)
+			{
+				if (d > begin && d < end)
+				{
+					static_cast<dropout_layer*>(m_layers[d])->restore_mask(sample, task_idx);
+				}
+			}
+			recompute_segment(begin + 1, end, task_idx);
+		}
+		else
+		{
+			forward_range(begin + 1, end, task_idx);
+			for (nn_int d : m_norm_dropouts)
+			{
+				if (d > begin && d < end)
+				{
+					static_cast<dropout_layer*>(m_layers[d])->keep_mask(sample, task_idx);
+				}
+			}
+		}
+	}
+
+	// backward: m_wd of the layer on top of segment j is set, ends with the deltas of batch norm layer j - 1
+	void backward_segment(nn_int j, nn_int sample, nn_int task_idx)
+	{
+		nn_int end = j < (nn_int)m_norm_layers.size() ? m_norm_layers[j] : (nn_int)m_layers.size() - 1;
+		nn_int begin = j > 0 ? m_norm_layers[j - 1] : 0;
+		backward_range(end - 1, begin, task_idx);
+		if (j > 0)
+		{
+			norm_layer(j - 1)->collect_delta(m_layers[begin + 1]->get_task_storage(task_idx).m_wd, sample, task_idx);
+		}
+	}
+
+	// func(begin, end, task_idx) for the samples of every task, the same split in every stage
+	static void run_tasks(nn_int count, nn_int max_threads, std::function<void(nn_int, nn_int, nn_int)> func)
+	{
+		nn_int nthreads = std::min(max_threads, count);
+		nn_int nstep = (count + nthreads - 1) / nthreads;
+		std::vector<std::future<void>> futures;
+		for (nn_int k = 0; k < nthreads && k * nstep < count; ++k)
+		{
+			nn_int begin = k * nstep;
+			nn_int end = std::min(count, begin + nstep);
+			futures.push_back(std::async(std::launch::async, func, begin, end, k));
+		}
+		for (auto &future : futures)
+		{
+			future.wait();
+		}
+	}
+
+	void flush_gradients(nn_int task_idx)
+	{
+		for (auto &layer : m_layers)
+		{
+			layer->flush_gradient(task_idx);
 		}
 	}
 
@@ -309,39 +988,82 @@ private:
 		return c_count;
 	}
 
-	nn_float cost_task(const varray_vec &img_vec, const varray_vec &label_vec, nn_int begin, nn_int end, nn_int task_idx)
+	template<class label_vec_type>
+	nn_float cost_task(const varray_vec &img_vec, const label_vec_type &label_vec, nn_int begin, nn_int end, nn_int task_idx)
 	{
 		set_phase(phase_type::eTest);
 		nn_float cost = 0;
 		for (nn_int i = begin; i < end; ++i)
 		{
-			m_input_layer->forw_prop(*img_vec[i], task_idx);
-			cost += m_output_layer->calc_cost(false, *label_vec[i], task_idx);
+			forward(*img_vec[i], task_idx);
+			cost += m_output_layer->calc_cost(false, label_at(label_vec, i), task_idx);
 		}
 		return cost;
 	}
 
-	bool calc_gradient(const varray &test_img, const varray &test_lab, nn_float &w, nn_float &dw)
+	template<class label_vec_type>
+	nn_float cost_sum(const varray_vec &img_vec, const label_vec_type &lab_vec, const nn_int max_threads)
+	{
+		nn_int tot_count = img_vec.size();
+
+		nn_int nthreads = max_threads;
+		nn_int nstep = (tot_count + nthreads - 1) / nthreads;
+
+		std::vector<std::future<nn_float>> futures;
+		for (nn_int k = 0; k < nthreads && k * nstep < tot_count; ++k)
+		{
+			nn_int begin = k * nstep;
+			nn_int end = std::min(tot_count, begin + nstep);
+			futures.push_back(std::move(std::async(std::launch::async, [&, begin, end, k]() {
+				return cost_task(img_vec, lab_vec, begin, end, k);
+			})));
+		}
+		nn_float tot_cost = 0;
+		for (auto &future : futures)
+		{
+			tot_cost += future.get();
+		}
+		return tot_cost;
+	}
+
+	void for_each_batch(dataset_source &data_set, std::function<void(data_batch&)> func)
+	{
+		const nn_int eval_batch_size = 1024;
+		batch_loader loader(data_set, eval_batch_size, m_prefetch_count, m_loader_threads);
+		nn_int batch_count = loader.start_epoch(data_set.count(), false, 0);
+		for (nn_int i = 0; i < batch_count; ++i)
+		{
+			func(loader.next());
+			loader.release();
+		}
+	}
+
+	// w: weight (bias) i of layer
+	template<class label_vec_type>
+	bool calc_gradient(const varray_vec &batch_img_vec, const label_vec_type &batch_label_vec, nn_int nthreads
+		, layer_base *layer, bool bias, nn_int i)
 	{
 		static const nn_float EPSILON = 1e-6f;
 		static const nn_float Precision = 1e-4f;
 
 		clear_all_grident();
-		set_fixed_prop(0);
+		for (nn_int k = 0; k < nthreads; ++k)
+		{
+			set_fixed_prop(k);
+		}
 
+		nn_float &w = bias ? layer->m_b[i] : layer->m_w[i];
 		nn_float prev_w = w;
 		w = prev_w + EPSILON;
-		m_input_layer->forw_prop(test_img, 0);
-		nn_float loss_0 = m_output_layer->calc_cost(true, test_lab, 0);
+		nn_float loss_0 = batch_cost(batch_img_vec, batch_label_vec, nthreads);
 
 		w = prev_w - EPSILON;
-		m_input_layer->forw_prop(test_img, 0);
-		nn_float loss_1 = m_output_layer->calc_cost(true, test_lab, 0);
+		nn_float loss_1 = batch_cost(batch_img_vec, batch_label_vec, nthreads);
 		nn_float delta_by_numerical = (loss_0 - loss_1) / (nn_float(2.0) * EPSILON);
 
 		w = prev_w;
-		m_input_layer->forw_prop(test_img, 0);
-		m_output_layer->backward(test_lab, 0);
+		train_stages(batch_img_vec, batch_label_vec, nthreads);
+		nn_float dw = layer->reduce_gradient(bias, i, i + 1)[i];
 
 		nn_float delta_by_bprop = dw;
 
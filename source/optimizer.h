@@ -0,0 +1,605 @@
+#ifndef __OPTIMIZER_H__
+#define __OPTIMIZER_H__
+
+#include <vector>
+#include <cmath>
+
+namespace mini_cnn
+{
+
+/*
+	parameter update rule, applied by the network after every minibatch
+
+	the per-parameter state of all layers (velocities, moments) lives in one
+	contiguous block: state_count() planes, each plane holds one value per
+	parameter and every parameter vector starts at a cache line.
+
+	update() is a single fused pass over a slice of one parameter vector,
+	it reads the reduced gradient once, scales it to the batch mean, adds the
+	l2 weight decay (weights only, see layer_base::decays_weight) and applies the rule.
+	slices are independent, the network runs them on several threads.
+*/
+class optimizer
+{
+protected:
+	nn_int m_state_count;  // state values per parameter
+	nn_float m_weight_decay;
+	nn_int m_step;         // minibatches applied so far
+	varray m_state;
+	std::vector<nn_int> m_offsets;  // per layer: state offset of m_w, then of m_b
+	nn_int m_plane_size;
+	std::vector<nn_float> m_trust;  // per parameter vector: layer-wise scale of the learning rate
+	std::vector<nn_float> m_decay;  // per parameter vector: weight decay, 0 for biases
+
+public:
+	optimizer(nn_int state_count, nn_float weight_decay)
+		: m_state_count(state_count), m_weight_decay(weight_decay), m_step(0), m_plane_size(0)
+	{
+	}
+
+	virtual ~optimizer()
+	{
+	}
+
+	nn_int state_count() const
+	{
+		return m_state_count;
+	}
+
+	nn_float weight_decay() const
+	{
+		return m_weight_decay;
+	}
+
+	nn_int step_count() const
+	{
+		return m_step;
+	}
+
+	void set_step_count(nn_int step)
+	{
+		m_step = step;
+	}
+
+	// the state block, checkpoints save and restore it as is
+	varray& state()
+	{
+		return m_state;
+	}
+
+	/*
+		lay out the state for the parameters of layers, a no-op when the layout
+		is already there. a new layout starts from zero state and step 0.
+	*/
+	void prepare(const std::vector<layer_base*> &layers)
+	{
+		std::vector<nn_int> offsets;
+		nn_int plane_size = 0;
+		m_decay.clear();
+		for (auto layer : layers)
+		{
+			offsets.push_back(plane_size);
+			plane_size += align_up(layer->m_w.size());
+			offsets.push_back(plane_size);
+			plane_size += align_up(layer->m_b.size());
+			m_decay.push_back(layer->decays_weight() ? m_weight_decay : 0);
+			m_decay.push_back(0);
+		}
+		if (offsets == m_offsets && m_plane_size == plane_size)
+		{
+			return;
+		}
+		m_offsets = offsets;
+		m_plane_size = plane_size;
+		m_trust.assign(offsets.size(), 1);
+		m_step = 0;
+		if (m_state_count > 0 && plane_size > 0)
+		{
+			m_state.resize(plane_size, m_state_count);
+		}
+		else
+		{
+			m_state.resize(0);
+		}
+	}
+
+	// once per minibatch, before the update() calls of that minibatch
+	virtual void begin_step()
+	{
+		++m_step;
+	}
+
+	/*
+		layer-wise rules (lars, lamb) scale the step of every weight vector by a
+		trust ratio computed from norms over the whole vector. the network then
+		runs measure() over all slices, set_norms() per vector and update() last.
+	*/
+	virtual bool layer_wise() const
+	{
+		return false;
+	}
+
+	// adds the squared norms of w and of the step direction over the slice to sums[0], sums[1]
+	void measure(nn_int layer_idx, bool bias, const nn_float *w, const nn_float *g, nn_int begin, nn_int end, nn_float grad_scale, double *sums)
+	{
+		nn_int param = layer_idx * 2 + (bias ? 1 : 0);
+		measure_slice(w + begin, g + begin, m_offsets[param] + begin, end - begin, grad_scale, m_decay[param], sums);
+	}
+
+	// biases keep the plain learning rate
+	void set_norms(nn_int layer_idx, bool bias, double w_sqr_sum, double d_sqr_sum)
+	{
+		m_trust[layer_idx * 2 + (bias ? 1 : 0)] = bias ? 1 : trust_ratio(std::sqrt(w_sqr_sum), std::sqrt(d_sqr_sum));
+	}
+
+	/*
+		w, g: slice [begin, end) of parameter vector `bias ? m_b : m_w` of layer layer_idx and its summed gradient
+		lr: learning rate, grad_scale: 1 / batch size
+	*/
+	void update(nn_int layer_idx, bool bias, nn_float *w, const nn_float *g, nn_int begin, nn_int end, nn_float lr, nn_float grad_scale)
+	{
+		nn_int param = layer_idx * 2 + (bias ? 1 : 0);
+		apply(w + begin, g + begin, m_offsets[param] + begin, end - begin, lr * m_trust[param], grad_scale, m_decay[param]);
+	}
+
+protected:
+	// s(k): plane k of the state, offset by the first value of the slice
+	nn_float* s(nn_int k, nn_int offset)
+	{
+		return &m_state[0] + (size_t)k * m_plane_size + offset;
+	}
+
+	virtual void apply(nn_float *nn_restrict w, const nn_float *nn_restrict g, nn_int offset, nn_int n
+		, nn_float lr, nn_float grad_scale, nn_float decay) = 0;
+
+	virtual void measure_slice(const nn_float *nn_restrict w, const nn_float *nn_restrict g, nn_int offset, nn_int n
+		, nn_float grad_scale, nn_float decay, double *sums)
+	{
+	}
+
+	virtual nn_float trust_ratio(double w_norm, double d_norm) const
+	{
+		return 1;
+	}
+
+	/*
+		x := sqrt(x) + eps with eigen's packet sqrt, plain sqrt loops are not
+		vectorized by compilers that keep errno semantics
+	*/
+	static void sqrt_add(nn_float *x, nn_int n, nn_float eps)
+	{
+		Map<Array<nn_float, Dynamic, 1>> arr(x, n);
+		arr = arr.sqrt() + eps;
+	}
+
+	// rules with a sqrt run over chunks that stay in l1 cache
+	static const nn_int chunk_size = 256;
+
+private:
+	static nn_int align_up(nn_int count)
+	{
+		const nn_int line = nn_cache_line_size / sizeof(nn_float);
+		return (count + line - 1) / line * line;
+	}
+};
+
+/*
+	w -= lr * g
+*/
+class sgd_optimizer : public optimizer
+{
+public:
+	sgd_optimizer(nn_float weight_decay = 0) : optimizer(0, weight_decay)
+	{
+	}
+
+protected:
+	virtual void apply(nn_float *nn_restrict w, const nn_float *nn_restrict g, nn_int offset, nn_int n
+		, nn_float lr, nn_float grad_scale, nn_float decay)
+	{
+		for (nn_int i = 0; i < n; ++i)
+		{
+			nn_float gi = g[i] * grad_scale + decay * w[i];
+			w[i] -= lr * gi;
+		}
+	}
+};
+
+/*
+	v = mu * v - lr * g
+	w += v
+*/
+class momentum_optimizer : public optimizer
+{
+private:
+	nn_float m_momentum;
+
+public:
+	momentum_optimizer(nn_float momentum = 0.9f, nn_float weight_decay = 0) : optimizer(1, weight_decay), m_momentum(momentum)
+	{
+	}
+
+protected:
+	virtual void apply(nn_float *nn_restrict w, const nn_float *nn_restrict g, nn_int offset, nn_int n
+		, nn_float lr, nn_float grad_scale, nn_float decay)
+	{
+		nn_float *nn_restrict v = s(0, offset);
+		nn_float mu = m_momentum;
+		for (nn_int i = 0; i < n; ++i)
+		{
+			nn_float gi = g[i] * grad_scale + decay * w[i];
+			nn_float vi = mu * v[i] - lr * gi;
+			v[i] = vi;
+			w[i] += vi;
+		}
+	}
+};
+
+/*
+	nesterov momentum, the look ahead form that only needs the current gradient
+	v_new = mu * v - lr * g
+	w += -mu * v + (1 + mu) * v_new
+*/
+class nesterov_optimizer : public optimizer
+{
+private:
+	nn_float m_momentum;
+
+public:
+	nesterov_optimizer(nn_float momentum = 0.9f, nn_float weight_decay = 0) : optimizer(1, weight_decay), m_momentum(momentum)
+	{
+	}
+
+protected:
+	virtual void apply(nn_float *nn_restrict w, const nn_float *nn_restrict g, nn_int offset, nn_int n
+		, nn_float lr, nn_float grad_scale, nn_float decay)
+	{
+		nn_float *nn_restrict v = s(0, offset);
+		nn_float mu = m_momentum;
+		for (nn_int i = 0; i < n; ++i)
+		{
+			nn_float gi = g[i] * grad_scale + decay * w[i];
+			nn_float vi = mu * v[i] - lr * gi;
+			w[i] += (1 + mu) * vi - mu * v[i];
+			v[i] = vi;
+		}
+	}
+};
+
+/*
+	r = rho * r + (1 - rho) * g^2
+	w -= lr * g / (sqrt(r) + eps)
+*/
+class rmsprop_optimizer : public optimizer
+{
+private:
+	nn_float m_rho;
+	nn_float m_epsilon;
+
+public:
+	rmsprop_optimizer(nn_float rho = 0.9f, nn_float epsilon = 1e-7f, nn_float weight_decay = 0)
+		: optimizer(1, weight_decay), m_rho(rho), m_epsilon(epsilon)
+	{
+	}
+
+protected:
+	virtual void apply(nn_float *nn_restrict w, const nn_float *nn_restrict g, nn_int offset, nn_int n
+		, nn_float lr, nn_float grad_scale, nn_float decay)
+	{
+		nn_float *nn_restrict r = s(0, offset);
+		nn_float rho = m_rho;
+		nn_align(nn_align_size) nn_float grad[chunk_size];
+		nn_align(nn_align_size) nn_float denom[chunk_size];
+		for (nn_int c = 0; c < n; c += chunk_size)
+		{
+			nn_int len = n - c < chunk_size ? n - c : chunk_size;
+			for (nn_int i = 0; i < len; ++i)
+			{
+				nn_float gi = g[c + i] * grad_scale + decay * w[c + i];
+				nn_float ri = rho * r[c + i] + (1 - rho) * gi * gi;
+				r[c + i] = ri;
+				grad[i] = gi;
+				denom[i] = ri;
+			}
+			sqrt_add(denom, len, m_epsilon);
+			for (nn_int i = 0; i < len; ++i)
+			{
+				w[c + i] -= lr * grad[i] / denom[i];
+			}
+		}
+	}
+};
+
+/*
+	m = beta1 * m + (1 - beta1) * g
+	v = beta2 * v + (1 - beta2) * g^2
+	w -= lr * sqrt(1 - beta2^t) / (1 - beta1^t) * m / (sqrt(v) + eps)
+*/
+class adam_optimizer : public optimizer
+{
+private:
+	nn_float m_beta1;
+	nn_float m_beta2;
+	nn_float m_epsilon;
+	nn_float m_correction;  // bias correction of the current step
+
+public:
+	adam_optimizer(nn_float beta1 = 0.9f, nn_float beta2 = 0.999f, nn_float epsilon = 1e-8f, nn_float weight_decay = 0)
+		: optimizer(2, weight_decay), m_beta1(beta1), m_beta2(beta2), m_epsilon(epsilon), m_correction(1)
+	{
+	}
+
+	virtual void begin_step()
+	{
+		optimizer::begin_step();
+		m_correction = (nn_float)(std::sqrt(1 - std::pow((double)m_beta2, m_step)) / (1 - std::pow((double)m_beta1, m_step)));
+	}
+
+protected:
+	virtual void apply(nn_float *nn_restrict w, const nn_float *nn_restrict g, nn_int offset, nn_int n
+		, nn_float lr, nn_float grad_scale, nn_float decay)
+	{
+		nn_float *nn_restrict m = s(0, offset);
+		nn_float *nn_restrict v = s(1, offset);
+		nn_float b1 = m_beta1;
+		nn_float b2 = m_beta2;
+		nn_float step = lr * m_correction;
+		nn_align(nn_align_size) nn_float denom[chunk_size];
+		for (nn_int c = 0; c < n; c += chunk_size)
+		{
+			nn_int len = n - c < chunk_size ? n - c : chunk_size;
+			for (nn_int i = 0; i < len; ++i)
+			{
+				nn_float gi = g[c + i] * grad_scale + decay * w[c + i];
+				nn_float mi = b1 * m[c + i] + (1 - b1) * gi;
+				nn_float vi = b2 * v[c + i] + (1 - b2) * gi * gi;
+				m[c + i] = mi;
+				v[c + i] = vi;
+				denom[i] = vi;
+			}
+			sqrt_add(denom, len, m_epsilon);
+			for (nn_int i = 0; i < len; ++i)
+			{
+				w[c + i] -= step * m[c + i] / denom[i];
+			}
+		}
+	}
+};
+
+/*
+	lars: momentum sgd, the learning rate of every weight vector is scaled by
+	trust = eta * |w| / (|g| + decay * |w|)
+*/
+class lars_optimizer : public optimizer
+{
+private:
+	nn_float m_momentum;
+	nn_float m_eta;  // trust coefficient
+
+public:
+	lars_optimizer(nn_float momentum = 0.9f, nn_float eta = 0.001f, nn_float weight_decay = 0)
+		: optimizer(1, weight_decay), m_momentum(momentum), m_eta(eta)
+	{
+	}
+
+	virtual bool layer_wise() const
+	{
+		return true;
+	}
+
+protected:
+	virtual void measure_slice(const nn_float *nn_restrict w, const nn_float *nn_restrict g, nn_int offset, nn_int n
+		, nn_float grad_scale, nn_float decay, double *sums)
+	{
+		double w_sqr = 0;
+		double g_sqr = 0;
+		for (nn_int i = 0; i < n; ++i)
+		{
+			nn_float gi = g[i] * grad_scale;
+			w_sqr += w[i] * w[i];
+			g_sqr += gi * gi;
+		}
+		sums[0] += w_sqr;
+		sums[1] += g_sqr;
+	}
+
+	virtual nn_float trust_ratio(double w_norm, double g_norm) const
+	{
+		double denom = g_norm + m_weight_decay * w_norm;
+		return (w_norm > 0 && denom > 0) ? (nn_float)(m_eta * w_norm / denom) : 1;
+	}
+
+	virtual void apply(nn_float *nn_restrict w, const nn_float *nn_restrict g, nn_int offset, nn_int n
+		, nn_float lr, nn_float grad_scale, nn_float decay)
+	{
+		nn_float *nn_restrict v = s(0, offset);
+		nn_float mu = m_momentum;
+		for (nn_int i = 0; i < n; ++i)
+		{
+			nn_float gi = g[i] * grad_scale + decay * w[i];
+			nn_float vi = mu * v[i] - lr * gi;
+			v[i] = vi;
+			w[i] += vi;
+		}
+	}
+};
+
+/*
+	lamb: adam direction plus decoupled weight decay, scaled per weight vector
+	r = m_hat / (sqrt(v_hat) + eps) + decay * w
+	w -= lr * |w| / |r| * r
+	the moments are updated in the measure pass, the update pass only reads them
+*/
+class lamb_optimizer : public optimizer
+{
+private:
+	nn_float m_beta1;
+	nn_float m_beta2;
+	nn_float m_epsilon;
+	nn_float m_correction1;  // 1 / (1 - beta1^t)
+	nn_float m_correction2;  // 1 / (1 - beta2^t)
+
+public:
+	lamb_optimizer(nn_float beta1 = 0.9f, nn_float beta2 = 0.999f, nn_float epsilon = 1e-6f, nn_float weight_decay = 0)
+		: optimizer(2, weight_decay), m_beta1(beta1), m_beta2(beta2), m_epsilon(epsilon), m_correction1(1), m_correction2(1)
+	{
+	}
+
+	virtual bool layer_wise() const
+	{
+		return true;
+	}
+
+	virtual void begin_step()
+	{
+		optimizer::begin_step();
+		m_correction1 = (nn_float)(1 / (1 - std::pow((double)m_beta1, m_step)));
+		m_correction2 = (nn_float)(1 / (1 - std::pow((double)m_beta2, m_step)));
+	}
+
+protected:
+	virtual void measure_slice(const nn_float *nn_restrict w, const nn_float *nn_restrict g, nn_int offset, nn_int n
+		, nn_float grad_scale, nn_float decay, double *sums)
+	{
+		nn_float *nn_restrict m = s(0, offset);
+		nn_float *nn_restrict v = s(1, offset);
+		nn_float b1 = m_beta1;
+		nn_float b2 = m_beta2;
+		nn_align(nn_align_size) nn_float denom[chunk_size];
+		double w_sqr = 0;
+		double r_sqr = 0;
+		for (nn_int c = 0; c < n; c += chunk_size)
+		{
+			nn_int len = n - c < chunk_size ? n - c : chunk_size;
+			for (nn_int i = 0; i < len; ++i)
+			{
+				nn_float gi = g[c + i] * grad_scale;
+				nn_float mi = b1 * m[c + i] + (1 - b1) * gi;
+				nn_float vi = b2 * v[c + i] + (1 - b2) * gi * gi;
+				m[c + i] = mi;
+				v[c + i] = vi;
+				denom[i] = vi * m_correction2;
+			}
+			sqrt_add(denom, len, m_epsilon);
+			for (nn_int i = 0; i < len; ++i)
+			{
+				nn_float ri = m[c + i] * m_correction1 / denom[i] + decay * w[c + i];
+				w_sqr += w[c + i] * w[c + i];
+				r_sqr += ri * ri;
+			}
+		}
+		sums[0] += w_sqr;
+		sums[1] += r_sqr;
+	}
+
+	virtual nn_float trust_ratio(double w_norm, double r_norm) const
+	{
+		return (w_norm > 0 && r_norm > 0) ? (nn_float)(w_norm / r_norm) : 1;
+	}
+
+	virtual void apply(nn_float *nn_restrict w, const nn_float *nn_restrict g, nn_int offset, nn_int n
+		, nn_float lr, nn_float grad_scale, nn_float decay)
+	{
+		const nn_float *nn_restrict m = s(0, offset);
+		const nn_float *nn_restrict v = s(1, offset);
+		nn_align(nn_align_size) nn_float denom[chunk_size];
+		for (nn_int c = 0; c < n; c += chunk_size)
+		{
+			nn_int len = n - c < chunk_size ? n - c : chunk_size;
+			for (nn_int i = 0; i < len; ++i)
+			{
+				denom[i] = v[c + i] * m_correction2;
+			}
+			sqrt_add(denom, len, m_epsilon);
+			for (nn_int i = 0; i < len; ++i)
+			{
+				w[c + i] -= lr * (m[c + i] * m_correction1 / denom[i] + decay * w[c + i]);
+			}
+		}
+	}
+};
+
+/*
+	learning rate over the course of one SGD run, evaluated before every minibatch.
+	this base class is a linear warmup from 0 to the base rate, then constant.
+	subclasses shape the rate after the warmup in decay().
+*/
+class lr_schedule
+{
+protected:
+	nn_float m_warmup_epochs;
+
+public:
+	lr_schedule(nn_float warmup_epochs = 0) : m_warmup_epochs(warmup_epochs)
+	{
+	}
+
+	virtual ~lr_schedule()
+	{
+	}
+
+	// step: minibatches trained so far in the run, total_steps: minibatches of all epochs
+	nn_float rate(nn_float base_lr, nn_int step, nn_int steps_per_epoch, nn_int total_steps) const
+	{
+		nn_int warmup_steps = (nn_int)(m_warmup_epochs * steps_per_epoch);
+		if (step < warmup_steps)
+		{
+			return base_lr * (step + 1) / warmup_steps;
+		}
+		return decay(base_lr, step, steps_per_epoch, warmup_steps, total_steps);
+	}
+
+protected:
+	virtual nn_float decay(nn_float base_lr, nn_int step, nn_int steps_per_epoch, nn_int warmup_steps, nn_int total_steps) const
+	{
+		return base_lr;
+	}
+};
+
+// base_lr * gamma ^ (epochs done / step_epochs)
+class step_lr_schedule : public lr_schedule
+{
+private:
+	nn_int m_step_epochs;
+	nn_float m_gamma;
+
+public:
+	step_lr_schedule(nn_int step_epochs, nn_float gamma = 0.1f, nn_float warmup_epochs = 0)
+		: lr_schedule(warmup_epochs), m_step_epochs(step_epochs), m_gamma(gamma)
+	{
+		nn_assert(step_epochs > 0);
+	}
+
+protected:
+	virtual nn_float decay(nn_float base_lr, nn_int step, nn_int steps_per_epoch, nn_int warmup_steps, nn_int total_steps) const
+	{
+		nn_int drops = step / (m_step_epochs * steps_per_epoch);
+		return base_lr * (nn_float)std::pow((double)m_gamma, drops);
+	}
+};
+
+// half a cosine from base_lr down to base_lr * min_ratio over the steps after the warmup
+class cosine_lr_schedule : public lr_schedule
+{
+private:
+	nn_float m_min_ratio;
+
+public:
+	cosine_lr_schedule(nn_float min_ratio = 0, nn_float warmup_epochs = 0)
+		: lr_schedule(warmup_epochs), m_min_ratio(min_ratio)
+	{
+	}
+
+protected:
+	virtual nn_float decay(nn_float base_lr, nn_int step, nn_int steps_per_epoch, nn_int warmup_steps, nn_int total_steps) const
+	{
+		nn_int span = std::max(1, total_steps - warmup_steps);
+		double t = std::min(1.0, (double)(step - warmup_steps) / span);
+		double ratio = m_min_ratio + (1 - m_min_ratio) * 0.5 * (1 + std::cos(cPI * t));
+		return (nn_float)(base_lr * ratio);
+	}
+};
+
+}
+
+#endif //__OPTIMIZER_H__
@@ -23,46 +23,25 @@ public:
 		m_lossfunc_type = lf_type;
 	}
 
+	virtual void describe(layer_desc &desc) const
+	{
+		desc.m_type = layer_type::eOutputLayer;
+		desc.m_args[0] = m_neural_count;
+		desc.m_args[1] = m_activation_type;
+		desc.m_args[2] = m_lossfunc_type;
+	}
+
 	void backward(const varray &label, nn_int task_idx)
 	{
 		calc_delta(label, task_idx);
+		backward_delta(task_idx);
+	}
 
-		layer_base::task_storage &ts = m_task_storage[task_idx];
-		const varray &input = m_prev->get_output(task_idx);
-		nn_int out_sz = get_output(task_idx).size();
-		nn_int in_sz = input.size();
-
-		nn_assert(m_w.check_dim(2));
-		nn_assert(in_sz == m_w.width());
-		nn_assert(out_sz == m_w.height());
-
-		/*
-			dw = db * input
-		*/
-		for (nn_int i = 0; i < out_sz; ++i)
-		{
-			ts.m_db(i) += ts.m_delta(i);
-			for (nn_int j = 0; j < in_sz; ++j)
-			{
-				ts.m_dw(j, i) += ts.m_delta(i) * input[j];
-			}
-		}
-
-		/*
-			m_w : out_sz X in_sz
-		*/
-		for (nn_int i = 0; i < in_sz; ++i)
-		{
-			nn_float dot = 0;
-			for (nn_int j = 0; j < out_sz; ++j)
-			{
-				dot += m_w(i, j) * ts.m_delta(j);
-			}
-			ts.m_wd[i] = dot;
-		}
-
-		m_prev->back_prop(ts.m_wd, task_idx);
-
+	// label as class index, same result as the one-hot label
+	void backward(nn_int label, nn_int task_idx)
+	{
+		calc_delta(label, task_idx);
+		backward_delta(task_idx);
 	}
 
 	nn_float calc_cost(bool check_gradient, const varray &label, nn_int task_idx) const
@@ -110,19 +89,105 @@ public:
 		return cost;
 	}
 
+	nn_float calc_cost(bool check_gradient, nn_int label, nn_int task_idx) const
+	{
+		const varray &output = get_output(task_idx);
+
+		nn_int out_sz = output.size();
+		nn_assert(label >= 0 && label < out_sz);
+
+		nn_float e = check_gradient ? 0 : cEpsilon;
+		nn_float cost = 0;
+		switch (m_lossfunc_type)
+		{
+		case lossfunc_type::eMSE:
+			{
+				for (nn_int i = 0; i < out_sz; ++i)
+				{
+					nn_float s = i == label ? output(i) - cOne : output(i);
+					cost += s * s;
+				}
+				cost *= (nn_float)(0.5);
+			}
+			break;
+		case lossfunc_type::eSigmod_CrossEntropy:
+			{
+				for (nn_int i = 0; i < out_sz; ++i)
+				{
+					nn_float q = output(i);
+					cost += i == label ? -log(q + e) : -log((nn_float)(1.0) - q + e);
+				}
+			}
+			break;
+		case lossfunc_type::eSoftMax_LogLikelihood:
+			{
+				cost = -log(output(label) + e);
+			}
+			break;
+		default:
+			nn_assert(false);
+			break;
+		}
+		return cost;
+	}
+
 private:
+	void backward_delta(nn_int task_idx)
+	{
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+		const varray &input = m_prev->get_output(task_idx);
+		nn_int out_sz = get_output(task_idx).size();
+		nn_int in_sz = input.size();
+
+		nn_assert(m_w.check_dim(2));
+		nn_assert(in_sz == m_w.width());
+		nn_assert(out_sz == m_w.height());
+
+		accumulate_gradient(input, task_idx);
+		if (!m_need_input_gradient)
+		{
+			return;
+		}
+
+		/*
+			m_w : out_sz X in_sz
+		*/
+		for (nn_int i = 0; i < in_sz; ++i)
+		{
+			nn_float dot = 0;
+			for (nn_int j = 0; j < out_sz; ++j)
+			{
+				dot += m_w(i, j) * ts.m_delta(j);
+			}
+			ts.m_wd[i] = dot;
+		}
+	}
+
+	// delta := df(z), a relu layer keeps no z but x > 0 exactly where z > 0
+	void activation_deriv(layer_base::task_storage &ts) const
+	{
+		if (m_activation_type == activation_type::eRelu)
+		{
+			deriv_relu(ts.m_x, ts.m_delta);
+		}
+		else
+		{
+			m_df(ts.m_z, ts.m_delta);
+		}
+	}
+
 	const varray& calc_delta(const varray &label, nn_int task_idx)
 	{
 		layer_base::task_storage &ts = m_task_storage[task_idx];
 
 		nn_int out_sz = label.size();
-		nn_assert(out_sz == ts.m_z.size());
+		nn_assert(out_sz == ts.m_x.size());
 
 		switch (m_lossfunc_type)
 		{
 		case lossfunc_type::eMSE:
 			{
-				m_df(ts.m_z, ts.m_delta);
+				activation_deriv(ts);
 				for (nn_int i = 0; i < out_sz; ++i)
 				{
 					ts.m_delta(i) *= ts.m_x(i) - label(i); // ʧֵƫ
@@ -161,6 +226,42 @@ private:
 		return ts.m_delta;
 	}
 
+	/*
+		same as calc_delta with the one-hot label, without materializing it:
+		for softmax + log-likelihood delta = output, then delta(label) -= 1
+	*/
+	const varray& calc_delta(nn_int label, nn_int task_idx)
+	{
+		layer_base::task_storage &ts = m_task_storage[task_idx];
+
+		nn_int out_sz = ts.m_x.size();
+		nn_assert(label >= 0 && label < out_sz);
+
+		switch (m_lossfunc_type)
+		{
+		case lossfunc_type::eMSE:
+			{
+				activation_deriv(ts);
+				for (nn_int i = 0; i < out_sz; ++i)
+				{
+					ts.m_delta(i) *= i == label ? ts.m_x(i) - cOne : ts.m_x(i);
+				}
+			}
+			break;
+		case lossfunc_type::eSigmod_CrossEntropy:
+		case lossfunc_type::eSoftMax_LogLikelihood:
+			{
+				ts.m_delta.copy(ts.m_x);
+				ts.m_delta(label) -= cOne;
+			}
+			break;
+		default:
+			nn_assert(false);
+			break;
+		}
+		return ts.m_delta;
+	}
+
 };
 }
 
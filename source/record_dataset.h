@@ -0,0 +1,288 @@
+#ifndef __RECORD_DATASET_H__
+#define __RECORD_DATASET_H__
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <random>
+#include <algorithm>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+namespace mini_cnn
+{
+
+/*
+	a directory of shard files streamed front to back, for sets larger than memory
+
+	every shard is a plain sequence of fixed size records:
+		1 label byte, w * h * d pixel bytes (channel planes, row major)
+	which is also the CIFAR-10 binary layout. the shape is given by the caller.
+
+	a shuffled pass visits the shards in random order and draws records from a
+	shuffle buffer of buffer_size records that is refilled from the stream, so
+	only the buffer and one read chunk per pass are ever held in memory.
+*/
+class record_dataset : public dataset_source
+{
+protected:
+	nn_int m_width;
+	nn_int m_height;
+	nn_int m_depth;
+	nn_int m_class_count;
+	nn_int m_buffer_size;
+	size_t m_record_size;
+	nn_int m_count;
+	std::vector<std::string> m_files;
+
+	// state of the current pass
+	std::mt19937_64 m_rng;
+	bool m_shuffle;
+	index_vec m_shard_order;
+	nn_int m_next_shard;
+	std::ifstream m_stream;
+	std::vector<char> m_stream_buffer;
+	std::vector<unsigned char> m_buffer;   // shuffle buffer, m_buffered records
+	nn_int m_buffered;
+	std::vector<unsigned char> m_current;  // record handed out by read_next
+
+public:
+	record_dataset(nn_int width, nn_int height, nn_int depth, nn_int class_count, nn_int buffer_size = 4096)
+		: m_width(width), m_height(height), m_depth(depth), m_class_count(class_count), m_buffer_size(std::max(1, buffer_size))
+		, m_record_size((size_t)width * height * depth + 1), m_count(0), m_shuffle(false), m_next_shard(0)
+		, m_stream_buffer(1 << 20), m_buffered(0)
+	{
+		m_current.resize(m_record_size);
+	}
+
+	// every file with the given extension in dir, in name order
+	bool open_dir(const std::string &dir, const std::string &ext = ".bin")
+	{
+		std::vector<std::string> files = list_files(dir, ext);
+		if (files.empty())
+		{
+			std::cerr << "No shard found!" << dir << std::endl;
+			return false;
+		}
+		return open(files);
+	}
+
+	bool open(const std::vector<std::string> &files)
+	{
+		m_files.clear();
+		m_count = 0;
+		for (auto &file_path : files)
+		{
+			std::ifstream fs(file_path, std::ios::in | std::ios::binary | std::ios::ate);
+			if (!fs)
+			{
+				std::cerr << "Open failed!" << file_path << std::endl;
+				return false;
+			}
+			size_t size = (size_t)fs.tellg();
+			if (size % m_record_size != 0)
+			{
+				std::cerr << "Invalid shard size!" << file_path << std::endl;
+				return false;
+			}
+			if (!check_labels(fs, size / m_record_size, file_path))
+			{
+				return false;
+			}
+			m_count += (nn_int)(size / m_record_size);
+		}
+		m_files = files;
+		return true;
+	}
+
+	virtual nn_int count() const
+	{
+		return m_count;
+	}
+
+	virtual nn_int width() const
+	{
+		return m_width;
+	}
+
+	virtual nn_int height() const
+	{
+		return m_height;
+	}
+
+	virtual nn_int depth() const
+	{
+		return m_depth;
+	}
+
+	virtual nn_int class_count() const
+	{
+		return m_class_count;
+	}
+
+	virtual bool is_random_access() const
+	{
+		return false;
+	}
+
+	virtual void begin_pass(unsigned long long seed, bool shuffle)
+	{
+		m_rng.seed(seed);
+		m_shuffle = shuffle;
+		m_shard_order.resize(m_files.size());
+		for (nn_int i = 0; i < (nn_int)m_files.size(); ++i)
+		{
+			m_shard_order[i] = i;
+		}
+		if (shuffle)
+		{
+			std::shuffle(m_shard_order.begin(), m_shard_order.end(), m_rng);
+		}
+		m_next_shard = 0;
+		m_stream.close();
+		m_stream.clear();
+
+		m_buffered = 0;
+		if (shuffle)
+		{
+			m_buffer.resize(m_buffer_size * m_record_size);
+			while (m_buffered < m_buffer_size && read_record(&m_buffer[m_buffered * m_record_size]))
+			{
+				++m_buffered;
+			}
+		}
+	}
+
+	virtual const unsigned char* read_next(nn_int &label)
+	{
+		if (!m_shuffle)
+		{
+			if (!read_record(&m_current[0]))
+			{
+				return nullptr;
+			}
+		}
+		else
+		{
+			if (m_buffered == 0)
+			{
+				return nullptr;
+			}
+			// hand out a random buffered record, its place is taken by the next one of the stream
+			nn_int k = std::uniform_int_distribution<nn_int>(0, m_buffered - 1)(m_rng);
+			unsigned char *rec = &m_buffer[k * m_record_size];
+			::memcpy(&m_current[0], rec, m_record_size);
+			if (!read_record(rec))
+			{
+				--m_buffered;
+				::memcpy(rec, &m_buffer[m_buffered * m_record_size], m_record_size);
+			}
+		}
+		label = m_current[0];
+		nn_assert(label < m_class_count);
+		return &m_current[1];
+	}
+
+private:
+	// one sequential pass over the shard, a label past the class count would index past the output
+	bool check_labels(std::ifstream &fs, size_t record_count, const std::string &file_path)
+	{
+		if (m_class_count > 255)
+		{
+			return true;
+		}
+		fs.seekg(0);
+		size_t chunk_records = std::max((size_t)1, m_stream_buffer.size() / m_record_size);
+		std::vector<char> chunk(chunk_records * m_record_size);
+		for (size_t r = 0; r < record_count; r += chunk_records)
+		{
+			size_t n = std::min(chunk_records, record_count - r);
+			if (!fs.read(&chunk[0], n * m_record_size))
+			{
+				std::cerr << "Read failed!" << file_path << std::endl;
+				return false;
+			}
+			for (size_t k = 0; k < n; ++k)
+			{
+				if ((unsigned char)chunk[k * m_record_size] >= m_class_count)
+				{
+					std::cerr << "Invalid label!" << file_path << std::endl;
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	bool read_record(unsigned char *dst)
+	{
+		while (true)
+		{
+			if (m_stream.is_open() && m_stream.read((char*)dst, m_record_size))
+			{
+				return true;
+			}
+			if (m_next_shard >= (nn_int)m_shard_order.size())
+			{
+				return false;
+			}
+			m_stream.close();
+			m_stream.clear();
+			// large stream buffer, shards are read strictly sequentially
+			m_stream.rdbuf()->pubsetbuf(&m_stream_buffer[0], m_stream_buffer.size());
+			m_stream.open(m_files[m_shard_order[m_next_shard++]], std::ios::in | std::ios::binary);
+		}
+	}
+
+	static std::vector<std::string> list_files(const std::string &dir, const std::string &ext)
+	{
+		std::vector<std::string> files;
+		std::string prefix = dir;
+		if (!prefix.empty() && prefix.back() != '/' && prefix.back() != '\\')
+		{
+			prefix += '/';
+		}
+#if defined(_WIN32)
+		WIN32_FIND_DATAA fd;
+		HANDLE h = ::FindFirstFileA((prefix + "*" + ext).c_str(), &fd);
+		if (h != INVALID_HANDLE_VALUE)
+		{
+			do
+			{
+				if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+				{
+					files.push_back(prefix + fd.cFileName);
+				}
+			} while (::FindNextFileA(h, &fd));
+			::FindClose(h);
+		}
+#else
+		DIR *d = ::opendir(dir.c_str());
+		if (d != nullptr)
+		{
+			while (dirent *entry = ::readdir(d))
+			{
+				std::string name = entry->d_name;
+				if (name.size() > ext.size() && name.compare(name.size() - ext.size(), ext.size(), ext) == 0)
+				{
+					files.push_back(prefix + name);
+				}
+			}
+			::closedir(d);
+		}
+#endif
+		std::sort(files.begin(), files.end());
+		return files;
+	}
+};
+
+}
+
+#endif //__RECORD_DATASET_H__
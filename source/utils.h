@@ -4,6 +4,7 @@
 #include <cassert>
 #include <random>
 #include <chrono>
+#include <algorithm>
 
 namespace mini_cnn
 {
@@ -150,6 +151,105 @@ inline void deriv_relu(const varray &v, varray &retv)
 	}
 }
 
+/*
+	relu in place on x, bit j of mask[k] is set when x[32 * k + j] > 0.
+	the mask replaces z for the backward pass, 1 bit instead of a float per
+	value. mask is empty at inference, then only x is rectified.
+	whole words run a fixed 32 iteration loop the compiler turns into
+	compare / blend vector code.
+*/
+inline nn_uint relu_mask_word(nn_float * nn_restrict p, nn_int n)
+{
+	nn_uint bits = 0;
+	for (nn_int j = 0; j < n; ++j)
+	{
+		bits |= (p[j] > 0 ? 1u : 0u) << j;
+		p[j] = p[j] > 0 ? p[j] : 0;
+	}
+	return bits;
+}
+
+inline void relu_mask(varray &x, _varray<nn_uint> &mask)
+{
+	nn_int len = x.size();
+	nn_float * nn_restrict v = &x[0];
+	if (mask.size() == 0)
+	{
+		for (nn_int i = 0; i < len; ++i)
+		{
+			v[i] = v[i] > 0 ? v[i] : 0;
+		}
+		return;
+	}
+	nn_assert(mask.size() == (len + 31) / 32);
+
+	nn_uint * nn_restrict m = &mask[0];
+	nn_int words = len / 32;
+	for (nn_int k = 0; k < words; ++k)
+	{
+		m[k] = relu_mask_word(v + k * 32, 32);
+	}
+	if (len % 32 != 0)
+	{
+		m[words] = relu_mask_word(v + words * 32, len % 32);
+	}
+}
+
+// dst[j] := src[j] * bit j of bits, the same product as df(z) * next_wd
+inline void deriv_relu_mask_word(nn_uint bits, const nn_float * nn_restrict src, nn_float * nn_restrict dst, nn_int n)
+{
+	for (nn_int j = 0; j < n; ++j)
+	{
+		dst[j] = src[j] * (nn_float)((bits >> j) & 1);
+	}
+}
+
+// delta := next_wd where the bit of mask is set, else 0
+inline void deriv_relu_mask(const _varray<nn_uint> &mask, const varray &next_wd, varray &delta)
+{
+	nn_int len = delta.size();
+	nn_assert(len == next_wd.size());
+	nn_assert(mask.size() == (len + 31) / 32);
+
+	const nn_uint * nn_restrict m = &mask[0];
+	const nn_float * nn_restrict src = &next_wd[0];
+	nn_float * nn_restrict dst = &delta[0];
+	nn_int words = len / 32;
+	for (nn_int k = 0; k < words; ++k)
+	{
+		deriv_relu_mask_word(m[k], src + k * 32, dst + k * 32, 32);
+	}
+	if (len % 32 != 0)
+	{
+		deriv_relu_mask_word(m[words], src + words * 32, dst + words * 32, len % 32);
+	}
+}
+
+inline void identity(const varray &v, varray &retv)
+{
+	nn_int len = v.size();
+	nn_assert(len == retv.size());
+
+	const nn_float * nn_restrict src = &v[0];
+	nn_float * nn_restrict dst = &retv[0];
+	for (nn_int i = 0; i < len; ++i)
+	{
+		dst[i] = src[i];
+	}
+}
+
+inline void deriv_identity(const varray &v, varray &retv)
+{
+	nn_int len = v.size();
+	nn_assert(len == retv.size());
+
+	nn_float * nn_restrict dst = &retv[0];
+	for (nn_int i = 0; i < len; ++i)
+	{
+		dst[i] = cOne;
+	}
+}
+
 inline void softmax(const varray &v, varray &retv)
 {
 	nn_int len = v.size();
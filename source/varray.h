@@ -50,8 +50,14 @@ namespace mini_cnn
 	************* --------
 */
 
+/*
+	the element buffer is aligned to nn_align_size, the object itself is not:
+	varrays live in std::vector and in new'ed layers, which c++11 does not
+	allocate over-aligned, and an over-aligned type there lets the compiler
+	emit aligned simd stores on misaligned memory
+*/
 template<class T>
-class nn_align(nn_align_size) _varray
+class _varray
 {
 public:
 	_varray();
@@ -61,10 +67,14 @@ public:
 	_varray(nn_int w);
 	~_varray();
 	_varray(const _varray<T>&);
+	_varray(_varray<T>&&) noexcept;
 	_varray<T>& operator=(const _varray<T>&);
 
 	void copy(const _varray<T>&);
 
+	// view external memory (e.g. a memory_arena block), the data is not owned
+	void attach(T *data, nn_int w, nn_int h, nn_int d, nn_int n);
+
 	void reshape(nn_int w, nn_int h, nn_int d, nn_int n);
 	void reshape(nn_int w, nn_int h, nn_int d);
 	void reshape(nn_int w, nn_int h);
@@ -111,6 +121,7 @@ private:
 	nn_int m_d;  // depth or channel
 	nn_int m_n;  // count
 	T* m_data;
+	bool m_owner; // false when attached to external memory
 };
 
 template <class T>
@@ -122,6 +133,7 @@ inline void _varray<T>::_create(nn_int w, nn_int h, nn_int d, nn_int n)
 	m_d = d;
 	m_n = n;
 	m_data = (T*)align_malloc(w * h * d * n * sizeof(T), nn_align_size);
+	m_owner = true;
 	this->make_zero();
 }
 
@@ -132,15 +144,16 @@ inline void _varray<T>::_release()
 	m_h = 0;
 	m_d = 0;
 	m_n = 0;
-	if (m_data != nullptr)
+	if (m_data != nullptr && m_owner)
 	{
 		align_free(m_data);
-		m_data = nullptr;
 	}
+	m_data = nullptr;
+	m_owner = true;
 }
 
 template <class T>
-inline _varray<T>::_varray() : m_w(0), m_h(0), m_d(0), m_n(0)
+inline _varray<T>::_varray() : m_w(0), m_h(0), m_d(0), m_n(0), m_owner(true)
 {
 	m_data = nullptr;
 }
@@ -180,9 +193,22 @@ inline _varray<T>::_varray(const _varray<T> &other) : m_w(other.m_w), m_h(other.
 {
 	nn_int len = other.m_w * other.m_h * other.m_d * other.m_n;
 	m_data = (T*)align_malloc(len * sizeof(T), nn_align_size);
+	m_owner = true;
 	::memcpy(m_data, other.m_data, len * sizeof(T));
 }
 
+template <class T>
+inline _varray<T>::_varray(_varray<T> &&other) noexcept : m_w(other.m_w), m_h(other.m_h), m_d(other.m_d), m_n(other.m_n)
+	, m_data(other.m_data), m_owner(other.m_owner)
+{
+	other.m_w = 0;
+	other.m_h = 0;
+	other.m_d = 0;
+	other.m_n = 0;
+	other.m_data = nullptr;
+	other.m_owner = true;
+}
+
 template <class T>
 inline _varray<T>& _varray<T>::operator=(const _varray<T> &other)
 {
@@ -191,11 +217,7 @@ inline _varray<T>& _varray<T>::operator=(const _varray<T> &other)
 		return *this;
 	}
 
-	if (m_data != nullptr)
-	{
-		align_free(m_data);
-		m_data = nullptr;
-	}
+	_release();
 
 	m_w = other.m_w;
 	m_h = other.m_h;
@@ -203,6 +225,7 @@ inline _varray<T>& _varray<T>::operator=(const _varray<T> &other)
 	m_n = other.m_n;
 	nn_int len = m_w * m_h * m_d * m_n;
 	m_data = (T*)align_malloc(len * sizeof(T), nn_align_size);
+	m_owner = true;
 	::memcpy(m_data, other.m_data, len * sizeof(T));
 	return *this;
 }
@@ -215,6 +238,19 @@ inline void _varray<T>::copy(const _varray<T> &other)
 	::memcpy(m_data, other.m_data, len * sizeof(T));
 }
 
+template <class T>
+inline void _varray<T>::attach(T *data, nn_int w, nn_int h, nn_int d, nn_int n)
+{
+	nn_assert(w >= 0 && h >= 0 && d >= 0 && n >= 0);
+	_release();
+	m_w = w;
+	m_h = h;
+	m_d = d;
+	m_n = n;
+	m_data = data;
+	m_owner = false;
+}
+
 template <class T>
 inline void _varray<T>::reshape(nn_int w, nn_int h, nn_int d, nn_int n)
 {
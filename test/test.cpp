@@ -1,5 +1,7 @@
 #include <iostream>
 #include <iomanip>
+#include <fstream>
+#include <cstdio>
 
 #define GRADIENT_CHECKER
 #include "../source/mini_cnn.h"
@@ -17,11 +19,21 @@ private:
 	const nn_int cInput_d = 1;
 	const nn_int cInput_n = cInput_w * cInput_h * cInput_d;
 	const nn_int cOutput_n = 10;
+	const nn_int cBatch_n = 6;
+	const nn_int cTask_n = 3;
 
 public:
 #define TEST_GRADIENT(model)\
 	std::cout << std::setw(30) << std::setiosflags(std::ios::left) << #model << "\t" << std::boolalpha << test_nn_gradient_check(model(), input, label) << std::endl;
 
+	// label given as class index instead of one-hot
+#define TEST_GRADIENT_CLASS_INDEX(model)\
+	std::cout << std::setw(30) << std::setiosflags(std::ios::left) << #model "(index)" << "\t" << std::boolalpha << test_nn_gradient_check(model(), input, label->arg_max()) << std::endl;
+
+	// a minibatch over several tasks, batch statistics tie its samples together
+#define TEST_GRADIENT_BATCH(model)\
+	std::cout << std::setw(30) << std::setiosflags(std::ios::left) << #model "(batch)" << "\t" << std::boolalpha << test_nn_gradient_check(model(), batch_input, batch_label) << std::endl;
+
 	gradient_checker()
 	{
 		uniform_random uRand(0, 1.0);
@@ -34,6 +46,18 @@ public:
 		}
 		(*label)[3] = 1.0;
 
+		varray_vec batch_input(cBatch_n);
+		index_vec batch_label(cBatch_n);
+		for (nn_int k = 0; k < cBatch_n; ++k)
+		{
+			batch_input[k] = new varray(cInput_n);
+			for (nn_int i = 0; i < cInput_n; ++i)
+			{
+				(*batch_input[k])[i] = uRand.get_random();
+			}
+			batch_label[k] = (k * 7) % cOutput_n;
+		}
+
 		TEST_GRADIENT(create_fcn_sigmod_mse);
 
 		TEST_GRADIENT(create_fcn_sigmod_crossentropy);
@@ -70,9 +94,100 @@ public:
 
 		TEST_GRADIENT(create_cnn_relu_softmax_avg_pool);
 
+		TEST_GRADIENT(create_fcn_relu_dropout_checkpoint);
+
+		TEST_GRADIENT(create_cnn_relu_softmax_max_pool_checkpoint);
+
+		TEST_GRADIENT(create_fcn_relu_sharded_gradient);
+
+		TEST_GRADIENT(create_fcn_relu_dropout_sparse_backward);
+
+		TEST_GRADIENT(create_cnn_relu_softmax_max_pool_sparse_backward);
+
+		TEST_GRADIENT(create_cnn_stride_2x2_sparse_backward);
+
+		TEST_GRADIENT(create_fcn_relu_dropout_sparse_input);
+
+		TEST_GRADIENT(create_cnn_stride_2x2_sparse_input);
+
+		TEST_GRADIENT_BATCH(create_fcn_batch_norm);
+
+		TEST_GRADIENT_BATCH(create_cnn_batch_norm);
+
+		TEST_GRADIENT_BATCH(create_cnn_pool_batch_norm_first);
+
+		TEST_GRADIENT_BATCH(create_cnn_batch_norm_checkpoint);
+
+		TEST_GRADIENT_BATCH(create_fcn_dropout_batch_norm);
+
+		TEST_GRADIENT_BATCH(create_cnn_relu_softmax_max_pool_checkpoint);
+
+		TEST_GRADIENT(create_cnn_depthwise_separable);
+
+		TEST_GRADIENT(create_cnn_grouped_stride_2x2);
+
+		TEST_GRADIENT(create_cnn_pointwise);
+
+		TEST_GRADIENT(create_cnn_global_avg_pool);
+
+		TEST_GRADIENT_CLASS_INDEX(create_fcn_sigmod_mse);
+
+		TEST_GRADIENT_CLASS_INDEX(create_fcn_sigmod_crossentropy);
+
+		TEST_GRADIENT_CLASS_INDEX(create_cnn_relu_softmax);
+
+		std::cout << std::setw(30) << std::setiosflags(std::ios::left) << "idx_dataset_interleaved" << "\t" << std::boolalpha << test_idx_interleaved() << std::endl;
 	}
 
 private:
+	static void write_idx(const std::string &file_path, const index_vec &dims, const std::vector<unsigned char> &body)
+	{
+		std::ofstream ofs(file_path, std::ios::out | std::ios::binary);
+		unsigned char magic[4] = { 0, 0, 0x08, (unsigned char)dims.size() };
+		ofs.write((const char*)magic, 4);
+		for (nn_int d : dims)
+		{
+			unsigned char be[4] = { (unsigned char)(d >> 24), (unsigned char)(d >> 16), (unsigned char)(d >> 8), (unsigned char)d };
+			ofs.write((const char*)be, 4);
+		}
+		ofs.write((const char*)&body[0], body.size());
+	}
+
+	// a 2 channel set stores interleaved pixels, the dataset hands out channel planes
+	bool test_idx_interleaved()
+	{
+		const nn_int count = 2, rows = 2, cols = 3, depth = 2, plane = rows * cols;
+		std::vector<unsigned char> pixels(count * plane * depth);
+		for (nn_int i = 0; i < (nn_int)pixels.size(); ++i)
+		{
+			pixels[i] = (unsigned char)i;
+		}
+		write_idx("interleaved-images.idx4-ubyte", index_vec{ count, rows, cols, depth }, pixels);
+		write_idx("interleaved-labels.idx1-ubyte", index_vec{ count }, std::vector<unsigned char>{ 1, 0 });
+
+		bool ok;
+		{
+			idx_dataset set;
+			ok = set.open("interleaved-images.idx4-ubyte", "interleaved-labels.idx1-ubyte");
+			ok = ok && set.width() == cols && set.height() == rows && set.depth() == depth
+				&& set.label(0) == 1 && set.label(1) == 0;
+			for (nn_int i = 0; ok && i < count; ++i)
+			{
+				const unsigned char *img = set.pixels(i);
+				for (nn_int c = 0; c < depth; ++c)
+				{
+					for (nn_int p = 0; p < plane; ++p)
+					{
+						ok = ok && img[c * plane + p] == pixels[(i * plane + p) * depth + c];
+					}
+				}
+			}
+		}
+		std::remove("interleaved-images.idx4-ubyte");
+		std::remove("interleaved-labels.idx1-ubyte");
+		return ok;
+	}
+
 	bool test_nn_gradient_check(network &nn, varray *input, varray *label)
 	{
 		truncated_normal_initializer initializer(0, 0.1f, 2);
@@ -80,6 +195,20 @@ private:
 		return nn.gradient_check(*input, *label);
 	}
 
+	bool test_nn_gradient_check(network &nn, varray *input, nn_int label)
+	{
+		truncated_normal_initializer initializer(0, 0.1f, 2);
+		nn.init_all_weight(initializer);
+		return nn.gradient_check(*input, label);
+	}
+
+	bool test_nn_gradient_check(network &nn, const varray_vec &input, const index_vec &label)
+	{
+		truncated_normal_initializer initializer(0, 0.1f, 2);
+		nn.init_all_weight(initializer);
+		return nn.gradient_check(input, label, cTask_n);
+	}
+
 	network create_fcn_sigmod_mse()
 	{
 		network nn;
@@ -276,6 +405,175 @@ private:
 		return nn;
 	}
 
+	network create_fcn_relu_dropout_checkpoint()
+	{
+		network nn = create_fcn_relu_dropout();
+		nn.set_auto_checkpoints();
+		return nn;
+	}
+
+	network create_cnn_relu_softmax_max_pool_checkpoint()
+	{
+		network nn = create_cnn_relu_softmax_max_pool();
+		nn.set_auto_checkpoints();
+		return nn;
+	}
+
+	// density 1: every sample takes the sparse path
+	network create_fcn_relu_dropout_sparse_backward()
+	{
+		network nn = create_fcn_relu_dropout();
+		nn.set_sparse_backward(1);
+		return nn;
+	}
+
+	network create_cnn_relu_softmax_max_pool_sparse_backward()
+	{
+		network nn = create_cnn_relu_softmax_max_pool();
+		nn.set_sparse_backward(0.5f);
+		return nn;
+	}
+
+	network create_cnn_stride_2x2_sparse_backward()
+	{
+		network nn = create_cnn_stride_2x2_sigmod();
+		nn.set_sparse_backward(1);
+		return nn;
+	}
+
+	// density 1: every sample reaches the first layer as (index, value) pairs
+	network create_fcn_relu_dropout_sparse_input()
+	{
+		network nn = create_fcn_relu_dropout();
+		nn.set_sparse_input(1);
+		nn.set_sparse_backward(1);
+		return nn;
+	}
+
+	network create_cnn_stride_2x2_sparse_input()
+	{
+		network nn = create_cnn_stride_2x2_sigmod();
+		nn.set_sparse_input(1);
+		return nn;
+	}
+
+	network create_fcn_relu_sharded_gradient()
+	{
+		network nn;
+		nn.add_layer(new input_layer(cInput_n));
+		fully_connected_layer *fc = new fully_connected_layer(100, activation_type::eRelu);
+		fc->set_gradient_shards(3, 4);
+		nn.add_layer(fc);
+		nn.add_layer(new fully_connected_layer(30, activation_type::eRelu));
+		output_layer *out = new output_layer(cOutput_n, lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax);
+		out->set_gradient_shards(4, 1);
+		nn.add_layer(out);
+		return nn;
+	}
+
+	network create_fcn_batch_norm()
+	{
+		network nn;
+		nn.add_layer(new input_layer(cInput_n));
+		nn.add_layer(new fully_connected_layer(30, activation_type::eIdentity));
+		nn.add_layer(new batch_norm_layer(activation_type::eRelu));
+		nn.add_layer(new output_layer(cOutput_n, lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax));
+		return nn;
+	}
+
+	// the segment below the batch norm layer runs forward twice, dropout replays its mask
+	network create_fcn_dropout_batch_norm()
+	{
+		network nn;
+		nn.add_layer(new input_layer(cInput_n));
+		nn.add_layer(new fully_connected_layer(30, activation_type::eRelu));
+		nn.add_layer(new dropout_layer((nn_float)(0.5)));
+		nn.add_layer(new fully_connected_layer(20, activation_type::eIdentity));
+		nn.add_layer(new batch_norm_layer(activation_type::eRelu));
+		nn.add_layer(new output_layer(cOutput_n, lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax));
+		return nn;
+	}
+
+	network create_cnn_batch_norm()
+	{
+		network nn;
+		nn.add_layer(new input_layer(cInput_w, cInput_h, cInput_d));
+		nn.add_layer(new convolutional_layer(3, 3, 1, 4, 1, 1, padding_type::eValid, activation_type::eIdentity));
+		nn.add_layer(new batch_norm_layer(activation_type::eRelu));
+		nn.add_layer(new max_pooling_layer(2, 2, 2, 2));
+		nn.add_layer(new batch_norm_layer(activation_type::eSigmod));
+		nn.add_layer(new fully_connected_layer(12, activation_type::eRelu));
+		nn.add_layer(new output_layer(cOutput_n, lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax));
+		return nn;
+	}
+
+	// batch norm layers stay checkpoints, the segments in between are recomputed
+	network create_cnn_batch_norm_checkpoint()
+	{
+		network nn = create_cnn_batch_norm();
+		nn.set_checkpoints(index_vec(1, 3));
+		return nn;
+	}
+
+	// nothing below the batch norm layer learns, back_prop stops there and skips its wd
+	network create_cnn_pool_batch_norm_first()
+	{
+		network nn;
+		nn.add_layer(new input_layer(cInput_w, cInput_h, cInput_d));
+		nn.add_layer(new max_pooling_layer(2, 2, 2, 2));
+		nn.add_layer(new batch_norm_layer(activation_type::eIdentity));
+		nn.add_layer(new convolutional_layer(3, 3, 1, 4, 1, 1, padding_type::eValid, activation_type::eRelu));
+		nn.add_layer(new output_layer(cOutput_n, lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax));
+		return nn;
+	}
+
+	network create_cnn_depthwise_separable()
+	{
+		network nn;
+		nn.add_layer(new input_layer(cInput_w, cInput_h, cInput_d));
+		nn.add_layer(new convolutional_layer(3, 3, 1, 4, 1, 1, padding_type::eValid, activation_type::eRelu));
+		nn.add_layer(new depthwise_convolutional_layer(3, 3, 4, 1, 1, activation_type::eIdentity));
+		nn.add_layer(new grouped_convolutional_layer(1, 1, 4, 6, 2, 1, 1, activation_type::eRelu));
+		nn.add_layer(new max_pooling_layer(2, 2, 2, 2));
+		nn.add_layer(new output_layer(cOutput_n, lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax));
+		return nn;
+	}
+
+	network create_cnn_grouped_stride_2x2()
+	{
+		network nn;
+		nn.add_layer(new input_layer(cInput_w, cInput_h, cInput_d));
+		nn.add_layer(new convolutional_layer(3, 3, 1, 4, 1, 1, padding_type::eValid, activation_type::eSigmod));
+		nn.add_layer(new depthwise_convolutional_layer(2, 2, 4, 2, 2, activation_type::eSigmod));
+		nn.add_layer(new grouped_convolutional_layer(3, 3, 4, 6, 2, 2, 2, activation_type::eSigmod));
+		nn.add_layer(new fully_connected_layer(12, activation_type::eRelu));
+		nn.add_layer(new output_layer(cOutput_n, lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax));
+		return nn;
+	}
+
+	network create_cnn_pointwise()
+	{
+		network nn;
+		nn.add_layer(new input_layer(cInput_w, cInput_h, cInput_d));
+		nn.add_layer(new convolutional_layer(3, 3, 1, 4, 1, 1, padding_type::eValid, activation_type::eSigmod));
+		nn.add_layer(new convolutional_layer(1, 1, 4, 6, 1, 1, padding_type::eValid, activation_type::eRelu));
+		nn.add_layer(new max_pooling_layer(2, 2, 2, 2));
+		nn.add_layer(new output_layer(cOutput_n, lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax));
+		return nn;
+	}
+
+	network create_cnn_global_avg_pool()
+	{
+		network nn;
+		nn.add_layer(new input_layer(cInput_w, cInput_h, cInput_d));
+		nn.add_layer(new convolutional_layer(3, 3, 1, 4, 1, 1, padding_type::eValid, activation_type::eSigmod));
+		nn.add_layer(new max_pooling_layer(2, 2, 2, 2));
+		nn.add_layer(new convolutional_layer(1, 1, 4, 8, 1, 1, padding_type::eValid, activation_type::eRelu));
+		nn.add_layer(new global_avg_pooling_layer());
+		nn.add_layer(new output_layer(cOutput_n, lossfunc_type::eSoftMax_LogLikelihood, activation_type::eSoftMax));
+		return nn;
+	}
+
 };
 
 }